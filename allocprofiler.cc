@@ -0,0 +1,180 @@
+#include "allocprofiler.hh"
+#include "ast.hh"
+#include <algorithm>
+#include <map>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+#include <stdio.h>
+
+namespace {
+/**
+ * The estimated allocations at a single site.
+ */
+struct SiteStats
+{
+	/**
+	 * The estimated number of bytes allocated.
+	 */
+	uint64_t bytes = 0;
+	/**
+	 * The estimated number of objects allocated.
+	 */
+	double count = 0;
+};
+/**
+ * An allocation site: the source file, line and kind of object allocated.
+ * File names are compared by pointer, which is enough because each file's
+ * statements share a single copy of its name.
+ */
+typedef std::tuple<const char*, int, std::string> Site;
+/**
+ * The samples recorded for each allocation site.
+ */
+std::map<Site, SiteStats> sites;
+/**
+ * Are allocation sites being recorded in `objectSites`?
+ */
+bool trackingSites;
+/**
+ * The allocation site of each object allocated while the profiler has been
+ * active, as a source file and line.  Only recorded when heap snapshots are
+ * requested.  Entries are not removed when objects are collected, but every
+ * allocation replaces the entry for its address, so lookups for live objects
+ * are always correct, and each heap snapshot removes the entries for objects
+ * that it didn't find.
+ */
+std::unordered_map<const void*, std::pair<const char*, int>> objectSites;
+/**
+ * The number of bytes between samples, or 0 if samples are not being taken.
+ */
+int64_t sampleInterval;
+/**
+ * The number of bytes that may be allocated before the next sample is taken.
+ */
+int64_t bytesUntilSample;
+/**
+ * The total number of bytes reported to the profiler.
+ */
+uint64_t totalBytes;
+/**
+ * The total number of allocations reported to the profiler.
+ */
+uint64_t totalCount;
+
+/**
+ * Print the `topN` sites with the largest value of `key`.
+ */
+template<typename Key>
+void printTop(std::vector<std::pair<Site, SiteStats>> &all, size_t topN,
+              const char *title, Key key)
+{
+	std::sort(all.begin(), all.end(),
+		[&](const std::pair<Site, SiteStats> &a,
+		    const std::pair<Site, SiteStats> &b)
+		{
+			return key(a.second) > key(b.second);
+		});
+	fprintf(stderr, "Top allocation sites by %s:\n", title);
+	fprintf(stderr, "%-40s %-20s %14s %14s\n", "Location", "Kind", "Bytes",
+			"Objects");
+	for (size_t i=0 ; i<std::min(topN, all.size()) ; i++)
+	{
+		const char *file = std::get<0>(all[i].first);
+		int line = std::get<1>(all[i].first);
+		std::string location(file ? file : "<repl>");
+		location += ':';
+		location += line ? std::to_string(line) : "?";
+		fprintf(stderr, "%-40s %-20s %14llu %14.0f\n", location.c_str(),
+				std::get<2>(all[i].first).c_str(),
+				(unsigned long long)all[i].second.bytes, all[i].second.count);
+	}
+}
+}
+
+namespace AllocProfiler
+{
+bool active;
+AST::Statement *currentStatement;
+
+void start(size_t sampleBytes, bool trackSites)
+{
+	trackingSites = trackSites;
+	sampleInterval = sampleBytes;
+	bytesUntilSample = sampleInterval;
+	active = true;
+}
+
+void recordAllocation(const void *obj, size_t size, const char *kind)
+{
+	AST::Statement *s = currentStatement;
+	if (trackingSites)
+	{
+		objectSites[obj] = std::make_pair(s ? s->sourceFile : nullptr,
+				s ? s->sourceLine : 0);
+	}
+	totalBytes += size;
+	totalCount++;
+	if (sampleInterval == 0)
+	{
+		return;
+	}
+	bytesUntilSample -= size;
+	if (bytesUntilSample > 0)
+	{
+		return;
+	}
+	// This allocation crossed one or more sample points, so it stands for all
+	// of the bytes allocated since the last sample.  Objects that are larger
+	// than the interval are recorded once per interval that they span.
+	int64_t samples = 1 + (-bytesUntilSample / sampleInterval);
+	bytesUntilSample += samples * sampleInterval;
+	int64_t bytes = samples * sampleInterval;
+	Site site(s ? s->sourceFile : nullptr, s ? s->sourceLine : 0,
+			kind ? kind : "?");
+	SiteStats &stats = sites[site];
+	stats.bytes += bytes;
+	stats.count += (double)bytes / (double)std::max<size_t>(size, 1);
+}
+
+bool siteOf(const void *obj, const char *&file, int &line)
+{
+	auto I = objectSites.find(obj);
+	if (I == objectSites.end())
+	{
+		return false;
+	}
+	file = I->second.first;
+	line = I->second.second;
+	return true;
+}
+
+void pruneSites(const std::unordered_set<const void*> &live)
+{
+	for (auto I=objectSites.begin(), E=objectSites.end() ; I!=E ;)
+	{
+		if (live.count(I->first))
+		{
+			++I;
+		}
+		else
+		{
+			I = objectSites.erase(I);
+		}
+	}
+}
+
+void report(size_t topN)
+{
+	active = false;
+	std::vector<std::pair<Site, SiteStats>> all(sites.begin(), sites.end());
+	fprintf(stderr, "Allocated %llu objects (%llu bytes), sampled every %lld "
+			"bytes.\n", (unsigned long long)totalCount,
+			(unsigned long long)totalBytes, (long long)sampleInterval);
+	printTop(all, topN, "bytes",
+			[](const SiteStats &s) { return (double)s.bytes; });
+	printTop(all, topN, "count",
+			[](const SiteStats &s) { return s.count; });
+}
+}
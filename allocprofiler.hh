@@ -0,0 +1,65 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <unordered_set>
+
+namespace AST
+{
+	struct Statement;
+}
+
+/**
+ * A sampling allocation profiler.  Every allocation of a MysoreScript object is
+ * reported to the profiler while it is active, and approximately one sample is
+ * taken for every fixed number of bytes allocated.  Each sample is attributed
+ * to the source location of the statement that was executing and the kind of
+ * object that was allocated, so that GC pressure can be traced back to the
+ * code that causes it.
+ *
+ * When heap snapshots are requested, the profiler also remembers the
+ * allocation site of every object allocated while it is active, so that
+ * snapshots can attribute live objects to the code that created them.
+ */
+namespace AllocProfiler
+{
+	/**
+	 * Is the allocation profiler running?  The compiler only inserts the code
+	 * that tracks the current statement into functions that are compiled
+	 * while this is set.
+	 */
+	extern bool active;
+	/**
+	 * The statement that is currently executing.  This is updated by the
+	 * interpreter and by compiled code while the profiler is active.
+	 */
+	extern AST::Statement *currentStatement;
+	/**
+	 * Start profiling, taking a sample approximately once for every
+	 * `sampleBytes` bytes allocated.  If `sampleBytes` is 1 then every
+	 * allocation is recorded.  If it is 0 then no samples are taken.  The
+	 * allocation site of each object is only recorded if `trackSites` is set.
+	 */
+	void start(size_t sampleBytes, bool trackSites);
+	/**
+	 * Record that `obj`, an object of `size` bytes of the named kind, has just
+	 * been allocated.  The kind is usually a class name.
+	 */
+	void recordAllocation(const void *obj, size_t size, const char *kind);
+	/**
+	 * Look up the source location of the statement that allocated `obj`.
+	 * Returns false if the object was allocated while the profiler was not
+	 * active.  The file name is null for code entered at the REPL.
+	 */
+	bool siteOf(const void *obj, const char *&file, int &line);
+	/**
+	 * Forget the allocation sites of all objects except the ones in `live`.
+	 * Heap snapshots call this after walking the heap, so that the sites of
+	 * collected objects don't accumulate.
+	 */
+	void pruneSites(const std::unordered_set<const void*> &live);
+	/**
+	 * Stop profiling and print the allocation sites that allocated the most
+	 * bytes and the most objects to the standard error stream.
+	 */
+	void report(size_t topN=20);
+}
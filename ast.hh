@@ -1,6 +1,8 @@
+#pragma once
 #include "Pegmatite/ast.hh"
 #include "runtime.hh"
 #include "interpreter.hh"
+#include "stats.hh"
 #include <unordered_set>
 
 namespace Compiler
@@ -19,6 +21,12 @@ namespace AST
 	using pegmatite::ASTList;
 	using MysoreScript::Obj;
 
+	/**
+	 * The file that the parser on the current thread is reading, or null if
+	 * it is not reading a file.  Statements record this as they are built.
+	 */
+	extern thread_local const char *currentSourceFile;
+
 	/**
 	 * The abstract superclass for all statements.
 	 */
@@ -40,6 +48,35 @@ namespace AST
 		 */
 		virtual void collectVarUses(std::unordered_set<std::string> &decls,
 		                            std::unordered_set<std::string> &uses) = 0;
+		/**
+		 * The line in the source file where this statement starts.
+		 */
+		int sourceLine = 0;
+		/**
+		 * The file that this statement was read from, or null if it was not
+		 * read from a file.
+		 */
+		const char *sourceFile = nullptr;
+		/**
+		 * The column in the source file where this statement starts.
+		 */
+		int sourceColumn = 0;
+		/**
+		 * The number of times that this statement has been executed.  Only
+		 * updated if the heatmap is enabled.
+		 */
+		uint64_t hits = 0;
+		/**
+		 * Construct the statement, recording where it appears in the source.
+		 */
+		void construct(const pegmatite::InputRange &r,
+		               pegmatite::ASTStack &st) override
+		{
+			sourceLine = r.start.line;
+			sourceColumn = r.start.col;
+			sourceFile = currentSourceFile;
+			pegmatite::ASTContainer::construct(r, st);
+		}
 	};
 
 	/**
@@ -188,6 +225,11 @@ namespace AST
 		{
 			return;
 		}
+		/**
+		 * Returns the characters in the string, with escapes already
+		 * expanded.
+		 */
+		const std::string &getValue() const { return value; }
 		private:
 		/**
 		 * The value of the string.
@@ -528,6 +570,50 @@ namespace AST
 		                    Obj self,
 		                    MysoreScript::Selector sel,
 		                    Obj *args);
+		/**
+		 * The name of the class that this closure is a method of, or null if
+		 * it is not a method.  Set when the class is constructed.
+		 */
+		const char *ownerClass = nullptr;
+		/**
+		 * Execution statistics for this closure.  Only updated if statistics
+		 * collection is enabled.
+		 */
+		Stats::FunctionStats stats;
+		/**
+		 * Returns a human-readable name for this closure, for use in profiles
+		 * and symbol tables.  This is the closure name, qualified with the
+		 * class name if it is a method, followed by the source line.
+		 */
+		std::string displayName();
+		/**
+		 * Compile this closure now, rather than after it has been interpreted
+		 * `compileThreshold` times, and make `self` call the compiled code.
+		 * Used when a closure is known to be about to run many times.
+		 * Returns false if it can't be compiled, in which case it is still
+		 * interpreted.
+		 */
+		bool compileNow(Interpreter::Context &c, MysoreScript::Closure *self);
+		/**
+		 * A hash of the declaration's source, ignoring comments and layout.
+		 * Declarations with the same hash have the same name, parameters and
+		 * body, so reloading one can keep the code compiled for the other.
+		 */
+		uint64_t structuralHash = 0;
+		/**
+		 * Record the structural hash as the declaration is parsed.
+		 */
+		void construct(const pegmatite::InputRange &r,
+		               pegmatite::ASTStack &st) override;
+		/**
+		 * The number of bound variables stored in closures created from this
+		 * declaration.
+		 */
+		size_t boundVariableCount()
+		{
+			check();
+			return boundVars.size();
+		}
 		protected:
 		/**
 		 * Evaluate this closure, returning the closure object representing it.
@@ -866,6 +952,13 @@ namespace AST
 		 * methods may be compiled.
 		 */
 		void interpret(Interpreter::Context &c) override;
+		/**
+		 * Replace the methods of an existing class, which has the same
+		 * instance variables, with the ones in this declaration.  Methods
+		 * whose structural hash is unchanged are kept, along with any code
+		 * compiled for them.  Returns the number of methods that were kept.
+		 */
+		size_t reloadInto(MysoreScript::Class *cls);
 		/**
 		 * Classes are not allowed to be declared inside closures, so there is
 		 * never a need to collect their declarations.
@@ -898,4 +991,33 @@ namespace AST
 		void collectVarUses(std::unordered_set<std::string> &decls,
 		                    std::unordered_set<std::string> &uses) {}
 	};
+	/**
+	 * An import statement, which loads another source file as a module.  Each
+	 * module is parsed at most once per process and executed at most once per
+	 * context, no matter how many times it is imported.  Imports are only
+	 * allowed at the top level.
+	 */
+	struct ImportStatement : Statement
+	{
+		/**
+		 * The path of the module to import.  Relative paths are resolved
+		 * against the directory of the importing module.
+		 */
+		ASTPtr<StringLiteral> path;
+		/**
+		 * Load the module, if it has not already been loaded.
+		 */
+		void interpret(Interpreter::Context &c) override;
+		/**
+		 * Imports inside closures are errors.  Report them when the closure
+		 * is compiled, as the interpreter does when it reaches them.
+		 */
+		void compile(Compiler::Context &c) override;
+		/**
+		 * Imports are only permitted at the top level, so they never declare
+		 * or reference variables inside closures.
+		 */
+		void collectVarUses(std::unordered_set<std::string> &decls,
+		                    std::unordered_set<std::string> &uses) {}
+	};
 }
@@ -0,0 +1,163 @@
+#!/usr/bin/env python3
+"""
+Runs the MysoreScript benchmarks and writes the results as JSON.
+
+Each benchmark is run several times.  Each run executes the interpreter
+twice.  The wall-clock time and peak resident set size are measured for the
+first execution, which has no statistics or counters enabled, because
+collecting those slows the program down.  The number of garbage collections
+and the time spent in the JIT are taken from the statistics (-s and -m) output
+of the second.  Extra options can be passed to the interpreter with --args.  If
+they include --perf-counters, then the hardware counter totals for the
+execution phase of the second execution are recorded too, so that, for
+example, TLB misses can be compared with and without --huge-pages.
+
+The benchmarks print their results with dump(), which writes to standard
+error.  The output of the first execution is compared with the benchmark's
+.expected file, and a run that produces the wrong answer is reported as a
+failure, so that a broken benchmark is not timed as if it were valid.
+"""
+
+import argparse
+import glob
+import json
+import os
+import re
+import shlex
+import statistics
+import subprocess
+import sys
+import time
+
+GC_RE = re.compile(r"^GC collections: (\d+)$", re.M)
+COMPILE_RE = re.compile(
+    r"^Compiled (\d+) functions \((\d+) bytes\) in ([0-9.]+) seconds\.$", re.M)
+
+
+def parse_counters(output):
+    """Returns the hardware counter totals for the execution phase."""
+    lines = output.splitlines()
+    for i, line in enumerate(lines):
+        if not line.startswith("Phase "):
+            continue
+        # The counter names contain spaces, so split the header by column:
+        # three fixed columns, one 16-character column per counter, then IPC.
+        names = [line[j:j + 16].strip()
+                 for j in range(30, len(line) - 7, 16)]
+        for row in lines[i + 1:]:
+            fields = row.split()
+            if fields and fields[0] == "Execution":
+                return {name: int(value)
+                        for name, value in zip(names, fields[3:])
+                        if value != "-"}
+    return None
+
+
+# Options that add instrumentation, which are left out of the timed execution.
+# They write reports to standard error, so they would also stop its output
+# from matching the expected results.
+INSTRUMENTATION_ARGS = {"-m", "-s", "-t", "--perf-counters",
+                        "--startup-profile"}
+
+
+def execute(command):
+    """Runs a command and returns its wall time, exit status, peak RSS and
+    output.  Standard output and standard error are both captured, in the
+    order in which they were written."""
+    start = time.monotonic()
+    proc = subprocess.Popen(command,
+                            stdout=subprocess.PIPE,
+                            stderr=subprocess.STDOUT)
+    output = proc.stdout.read().decode("utf-8", "replace")
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall = time.monotonic() - start
+    if os.WIFSIGNALED(status):
+        returncode = -os.WTERMSIG(status)
+    else:
+        returncode = os.WEXITSTATUS(status)
+    # ru_maxrss is in kilobytes on Linux and FreeBSD.
+    return wall, returncode, usage.ru_maxrss * 1024, output
+
+
+def run_once(binary, benchmark, expected, extra_args):
+    timed_args = [a for a in extra_args if a not in INSTRUMENTATION_ARGS]
+    wall, status, rss, output = execute([binary] + timed_args +
+                                        ["-f", benchmark])
+    result = {
+        "wall_seconds": wall,
+        "max_rss_bytes": rss,
+        "exit_status": status,
+        "output_correct": output == expected,
+    }
+    if output != expected:
+        result["output"] = output
+    _, status, _, output = execute([binary, "-m", "-s"] + extra_args +
+                                   ["-f", benchmark])
+    if status != 0:
+        result["exit_status"] = status
+    gc = GC_RE.search(output)
+    if gc:
+        result["gc_count"] = int(gc.group(1))
+    compiled = COMPILE_RE.search(output)
+    if compiled:
+        result["compiled_functions"] = int(compiled.group(1))
+        result["code_bytes"] = int(compiled.group(2))
+        result["compile_seconds"] = float(compiled.group(3))
+        if result["compiled_functions"]:
+            result["compile_ms_per_function"] = (
+                result["compile_seconds"] * 1000 /
+                result["compiled_functions"])
+    counters = parse_counters(output)
+    if counters:
+        result["execution_counters"] = counters
+    return result
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.strip())
+    parser.add_argument("--binary", required=True,
+                        help="path to the mysorescript executable")
+    parser.add_argument("--runs", type=int, default=5,
+                        help="number of times to run each benchmark")
+    parser.add_argument("--output", default="bench.json",
+                        help="file to write the JSON results to")
+    parser.add_argument("--args", default="",
+                        help="extra options to pass to mysorescript")
+    parser.add_argument("benchmarks", nargs="*",
+                        help="benchmarks to run (default: all)")
+    args = parser.parse_args()
+
+    names = args.benchmarks or sorted(
+        os.path.splitext(os.path.basename(f))[0]
+        for f in glob.glob(os.path.join(here, "*.ms")))
+    results = {}
+    failed = False
+    for name in names:
+        path = os.path.join(here, name + ".ms")
+        with open(os.path.join(here, name + ".expected")) as f:
+            expected = f.read()
+        runs = [run_once(args.binary, path, expected, shlex.split(args.args))
+                for _ in range(args.runs)]
+        walls = [r["wall_seconds"] for r in runs]
+        results[name] = {
+            "runs": runs,
+            "median_wall_seconds": statistics.median(walls),
+            "min_wall_seconds": min(walls),
+        }
+        wrong = sum(not r["output_correct"] for r in runs)
+        if wrong or any(r["exit_status"] != 0 for r in runs):
+            failed = True
+        print("%-16s %8.3fs (median of %d)%s" %
+              (name, statistics.median(walls), len(runs),
+               "  WRONG OUTPUT in %d runs" % wrong if wrong else ""))
+    with open(args.output, "w") as out:
+        json.dump({"binary": os.path.abspath(args.binary),
+                   "args": args.args,
+                   "benchmarks": results}, out, indent=2)
+    print("Results written to", args.output)
+    return 1 if failed else 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
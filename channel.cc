@@ -0,0 +1,103 @@
+#include "channel.hh"
+#include <new>
+
+using MysoreScript::Obj;
+
+namespace Channel
+{
+/**
+ * A ring buffer of values.
+ */
+struct Queue
+{
+	/**
+	 * The number of values that the buffer can hold.
+	 */
+	size_t capacity;
+	/**
+	 * The index of the oldest value.
+	 */
+	size_t head;
+	/**
+	 * The number of values in the buffer.
+	 */
+	size_t count;
+	/**
+	 * Set when the queue is closed.
+	 */
+	bool   closed;
+	/**
+	 * The values.
+	 */
+	Obj    values[0];
+};
+
+Queue *create(size_t capacity)
+{
+	if (capacity > MaxCapacity)
+	{
+		return nullptr;
+	}
+	Queue *q = gcAlloc<Queue>(capacity * sizeof(Obj), "Channel");
+	if (!q)
+	{
+		return nullptr;
+	}
+	new (q) Queue();
+	q->capacity = capacity;
+	return q;
+}
+
+size_t capacity(Queue *q)
+{
+	return q->capacity;
+}
+
+bool send(Queue *q, Obj value)
+{
+	if (!value || q->closed || (q->count == q->capacity))
+	{
+		return false;
+	}
+	q->values[(q->head + q->count) % q->capacity] = value;
+	q->count++;
+	return true;
+}
+
+Obj receive(Queue *q)
+{
+	if (q->count == 0)
+	{
+		return nullptr;
+	}
+	Obj value = q->values[q->head];
+	// Don't keep the value alive after it has been received.
+	q->values[q->head] = nullptr;
+	q->head = (q->head + 1) % q->capacity;
+	q->count--;
+	return value;
+}
+
+size_t receiveMany(Queue *q, Obj *values, size_t max)
+{
+	size_t count = 0;
+	while ((count < max) && (values[count] = receive(q)))
+	{
+		count++;
+	}
+	return count;
+}
+
+void close(Queue *q)
+{
+	q->closed = true;
+}
+
+void forEachValue(Queue *q, const std::function<void(Obj)> &fn)
+{
+	for (size_t i=0 ; i<q->count ; i++)
+	{
+		fn(q->values[(q->head + i) % q->capacity]);
+	}
+}
+}
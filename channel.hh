@@ -0,0 +1,58 @@
+#pragma once
+#include <functional>
+#include "runtime.hh"
+
+/**
+ * Channels are bounded queues of values.  MysoreScript programs run on a
+ * single thread, so channels pass values between generators and event loop
+ * callbacks on that thread.  Nothing else can run while an operation waits,
+ * so no operation ever waits: sending to a full queue and receiving from an
+ * empty one fail immediately.  Queues are not safe to use from several
+ * threads.
+ */
+namespace Channel
+{
+	/**
+	 * A channel's queue.  Queues are allocated in the garbage-collected heap,
+	 * so that the collector sees the values in them.
+	 */
+	struct Queue;
+	/**
+	 * The largest capacity that a queue can have.
+	 */
+	const size_t MaxCapacity = 1 << 24;
+	/**
+	 * Create a queue with room for `capacity` values.  Returns null if the
+	 * capacity is more than `MaxCapacity` or the queue can't be allocated.
+	 */
+	Queue *create(size_t capacity);
+	/**
+	 * Returns the number of values that the queue can hold.
+	 */
+	size_t capacity(Queue *q);
+	/**
+	 * Send a value.  Returns false if the queue is full or closed.  Null
+	 * values can't be sent.
+	 */
+	bool send(Queue *q, MysoreScript::Obj value);
+	/**
+	 * Receive a value.  Returns null if the queue is empty.
+	 */
+	MysoreScript::Obj receive(Queue *q);
+	/**
+	 * Receive up to `max` values into `values`.  Returns the number of values
+	 * received, which is zero if the queue is empty.
+	 */
+	size_t receiveMany(Queue *q, MysoreScript::Obj *values, size_t max);
+	/**
+	 * Close the queue.  Values that have already been sent can still be
+	 * received, but no more can be sent.
+	 */
+	void close(Queue *q);
+	/**
+	 * Call `fn` with each value that is waiting in the queue, oldest first.
+	 * Used to find the objects that a channel keeps alive for heap snapshots.
+	 */
+	void forEachValue(Queue *q,
+	                  const std::function<void(MysoreScript::Obj)> &fn);
+}
@@ -0,0 +1,209 @@
+#include "codearena.hh"
+#include "hugepages.hh"
+#include <algorithm>
+#include <llvm/ExecutionEngine/JITMemoryManager.h>
+#include <llvm/Support/ErrorHandling.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+
+using namespace llvm;
+
+namespace {
+/**
+ * Round `v` up to a multiple of `align`, which must be a power of two.
+ */
+uintptr_t alignUp(uintptr_t v, uintptr_t align)
+{
+	return (v + align - 1) & ~(align - 1);
+}
+/**
+ * A memory manager that allocates code upwards from just after the stub space
+ * at the start of a single reserved region, stubs downwards from the start of
+ * the code and everything else downwards from the end of the region.  Nothing
+ * is ever freed, except a function body that the JIT abandons because it
+ * didn't fit in the space that it was given.
+ */
+class Arena : public JITMemoryManager
+{
+	/**
+	 * The start of the region, which is the lower limit for stubs.
+	 */
+	uintptr_t base;
+	/**
+	 * The start of the stubs allocated so far.  Stubs are allocated
+	 * downwards, towards the start of the region.
+	 */
+	uintptr_t stubBottom;
+	/**
+	 * The end of the code allocated so far.
+	 */
+	uintptr_t codeTop;
+	/**
+	 * The start of the data allocated so far.  Data is allocated downwards.
+	 */
+	uintptr_t dataBottom;
+	/**
+	 * The end of the space given to the function that is being emitted.
+	 * Data can't be allocated below this, because the JIT may still write
+	 * code anywhere up to it.
+	 */
+	uintptr_t codeLimit;
+	/**
+	 * The start of the function that was most recently started.
+	 */
+	uintptr_t functionStart = 0;
+	/**
+	 * The global offset table, if the target needs one.
+	 */
+	uint8_t *GOTBase = nullptr;
+	/**
+	 * The minimum amount of space to give each function, in bytes.  The JIT
+	 * doesn't know how large a function will be before emitting it, and
+	 * must start again if it runs out of space.
+	 */
+	static const uintptr_t MinFunctionSpace = 64 * 1024;
+	/**
+	 * Allocate code.
+	 */
+	uint8_t *allocateCode(uintptr_t size, unsigned alignment)
+	{
+		uintptr_t start = alignUp(codeTop, std::max(alignment, 16U));
+		if (start + size > dataBottom)
+		{
+			report_fatal_error("JIT code arena exhausted");
+		}
+		codeTop = start + size;
+		codeLimit = std::max(codeLimit, codeTop);
+		return (uint8_t*)start;
+	}
+	/**
+	 * Allocate stubs, constants or globals.
+	 */
+	uint8_t *allocateData(uintptr_t size, unsigned alignment)
+	{
+		uintptr_t start = (dataBottom - size) &
+			~(uintptr_t)(std::max(alignment, 1U) - 1);
+		if ((start < codeLimit) || (start > dataBottom))
+		{
+			report_fatal_error("JIT code arena exhausted");
+		}
+		dataBottom = start;
+		return (uint8_t*)start;
+	}
+	public:
+	Arena(uint8_t *start, size_t size) :
+		base((uintptr_t)start),
+		stubBottom((uintptr_t)start + CodeArena::StubSpace),
+		codeTop(stubBottom),
+		dataBottom((uintptr_t)start + size),
+		codeLimit(stubBottom) {}
+	void setMemoryWritable() override {}
+	void setMemoryExecutable() override {}
+	void setPoisonMemory(bool) override {}
+	void AllocateGOT() override
+	{
+		// The same size of table as LLVM's default memory manager.
+		const size_t GOTSize = 8192 * sizeof(void*);
+		GOTBase = allocateData(GOTSize, sizeof(void*));
+		memset(GOTBase, 0, GOTSize);
+		HasGOT = true;
+	}
+	uint8_t *getGOTBase() const override
+	{
+		return GOTBase;
+	}
+	uint8_t *startFunctionBody(const Function *,
+	                           uintptr_t &ActualSize) override
+	{
+		functionStart = alignUp(codeTop, 16);
+		uintptr_t space = std::min(std::max<uintptr_t>(ActualSize,
+					MinFunctionSpace), dataBottom - functionStart);
+		codeLimit = functionStart + space;
+		ActualSize = space;
+		return (uint8_t*)functionStart;
+	}
+	void endFunctionBody(const Function *, uint8_t *,
+	                     uint8_t *FunctionEnd) override
+	{
+		codeTop = (uintptr_t)FunctionEnd;
+		codeLimit = codeTop;
+	}
+	void deallocateFunctionBody(void *Body) override
+	{
+		// The JIT abandons a function body and tries again with more space if
+		// the first attempt doesn't fit.  Reuse the space in that case.
+		// Functions that are compiled successfully are never freed.
+		if ((uintptr_t)Body == functionStart)
+		{
+			codeTop = codeLimit = functionStart;
+		}
+	}
+	uint8_t *allocateStub(const GlobalValue *, unsigned StubSize,
+	                      unsigned Alignment) override
+	{
+		uintptr_t start = (stubBottom - StubSize) &
+			~(uintptr_t)(std::max(Alignment, 1U) - 1);
+		if ((start < base) || (start > stubBottom))
+		{
+			return allocateData(StubSize, Alignment);
+		}
+		stubBottom = start;
+		return (uint8_t*)start;
+	}
+	uint8_t *allocateSpace(intptr_t Size, unsigned Alignment) override
+	{
+		return allocateData(Size, Alignment);
+	}
+	uint8_t *allocateGlobal(uintptr_t Size, unsigned Alignment) override
+	{
+		return allocateData(Size, Alignment);
+	}
+	uint8_t *allocateCodeSection(uintptr_t Size, unsigned Alignment,
+	                             unsigned, StringRef) override
+	{
+		return allocateCode(Size, Alignment);
+	}
+	uint8_t *allocateDataSection(uintptr_t Size, unsigned Alignment,
+	                             unsigned, StringRef, bool) override
+	{
+		return allocateData(Size, Alignment);
+	}
+	bool finalizeMemory(std::string *) override
+	{
+		return false;
+	}
+};
+}
+
+namespace CodeArena
+{
+JITMemoryManager *create(bool hugePages)
+{
+	// Reserve an extra huge page so that the start can be aligned.
+	size_t mapSize = ReservedSize + HugePages::HugePageSize;
+	void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE | PROT_EXEC,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	uintptr_t start = alignUp((uintptr_t)map, HugePages::HugePageSize);
+	// Give back the unaligned space on either side.
+	if (start > (uintptr_t)map)
+	{
+		munmap(map, start - (uintptr_t)map);
+	}
+	uintptr_t end = start + ReservedSize;
+	uintptr_t mapEnd = (uintptr_t)map + mapSize;
+	if (mapEnd > end)
+	{
+		munmap((void*)end, mapEnd - end);
+	}
+	if (hugePages)
+	{
+		HugePages::advise((void*)start, ReservedSize);
+	}
+	return new Arena((uint8_t*)start, ReservedSize);
+}
+}
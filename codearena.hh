@@ -0,0 +1,48 @@
+#pragma once
+#include <stddef.h>
+
+namespace llvm
+{
+	class JITMemoryManager;
+}
+
+/**
+ * The memory that the JIT places compiled code in.  LLVM's default memory
+ * manager allocates code in small slabs scattered around the address space.
+ * The code arena instead reserves one large, huge-page-aligned region and
+ * allocates code contiguously, in the order that functions are compiled.
+ * Functions are compiled when they become hot, so this keeps the hot code
+ * together and lets it be covered by a few TLB entries.
+ *
+ * The region is divided into three parts.  The first `StubSpace` bytes hold
+ * the stubs that compiled code calls runtime functions through, allocated
+ * downwards from `base + StubSpace` so that the most recent ones share pages
+ * with the code.  Code is allocated upwards from there.  Constant data,
+ * globals and any stubs that don't fit in the stub space are allocated
+ * downwards from the end of the region, so they don't dilute the code.
+ *
+ * Nothing in the arena is ever freed, so it limits the total amount of code
+ * and data that a process can compile to `ReservedSize`.  When code meets
+ * data, the JIT can't continue and the process aborts with
+ * `report_fatal_error("JIT code arena exhausted")`.
+ */
+namespace CodeArena
+{
+	/**
+	 * The amount of address space reserved for the arena, which is the most
+	 * code and data that can be compiled in one process.  Pages are only
+	 * allocated when they are used.
+	 */
+	const size_t ReservedSize = 256 * 1024 * 1024;
+	/**
+	 * The amount of space at the start of the arena that is set aside for
+	 * stubs.  If this fills up, then stubs are allocated with the data.
+	 */
+	const size_t StubSpace = 1024 * 1024;
+	/**
+	 * Create a memory manager that allocates from a new arena.  If
+	 * `hugePages` is set, then the kernel is asked to back the arena with
+	 * huge pages.  Returns null if the address space can't be reserved.
+	 */
+	llvm::JITMemoryManager *create(bool hugePages);
+}
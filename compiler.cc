@@ -1,10 +1,34 @@
+#include <algorithm>
+#include <chrono>
 #include <functional>
 #include "interpreter.hh"
 #include "compiler.hh"
 #include "ast.hh"
+#include "allocprofiler.hh"
+#include "codearena.hh"
+#include "heatmap.hh"
+#include "hugepages.hh"
+#include "perfcounters.hh"
+#include "perfmap.hh"
+#include "profiler.hh"
+#include "safepoint.hh"
+#include "startup.hh"
+#include "stats.hh"
+#include "trace.hh"
 #include <llvm/ExecutionEngine/ExecutionEngine.h>
+#include <llvm/ExecutionEngine/JITEventListener.h>
 #include <llvm/Transforms/IPO/PassManagerBuilder.h>
 #include <llvm/IR/LegacyPassManager.h>
+#include <llvm/IR/DiagnosticInfo.h>
+#include <llvm/IR/DiagnosticPrinter.h>
+#include <llvm/IR/MDBuilder.h>
+#include <llvm/Support/CommandLine.h>
+#include <llvm/Support/DynamicLibrary.h>
+#include <llvm/Support/ManagedStatic.h>
+#include <llvm/Support/raw_ostream.h>
+#include <llvm/Transforms/Scalar.h>
+#include <errno.h>
+#include <sys/stat.h>
 
 using namespace llvm;
 using llvm::legacy::PassManager;
@@ -26,6 +50,15 @@ Value *staticAddress(Compiler::Context &c, T *ptr, Type *ty)
 {
 	return c.B.CreateIntToPtr(ConstantInt::get(c.ObjIntTy, (uintptr_t)ptr), ty);
 }
+/**
+ * Insert code that increments a 64-bit counter at a fixed address.
+ */
+void incrementCounter(Compiler::Context &c, uint64_t *counter)
+{
+	Value *addr = staticAddress(c, counter, c.ObjIntTy->getPointerTo());
+	c.B.CreateStore(c.B.CreateAdd(c.B.CreateLoad(addr),
+				ConstantInt::get(c.ObjIntTy, 1)), addr);
+}
 /**
  * Generate a small integer object from an integer value.
  */
@@ -66,6 +99,185 @@ Value *getAsSmallInt(Compiler::Context &c, Value *i)
 	}
 	return c.B.CreateBitCast(i, c.ObjIntTy);
 }
+/**
+ * Listener that the JIT notifies whenever it emits a function.  This informs
+ * the parts of MysoreScript that need to know where compiled code lives.
+ */
+class EmittedCodeListener : public JITEventListener
+{
+	void NotifyFunctionEmitted(const Function &F, void *Code, size_t Size,
+	                           const EmittedFunctionDetails &) override
+	{
+		lastSize = Size;
+		Profiler::registerCompiledCode(Code, Size);
+		PerfMap::recordFunction(F.getName().str().c_str(), Code, Size);
+	}
+	public:
+	/**
+	 * The size of the most recently emitted function.
+	 */
+	size_t lastSize = 0;
+} emittedCodeListener;
+/**
+ * The directory that IR and remarks are written to, if any.
+ */
+std::string dumpDirectory;
+/**
+ * The number of functions that have been dumped.  Used to give each one a
+ * unique file name prefix, because several functions may share a name.
+ */
+unsigned dumpCount;
+/**
+ * The stream that optimisation remarks are written to while compiling.
+ */
+raw_ostream *remarks;
+/**
+ * Diagnostic handler that writes optimisation remarks for the function being
+ * compiled into its remarks file.
+ */
+void remarkHandler(const DiagnosticInfo &DI, void *)
+{
+	raw_ostream &os = remarks ? *remarks : errs();
+	DiagnosticPrinterRawOStream printer(os);
+	DI.print(printer);
+	os << '\n';
+}
+/**
+ * Write the module to the named file in the dump directory.
+ */
+void dumpModule(Module &M, const std::string &file)
+{
+	std::string err;
+	raw_fd_ostream out((dumpDirectory + '/' + file).c_str(), err,
+			sys::fs::F_Text);
+	if (!err.empty())
+	{
+		fprintf(stderr, "ERROR: unable to write %s: %s\n", file.c_str(),
+				err.c_str());
+		return;
+	}
+	M.print(out, nullptr);
+}
+/**
+ * Initialise the parts of LLVM that the JIT needs.  This is deferred until the
+ * first function is compiled, because many short-running scripts never get
+ * that far, and is only done once.
+ */
+void initialiseLLVM()
+{
+	static bool initialised;
+	if (initialised)
+	{
+		return;
+	}
+	auto start = std::chrono::steady_clock::now();
+	LLVMInitializeNativeTarget();
+	// This does nothing, it just ensures that the JIT is not removed by the
+	// linker.
+	LLVMLinkInJIT();
+	initialised = true;
+	Startup::deferred("LLVM initialisation", Stats::secondsSince(start));
+}
+/**
+ * The execution engine that owns all of the compiled code.  This is created
+ * when the first function is compiled, and the module for each subsequent
+ * function is added to it, so the target machine and the rest of the JIT's
+ * state are only set up once.
+ */
+ExecutionEngine *executionEngine;
+/**
+ * The optimisation pipeline.  This is built on first use and then run on the
+ * module for every function that is compiled.
+ */
+PassManager *optimiser;
+/**
+ * The addresses of the external functions that compiled code calls, indexed
+ * by name.  Every module declares the runtime functions that it uses, and
+ * looking them up in the symbol table each time is a measurable part of the
+ * cost of compiling a small function.
+ */
+std::unordered_map<std::string, void*> externalFunctions;
+/**
+ * Returns the optimisation pipeline, constructing it if necessary.
+ */
+PassManager &getOptimiser()
+{
+	if (!optimiser)
+	{
+		optimiser = new PassManager();
+		PassManagerBuilder Builder;
+		Builder.OptLevel = 2;
+		// These are the passes that a per-function pass manager would run
+		// before the module passes.  Pass managers for functions are tied to
+		// a single module, so add them to the module pipeline instead.
+		optimiser->add(createSROAPass());
+		optimiser->add(createEarlyCSEPass());
+		Builder.populateModulePassManager(*optimiser);
+	}
+	return *optimiser;
+}
+/**
+ * Add a module to the execution engine, creating the engine if this is the
+ * first module.  Returns false and reports an error if the engine can't be
+ * created.
+ */
+bool addToExecutionEngine(Module &M)
+{
+	if (executionEngine)
+	{
+		executionEngine->addModule(&M);
+		return true;
+	}
+	std::string err;
+	EngineBuilder EB(&M);
+	EB.setEngineKind(EngineKind::JIT).setErrorStr(&err);
+	// Put all of the compiled code in one contiguous arena.  If the address
+	// space can't be reserved, fall back to LLVM's own memory manager.
+	if (JITMemoryManager *arena = CodeArena::create(HugePages::enabled))
+	{
+		EB.setJITMemoryManager(arena);
+	}
+	executionEngine = EB.create();
+	if (!executionEngine)
+	{
+		fprintf(stderr, "Failed to construct Execution Engine: %s\n",
+				err.c_str());
+		return false;
+	}
+	executionEngine->RegisterJITEventListener(&emittedCodeListener);
+	return true;
+}
+/**
+ * Tell the execution engine where each external function declared in the
+ * module lives, looking up each name only once.
+ *
+ * The declarations themselves can't be shared between compiles: an LLVM
+ * function declaration belongs to one module, and each compile has its own
+ * module, so every module declares the runtime functions that it calls.
+ * Creating a declaration is cheap; finding the symbol is not, so only the
+ * address is reused.
+ */
+void resolveExternalFunctions(Module &M)
+{
+	for (Function &decl : M)
+	{
+		if (!decl.isDeclaration() || decl.isIntrinsic())
+		{
+			continue;
+		}
+		void *&addr = externalFunctions[decl.getName().str()];
+		if (!addr)
+		{
+			addr = sys::DynamicLibrary::SearchForAddressOfSymbol(
+					decl.getName().str());
+		}
+		// If the symbol can't be found, let the JIT report the error.
+		if (addr)
+		{
+			executionEngine->addGlobalMapping(&decl, addr);
+		}
+	}
+}
 }
 
 Compiler::Context::Context(Interpreter::SymbolTable &g) :
@@ -77,10 +289,40 @@ Compiler::Context::Context(Interpreter::SymbolTable &g) :
 	ObjIntTy(Type::getInt64Ty(C)),
 	SelTy(Type::getInt32Ty(C))
 {
-	// These functions do nothing, they just ensure that the correct modules
-	// are not removed by the linker.
-	LLVMInitializeNativeTarget();
-	LLVMLinkInJIT();
+	initialiseLLVM();
+}
+
+bool Compiler::dumpTo(const char *dir)
+{
+	if ((mkdir(dir, 0777) != 0) && (errno != EEXIST))
+	{
+		return false;
+	}
+	dumpDirectory = dir;
+	// Ask LLVM's optimisers to report everything that they do and don't do,
+	// and to time each pass.  The timings are printed when LLVM shuts down.
+	std::string timingFile = "-info-output-file=" + dumpDirectory +
+		"/pass-timing.txt";
+	const char *args[] = {
+		"mysorescript",
+		"-pass-remarks=.*",
+		"-pass-remarks-missed=.*",
+		"-pass-remarks-analysis=.*",
+		"-time-passes",
+		timingFile.c_str()
+	};
+	cl::ParseCommandLineOptions(sizeof(args) / sizeof(args[0]), args);
+	getGlobalContext().setDiagnosticHandler(remarkHandler, nullptr, true);
+	return true;
+}
+
+void Compiler::finishDump()
+{
+	if (!dumpDirectory.empty())
+	{
+		// LLVM reports the pass timings when its static state is destroyed.
+		llvm_shutdown();
+	}
 }
 
 Value *Compiler::Context::lookupSymbolAddr(const std::string &str)
@@ -92,56 +334,188 @@ Value *Compiler::Context::lookupSymbolAddr(const std::string &str)
 		return addr;
 	}
 	// If it's in the global symbol table that we inherited from the interpreter
-	// then it's a pointer, so construct an LLVM `Value` of the correct type and
-	// value.
-	if (Obj *global = globalSymbols[str])
+	// then load its address from the current context's slot table.  The
+	// address in the symbol table is only valid in the context that is
+	// compiling this code, but code compiled for a module is shared by every
+	// context that imports it.
+	if (globalSymbols[str])
 	{
-		return staticAddress(*this, global, ObjPtrTy->getPointerTo());
+		Type *slotTy = ObjPtrTy->getPointerTo();
+		Value *table = B.CreateLoad(staticAddress(*this,
+				&Interpreter::currentGlobalSlots,
+				slotTy->getPointerTo()->getPointerTo()));
+		return B.CreateLoad(B.CreateConstGEP1_64(table,
+				Interpreter::globalSlot(str)));
 	}
 	llvm_unreachable("Symbol not found");
 }
 
 ClosureInvoke Compiler::Context::compile()
 {
-	// Construct a couple of pass managers to run the optimisations.
-	FunctionPassManager FPM(&M);
-	PassManager MPM;
-	PassManagerBuilder Builder;
-	Builder.OptLevel = 2;
-	Builder.populateFunctionPassManager(FPM);
-	Builder.populateModulePassManager(MPM);
-
-	// If you want to see the LLVM IR before optimisation, uncomment the
-	// following line:
-	//M.dump();
+	// If we're dumping IR, then write the unoptimised version and collect the
+	// remarks from the optimisers in a file alongside it.
+	std::string dumpName;
+	std::unique_ptr<raw_fd_ostream> remarkFile;
+	if (!dumpDirectory.empty())
+	{
+		dumpName = std::to_string(dumpCount++) + '-' + F->getName().str();
+		std::replace(dumpName.begin(), dumpName.end(), '/', '_');
+		dumpModule(M, dumpName + ".pre.ll");
+		std::string err;
+		remarkFile.reset(new raw_fd_ostream((dumpDirectory + '/' + dumpName +
+					".remarks").c_str(), err, sys::fs::F_Text));
+		remarks = remarkFile.get();
+	}
 
 	// Run the passes to optimise the function / module.
-	FPM.run(*F);
-	MPM.run(M);
+	Trace::Span optimise("jit", "optimisation");
+	getOptimiser().run(M);
+	optimise.end();
 
-	// If you want to see the LLVM IR before optimisation, uncomment the
-	// following line:
-	//M.dump();
+	if (!dumpDirectory.empty())
+	{
+		remarks = nullptr;
+		dumpModule(M, dumpName + ".post.ll");
+	}
 
-	std::string err;
-	EngineBuilder EB(&M);
-	// Construct an execution engine (JIT)
-	ExecutionEngine *EE = EB.setEngineKind(EngineKind::JIT)
-		.setErrorStr(&err)
-		.create();
-	if (!EE)
+	// Hand the module to the shared execution engine, which takes ownership of
+	// it.  The engine owns the memory for all compiled functions, and is never
+	// destroyed.  It would be better to provide our own JIT memory manager to
+	// manage the memory (and allow us to GC the functions if their addresses
+	// don't exist on the stack and they're replaced by specialised versions,
+	// but for now it's fine to just leak)
+	if (!addToExecutionEngine(M))
 	{
-		fprintf(stderr, "Failed to construct Execution Engine: %s\n",
-				err.c_str());
 		return nullptr;
 	}
-	// Use the execution engine to compile the code.  Note that we leave the
-	// ExecutionEngine live here because it owns the memory for the function.
-	// It would be better to provide our own JIT memory manager to manage the
-	// memory (and allow us to GC the functions if their addresses don't exist
-	// on the stack and they're replaced by specialised versions, but for now
-	// it's fine to just leak)
-	return (ClosureInvoke)EE->getPointerToFunction(F);
+	resolveExternalFunctions(M);
+	Trace::Span codegen("jit", "codegen");
+	emittedCodeListener.lastSize = 0;
+	ClosureInvoke fn =
+		(ClosureInvoke)executionEngine->getPointerToFunction(F);
+	codeSize = emittedCodeListener.lastSize;
+	codegen.end();
+	return fn;
+}
+
+void Compiler::Context::emitEntryHooks(ClosureDecl *decl)
+{
+	if (Profiler::active)
+	{
+		profiled = true;
+		Constant *enterFn = M.getOrInsertFunction("mysoreScriptProfilerEnter",
+				Type::getVoidTy(C), ObjPtrTy, nullptr);
+		B.CreateCall(enterFn, staticAddress(*this, decl, ObjPtrTy));
+	}
+	if (Stats::enabled)
+	{
+		// Count calls to the compiled version.  The interpreter counts its own
+		// calls, so compiled code doesn't need to call back into it.
+		incrementCounter(*this, &decl->stats.compiledCalls);
+	}
+	emitSafepointPoll();
+}
+
+Value *Compiler::Context::safepointCountdown()
+{
+	if (countdownAddr)
+	{
+		return countdownAddr;
+	}
+	// On platforms where we know where the thread pointer is, address the
+	// countdown relative to it.  Address space 257 is relative to %fs on
+	// x86.  Anywhere else, ask for the current thread's countdown on entry.
+	intptr_t offset;
+	if (Safepoint::countdownOffset(offset))
+	{
+		countdownAddr = ConstantExpr::getIntToPtr(
+				ConstantInt::get(ObjIntTy, offset), ObjIntTy->getPointerTo(257));
+	}
+	else
+	{
+		Constant *countdownFn = M.getOrInsertFunction(
+				"mysoreScriptSafepointCountdown", ObjIntTy->getPointerTo(),
+				nullptr);
+		countdownAddr = B.CreateCall(countdownFn, "safepoint.countdown.addr");
+	}
+	return countdownAddr;
+}
+
+void Compiler::Context::emitSafepointPoll()
+{
+	// The countdown is a 64-bit atomic, which has the same representation as
+	// a plain integer.  This does the same relaxed load, decrement and store
+	// as `Safepoint::poll()`.
+	Value *countdownAddr = safepointCountdown();
+	LoadInst *countdown = B.CreateLoad(countdownAddr, "safepoint.countdown");
+	countdown->setAlignment(8);
+	countdown->setAtomic(Monotonic);
+	Value *next = B.CreateSub(countdown, ConstantInt::get(ObjIntTy, 1));
+	StoreInst *store = B.CreateStore(next, countdownAddr);
+	store->setAlignment(8);
+	store->setAtomic(Monotonic);
+	BasicBlock *slow = BasicBlock::Create(C, "safepoint", F);
+	BasicBlock *unwind = BasicBlock::Create(C, "safepoint.unwind", F);
+	BasicBlock *cont = BasicBlock::Create(C, "safepoint.cont", F);
+	MDBuilder MDB(C);
+	B.CreateCondBr(B.CreateICmpSLE(next, ConstantInt::get(ObjIntTy, 0)), slow,
+			cont, MDB.createBranchWeights(1, 2000));
+	B.SetInsertPoint(slow);
+	Constant *safepointFn = M.getOrInsertFunction("mysoreScriptSafepoint",
+			Type::getInt32Ty(C), nullptr);
+	if (Function *fn = dyn_cast<Function>(safepointFn))
+	{
+		fn->addFnAttr(Attribute::Cold);
+	}
+	// If the thread is unwinding, return null immediately.  The caller will
+	// do the same at its next poll.
+	Value *unwinding = B.CreateIsNotNull(B.CreateCall(safepointFn));
+	B.CreateCondBr(unwinding, unwind, cont);
+	B.SetInsertPoint(unwind);
+	createRet(ConstantPointerNull::get(ObjPtrTy));
+	B.SetInsertPoint(cont);
+}
+
+void Compiler::Context::emitUnwindCheck(Value *result)
+{
+	// Calls return null while the thread is unwinding, and the countdown is
+	// always expired then, so only ask whether it is unwinding if both are
+	// true.  Plenty of calls return null, but very few of them find the
+	// countdown expired.
+	BasicBlock *isNull = BasicBlock::Create(C, "call.null", F);
+	BasicBlock *expired = BasicBlock::Create(C, "call.expired", F);
+	BasicBlock *unwind = BasicBlock::Create(C, "call.unwind", F);
+	BasicBlock *cont = BasicBlock::Create(C, "call.cont", F);
+	MDBuilder MDB(C);
+	B.CreateCondBr(B.CreateIsNull(result), isNull, cont);
+	B.SetInsertPoint(isNull);
+	LoadInst *countdown = B.CreateLoad(safepointCountdown(),
+			"safepoint.countdown");
+	countdown->setAlignment(8);
+	countdown->setAtomic(Monotonic);
+	B.CreateCondBr(B.CreateICmpSLE(countdown, ConstantInt::get(ObjIntTy, 0)),
+			expired, cont, MDB.createBranchWeights(1, 2000));
+	B.SetInsertPoint(expired);
+	Constant *unwindingFn = M.getOrInsertFunction("mysoreScriptUnwinding",
+			Type::getInt32Ty(C), nullptr);
+	if (Function *fn = dyn_cast<Function>(unwindingFn))
+	{
+		fn->addFnAttr(Attribute::Cold);
+	}
+	B.CreateCondBr(B.CreateIsNotNull(B.CreateCall(unwindingFn)), unwind, cont);
+	B.SetInsertPoint(unwind);
+	createRet(ConstantPointerNull::get(ObjPtrTy));
+	B.SetInsertPoint(cont);
+}
+
+void Compiler::Context::createRet(Value *v)
+{
+	if (profiled)
+	{
+		B.CreateCall(M.getOrInsertFunction("mysoreScriptProfilerExit",
+					Type::getVoidTy(C), nullptr));
+	}
+	B.CreateRet(v);
 }
 
 llvm::FunctionType *Compiler::Context::getMethodType(int ivars, int args)
@@ -155,7 +529,10 @@ llvm::FunctionType *Compiler::Context::getMethodType(int ivars, int args)
 		// isa (actually a class pointer not an object pointer)
 		fields[0] = ObjPtrTy;
 		fields[1] = ArrayType::get(ObjPtrTy, ivars);
-		ObjTy = StructType::create(fields)->getPointerTo();
+		// Use a literal struct type, which LLVM uniques by its fields, so
+		// that every method for objects of the same shape shares one type,
+		// rather than adding a new named type to the context every time.
+		ObjTy = StructType::get(C, fields)->getPointerTo();
 	}
 	// Set up the argument types for the closure invoke function.
 	SmallVector<Type*, 10> paramTypes;
@@ -184,7 +561,7 @@ llvm::FunctionType *Compiler::Context::getClosureType(int bound, int args)
 		fields.push_back(ObjPtrTy);
 		// The array of bound variables.
 		fields.push_back(ArrayType::get(ObjPtrTy, bound));
-		ClosureTy = StructType::create(fields)->getPointerTo();
+		ClosureTy = StructType::get(C, fields)->getPointerTo();
 	}
 	// Set up the argument types for the closure invoke function.
 	SmallVector<Type*, 10> paramTypes;
@@ -197,6 +574,10 @@ llvm::FunctionType *Compiler::Context::getClosureType(int bound, int args)
 CompiledMethod ClosureDecl::compileMethod(Class *cls,
                                           Interpreter::SymbolTable &globalSymbols)
 {
+	auto start = std::chrono::steady_clock::now();
+	Trace::Span span("jit", "compile " + displayName());
+	PerfCounters::Scope counters(PerfCounters::Compile);
+	Trace::Span irgen("jit", "IR generation");
 	auto &params = parameters->arguments.objects();
 	Compiler::Context c(globalSymbols);
 	// Get the type of the method as an LLVM type
@@ -204,7 +585,7 @@ CompiledMethod ClosureDecl::compileMethod(Class *cls,
 			params.size());
 	// Create the LLVM function
 	c.F = Function::Create(ClosureInvokeTy, GlobalValue::ExternalLinkage,
-			"invoke", &c.M);
+			displayName(), &c.M);
 	// Insert the first basic block and store all of the parameters.
 	BasicBlock *entry = BasicBlock::Create(c.C, "entry", c.F);
 	c.B.SetInsertPoint(entry);
@@ -274,9 +655,10 @@ CompiledMethod ClosureDecl::compileMethod(Class *cls,
 			const char *name = cls->indexedIVarNames[i];
 			// Now we do similar arithmetic on the array to get the address of
 			// each instance variable.
-			c.symbols[name] = c.B.CreateStructGEP(iVarsArray, i++, name);
+			c.symbols[name] = c.B.CreateStructGEP(iVarsArray, i, name);
 		}
 	}
+	c.emitEntryHooks(this);
 	// Compile the statements in the method.
 	body->compile(c);
 	// If we hit a return statement, it will clear the insert block, so if there
@@ -285,21 +667,30 @@ CompiledMethod ClosureDecl::compileMethod(Class *cls,
 	if (c.B.GetInsertBlock() != nullptr)
 	{
 		// Return null if there's no explicit return
-		c.B.CreateRet(ConstantPointerNull::get(c.ObjPtrTy));
+		c.createRet(ConstantPointerNull::get(c.ObjPtrTy));
 	}
+	irgen.end();
 	// Generate the compiled code.
-	return (CompiledMethod)c.compile();
+	CompiledMethod fn = (CompiledMethod)c.compile();
+	stats.compileSeconds += Stats::secondsSince(start);
+	stats.codeSize = c.codeSize;
+	return fn;
 }
 
 ClosureInvoke ClosureDecl::compileClosure(Interpreter::SymbolTable &globalSymbols)
 {
+	auto start = std::chrono::steady_clock::now();
+	Trace::Span span("jit", "compile " + displayName());
+	PerfCounters::Scope counters(PerfCounters::Compile);
+	Trace::Span irgen("jit", "IR generation");
 	auto &params = parameters->arguments.objects();
 	Compiler::Context c(globalSymbols);
 	// Get the LLVM type of the closure invoke function
 	FunctionType *ClosureInvokeTy = c.getClosureType(boundVars.size(),
 			params.size());
 	// Create the LLVM function
-	c.F = Function::Create(ClosureInvokeTy, GlobalValue::ExternalLinkage, "invoke", &c.M);
+	c.F = Function::Create(ClosureInvokeTy, GlobalValue::ExternalLinkage,
+			displayName(), &c.M);
 	// Insert the first basic block and store all of the parameters.
 	BasicBlock *entry = BasicBlock::Create(c.C, "entry", c.F);
 	c.B.SetInsertPoint(entry);
@@ -345,12 +736,17 @@ ClosureInvoke ClosureDecl::compileClosure(Interpreter::SymbolTable &globalSymbol
 			c.symbols[bound] = c.B.CreateStructGEP(boundVarsArray, i++, bound);
 		}
 	}
+	c.emitEntryHooks(this);
 	body->compile(c);
 	if (c.B.GetInsertBlock() != nullptr)
 	{
-		c.B.CreateRet(ConstantPointerNull::get(c.ObjPtrTy));
+		c.createRet(ConstantPointerNull::get(c.ObjPtrTy));
 	}
-	return c.compile();
+	irgen.end();
+	ClosureInvoke fn = c.compile();
+	stats.compileSeconds += Stats::secondsSince(start);
+	stats.codeSize = c.codeSize;
+	return fn;
 }
 
 Value *ClosureDecl::compileExpression(Compiler::Context &c)
@@ -362,20 +758,18 @@ Value *ClosureDecl::compileExpression(Compiler::Context &c)
 	FunctionType *invokeTy = c.getClosureType(boundVars.size(), params.size());
 	// Get the type of the first parameter (a pointer to the closure structure)
 	Type *closurePtrTy = invokeTy->getParamType(0);
-	// The size of the closure is the size of `Closure`, which contains all of
-	// the fields shared by all closures, and then space for all of the bound
-	// variables.
-	size_t closureSize = sizeof(struct Closure) + boundVars.size() * sizeof(Obj);
-	// Insert the `GC_malloc` function (provided by libgc) into the module,
-	// bitcast to return a pointer to our closure type.
-	Constant *allocFn = c.M.getOrInsertFunction("GC_malloc", closurePtrTy,
-			c.ObjIntTy, nullptr);
+	// Insert the function that allocates closures into the module, bitcast to
+	// return a pointer to our closure type.  This reports the allocation to
+	// the allocation profiler and charges it to the current allocation
+	// budget, like every other allocation.
+	Constant *allocFn = c.M.getOrInsertFunction("mysoreScriptNewClosure",
+			closurePtrTy, c.ObjIntTy, nullptr);
 	// Allocate GC'd memory for the closure.  Note that it would often be more
 	// efficient to do this on the stack, but only if we can either statically
 	// prove that the closure is not captured by anything that is called or if
 	// we can promote it to the heap if it is.
 	Value *closure = c.B.CreateCall(allocFn, ConstantInt::get(c.ObjIntTy,
-				closureSize));
+				boundVars.size()));
 	// Set the isa pointer to the closure class.
 	c.B.CreateStore(staticAddress(c, &ClosureClass, c.ObjPtrTy),
 			c.B.CreateStructGEP(closure, 0));
@@ -430,6 +824,26 @@ Value *Call::compileExpression(Compiler::Context &c)
 	{
 		args.push_back(getAsObject(c, arg->compileExpression(c)));
 	}
+	// The callee sets the allocation profiler's current statement, so restore
+	// it once the call returns, so that allocations made by the rest of this
+	// statement are attributed to it.
+	Value *statementAddr = nullptr;
+	Value *statement = nullptr;
+	if (AllocProfiler::active)
+	{
+		statementAddr = staticAddress(c, &AllocProfiler::currentStatement,
+				c.ObjPtrTy->getPointerTo());
+		statement = c.B.CreateLoad(statementAddr);
+	}
+	auto finishCall = [&](Value *result)
+	{
+		if (statementAddr)
+		{
+			c.B.CreateStore(statement, statementAddr);
+		}
+		c.emitUnwindCheck(result);
+		return result;
+	};
 	// If there's no method, then we're trying to invoke a closure.
 	if (!method)
 	{
@@ -441,7 +855,7 @@ Value *Call::compileExpression(Compiler::Context &c)
 		Type *Fields[3] =
 			{ c.ObjPtrTy, c.ObjPtrTy, invokeFnTy->getPointerTo() };
 		// Get the type of a pointer to the closure object 
-		Type *closurePtrTy = StructType::create(Fields)->getPointerTo();
+		Type *closurePtrTy = StructType::get(c.C, Fields)->getPointerTo();
 		// Cast the called object to a closure
 		Value *closure = c.B.CreateBitCast(obj, closurePtrTy);
 		// Compute the address of the pointer to the closure invoke function
@@ -449,7 +863,7 @@ Value *Call::compileExpression(Compiler::Context &c)
 		// Load the address of the invoke function
 		invokeFn = c.B.CreateLoad(invokeFn);
 		// Insert the call
-		return c.B.CreateCall(invokeFn, args, "call_closure");
+		return finishCall(c.B.CreateCall(invokeFn, args, "call_closure"));
 	}
 	// If we are invoking a method, then we must first look up the method, then
 	// call it.
@@ -462,7 +876,7 @@ Value *Call::compileExpression(Compiler::Context &c)
 	// that reports an error.
 	Value *methodFn = c.B.CreateCall2(lookupFn, obj, args[1]);
 	// Call the method
-	return c.B.CreateCall(methodFn, args, "call_method");
+	return finishCall(c.B.CreateCall(methodFn, args, "call_method"));
 }
 
 void Statements::compile(Compiler::Context &c)
@@ -475,17 +889,34 @@ void Statements::compile(Compiler::Context &c)
 		{
 			return;
 		}
+		// Let the allocation profiler know which statement is running.
+		if (AllocProfiler::active)
+		{
+			c.B.CreateStore(staticAddress(c, s.get(), c.ObjPtrTy),
+					staticAddress(c, &AllocProfiler::currentStatement,
+						c.ObjPtrTy->getPointerTo()));
+		}
+		// Count executions of this statement.  Every basic block that the
+		// compiler creates for a MysoreScript block starts with one of these.
+		if (Heatmap::enabled)
+		{
+			Heatmap::registerNode(s.get());
+			incrementCounter(c, &s->hits);
+		}
 		s->compile(c);
 	}
 }
 
-
+void ImportStatement::compile(Compiler::Context &c)
+{
+	fprintf(stderr, "\nERROR: import is only allowed at the top level\n");
+}
 
 void Return::compile(Compiler::Context &c)
 {
 	// Insert a return instruction with the correct value
 	Value *ret = expr->compileExpression(c);
-	c.B.CreateRet(getAsObject(c, ret));
+	c.createRet(getAsObject(c, ret));
 	// Clear the insert point so nothing else tries to insert instructions after
 	// the basic block terminator
 	c.B.ClearInsertionPoint();
@@ -549,8 +980,14 @@ void WhileLoop::compile(Compiler::Context &c)
 	c.B.SetInsertPoint(whileBody);
 	// Compile the body of the loop.
 	body->compile(c);
-	// Unconditionally branch back to the condition to check it again.
-	c.B.CreateBr(condBlock);
+	// Poll for safepoint requests on the back edge, so that a long-running
+	// loop can be interrupted, and then branch back to the condition to check
+	// it again.  If the body ended with a return, then there is no back edge.
+	if (c.B.GetInsertBlock() != nullptr)
+	{
+		c.emitSafepointPoll();
+		c.B.CreateBr(condBlock);
+	}
 	// Set the insert point to the block after the loop.
 	c.B.SetInsertPoint(cont);
 }
@@ -598,10 +1035,11 @@ Value *VarRef::compileExpression(Compiler::Context &c)
 }
 Value *NewExpr::compileExpression(Compiler::Context &c)
 {
-	// Look up the class statically
-	Class *cls = lookupClass(className->name);
-	// Create a value corresponding to the class pointer
-	Value *clsPtr = staticAddress(c, cls, c.ObjPtrTy);
+	// Load the class from its class table entry, rather than embedding the
+	// class pointer, so that this code sees the class if it is reloaded.
+	Class **cls = lookupClassSlot(className->name);
+	Value *clsPtr = c.B.CreateLoad(staticAddress(c, cls,
+				c.ObjPtrTy->getPointerTo()), className->name);
 	// Look up the function that creates instances of objects
 	Constant *newFn = c.M.getOrInsertFunction("newObject", c.ObjPtrTy,
 			c.ObjPtrTy, nullptr);
@@ -691,8 +1129,13 @@ Value *compileBinaryOp(Compiler::Context &c, Value *LHS, Value *RHS,
 	BasicBlock *small = BasicBlock::Create(c.C, "int", c.F);
 	BasicBlock *obj = BasicBlock::Create(c.C, "obj", c.F);
 	// If both arguments are small integers, jump to the small int block,
-	// otherwise fall back to the other case.
-	c.B.CreateCondBr(isSmallInt, small, obj);
+	// otherwise fall back to the other case.  Arithmetic on objects is rare,
+	// so tell LLVM that the object case is cold.  The code generator then
+	// moves it out of line, to the end of the function, so the hot path is
+	// straight-line code.
+	MDBuilder MDB(c.C);
+	c.B.CreateCondBr(isSmallInt, small, obj,
+			MDB.createBranchWeights(2000, 1));
 
 	// Now emit the small int code:
 	c.B.SetInsertPoint(small);
@@ -707,11 +1150,21 @@ Value *compileBinaryOp(Compiler::Context &c, Value *LHS, Value *RHS,
 
 	// Next we'll handle the real object case.
 	c.B.SetInsertPoint(obj);
-	// Call the function that handles the object case
-	Value *objResult = c.B.CreateCall2(c.M.getOrInsertFunction(slowCallFnName,
-				c.ObjPtrTy, LHS->getType(), RHS->getType(), nullptr), LHS,
-			RHS);
-	// And branch to the continuation block
+	// Call the function that handles the object case.  Marking it as cold
+	// also keeps any other paths that lead only to it out of line.
+	Constant *slowFn = c.M.getOrInsertFunction(slowCallFnName, c.ObjPtrTy,
+			LHS->getType(), RHS->getType(), nullptr);
+	if (Function *F = dyn_cast<Function>(slowFn))
+	{
+		F->addFnAttr(Attribute::Cold);
+	}
+	Value *objResult = c.B.CreateCall2(slowFn, LHS, RHS);
+	// The slow path calls a method, so it can return because the thread is
+	// unwinding.
+	c.emitUnwindCheck(objResult);
+	// And branch to the continuation block.  The check added blocks, so this
+	// isn't the block that the object case started in.
+	BasicBlock *objEnd = c.B.GetInsertBlock();
 	c.B.CreateBr(cont);
 
 	// Now that we've handled both cases, we need to unify the flow control and
@@ -721,7 +1174,7 @@ Value *compileBinaryOp(Compiler::Context &c, Value *LHS, Value *RHS,
 	PHINode *result = c.B.CreatePHI(intResult->getType(), 2, "sub");
 	// Set its value to the result of whichever basic block we arrived from
 	result->addIncoming(intResult, small);
-	result->addIncoming(objResult, obj);
+	result->addIncoming(objResult, objEnd);
 	// Return the result
 	return result;
 }
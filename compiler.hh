@@ -9,6 +9,19 @@
 namespace Compiler 
 {
 	using MysoreScript::Obj;
+	/**
+	 * Write the IR for every function compiled from now on, before and after
+	 * optimisation, to the named directory, along with the optimisation
+	 * remarks that LLVM reports while compiling it.  LLVM's per-pass timings
+	 * are written to the same directory on exit.  Returns false if the
+	 * directory can't be created.
+	 */
+	bool dumpTo(const char *dir);
+	/**
+	 * Finish dumping, writing out the pass timings.  Nothing can be compiled
+	 * after this has been called.
+	 */
+	void finishDump();
 	/**
 	 * The compiler context.  Contains everything that AST nodes need to be
 	 * able to compile themselves.
@@ -19,6 +32,16 @@ namespace Compiler
 		 * The global symbols that can be referenced when compiling.
 		 */
 		Interpreter::SymbolTable                     &globalSymbols;
+		/**
+		 * The address of the current thread's safepoint countdown, once the
+		 * first poll has been emitted.
+		 */
+		llvm::Value        *countdownAddr = nullptr;
+		/**
+		 * Returns the address of the current thread's safepoint countdown.
+		 * The first call must be in the entry block.
+		 */
+		llvm::Value        *safepointCountdown();
 		public:
 		/**
 		 * The LLVM context.  The current implementation uses the global
@@ -71,6 +94,39 @@ namespace Compiler
 		 * Returns the address of the specified symbol.
 		 */
 		llvm::Value        *lookupSymbolAddr(const std::string &str);
+		/**
+		 * Set if the function being compiled notifies the profiler on entry,
+		 * and so must also notify it on every exit.
+		 */
+		bool profiled = false;
+		/**
+		 * The size of the machine code generated by `compile()`, in bytes.
+		 */
+		size_t codeSize = 0;
+		/**
+		 * Insert the code that must run on entry to a compiled closure or
+		 * method.  This is called after the arguments have been stored.
+		 */
+		void emitEntryHooks(AST::ClosureDecl *decl);
+		/**
+		 * Insert a safepoint poll: a decrement of the safepoint countdown and
+		 * a branch to a call to the safepoint handler if it has expired.  If
+		 * the handler says that the thread is unwinding, the function returns
+		 * null.
+		 */
+		void emitSafepointPoll();
+		/**
+		 * Insert a check after a call that returned `result`.  If the call
+		 * returned null because the thread is unwinding, the function
+		 * returns null immediately, rather than carrying on with a value
+		 * that the callee never computed.
+		 */
+		void emitUnwindCheck(llvm::Value *result);
+		/**
+		 * Insert a return of the specified value, preceded by any code that
+		 * must run whenever the function exits.
+		 */
+		void createRet(llvm::Value *v);
 		/**
 		 * Construct a context, given a global symbol table from the
 		 * interpreter.  Compilation is always triggered from the interpreter.
@@ -0,0 +1,507 @@
+// Switching stacks with _longjmp trips glibc's check that longjmp only unwinds
+// the current stack.
+#undef _FORTIFY_SOURCE
+#include "coroutine.hh"
+#include <assert.h>
+#include <atomic>
+#include <mutex>
+#include <setjmp.h>
+#include <stdint.h>
+#include <ucontext.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+#include <sys/mman.h>
+#include <gc.h>
+#include <gc_mark.h>
+
+namespace Coroutine
+{
+struct Task
+{
+	/**
+	 * The registers saved when the task last switched away.
+	 */
+	jmp_buf   context;
+	/**
+	 * The stack pointer when the task last switched away.  Only the part of
+	 * the stack above this is live.
+	 */
+	void     *sp;
+	/**
+	 * The start of the stack mapping, including the guard page, or null once
+	 * the stack has been unmapped.
+	 */
+	char     *stack;
+	/**
+	 * The size of the stack mapping.
+	 */
+	size_t    mapSize;
+	/**
+	 * The top of the stack.  Stacks grow down from here.
+	 */
+	char     *stackTop;
+	/**
+	 * The task that resumed this one, or null if it was resumed from the
+	 * thread's own stack.
+	 */
+	Task     *resumer;
+	/**
+	 * The function that the task runs and its argument.
+	 */
+	Entry     entry;
+	void     *arg;
+	/**
+	 * The identifier passed to switch handlers.
+	 */
+	uint64_t  id;
+	/**
+	 * The task's state.
+	 */
+	State     state;
+};
+}
+
+using namespace Coroutine;
+
+namespace {
+/**
+ * The registers and stack pointer of the thread's own stack, saved while it
+ * is running a task.
+ */
+thread_local jmp_buf threadContext;
+thread_local void *threadSp;
+/**
+ * The top of the thread's own stack.
+ */
+thread_local GC_stack_base threadStack;
+/**
+ * Has `threadStack` been found yet?
+ */
+thread_local bool haveThreadStack;
+/**
+ * The running task, or null if the thread is on its own stack.
+ */
+thread_local Task *currentTask;
+/**
+ * The task that is being started by `create()`, and the context to return to
+ * once it has saved its initial registers.
+ */
+thread_local Task *startingTask;
+thread_local jmp_buf *creatorContext;
+/**
+ * The collector's object kind for tasks, which have a custom mark procedure.
+ */
+int taskKind;
+/**
+ * Ensures that the task kind is only created once.
+ */
+std::once_flag taskKindCreated;
+/**
+ * The identifier to give the next task.  Identifiers are unique across all
+ * threads.
+ */
+std::atomic<uint64_t> nextTaskId(1);
+/**
+ * The extra roots callback that was installed before ours, if any.
+ */
+GC_push_other_roots_proc previousPushOtherRoots;
+/**
+ * The current thread's switch handlers and their identifiers.
+ */
+thread_local std::vector<std::pair<int, SwitchHandler>> switchHandlers;
+/**
+ * The identifier to give the next switch handler added to the current thread.
+ */
+thread_local int nextSwitchHandlerId;
+/**
+ * The destroy handlers and their identifiers.  These are shared by all
+ * threads, because finalisers can run on any thread.
+ */
+std::vector<std::pair<int, DestroyHandler>> destroyHandlers;
+/**
+ * The identifier to give the next destroy handler.
+ */
+int nextDestroyHandlerId;
+/**
+ * Protects the destroy handlers.  It is held while they run, so that a
+ * handler is never called after it has been removed.
+ */
+std::mutex destroyHandlersLock;
+/**
+ * A thread that has resumed a task.  While one of its tasks is running, the
+ * collector scans only that task's stack as the thread's stack, so the
+ * stacks waiting for it to return have to be pushed as extra roots by
+ * whichever thread is collecting.  Each thread registers the addresses of
+ * its own state here, the first time that it resumes a task.
+ */
+struct RegisteredThread
+{
+	Task          **current;
+	void          **sp;
+	GC_stack_base  *stack;
+	RegisteredThread *next;
+	bool registered = false;
+	/**
+	 * Add the current thread to the list.
+	 */
+	void add();
+	/**
+	 * Remove the thread from the list when it exits.
+	 */
+	~RegisteredThread();
+};
+/**
+ * The threads that have resumed tasks.  This is only modified while holding
+ * the collector's allocation lock, so the collector can walk it safely.
+ */
+RegisteredThread *registeredThreads;
+/**
+ * The current thread's entry in `registeredThreads`.
+ */
+thread_local RegisteredThread registration;
+
+void RegisteredThread::add()
+{
+	current = &currentTask;
+	sp = &threadSp;
+	stack = &threadStack;
+	GC_call_with_alloc_lock([](void *arg) -> void*
+		{
+			RegisteredThread *self = (RegisteredThread*)arg;
+			self->next = registeredThreads;
+			registeredThreads = self;
+			return nullptr;
+		}, this);
+	registered = true;
+}
+
+RegisteredThread::~RegisteredThread()
+{
+	if (!registered)
+	{
+		return;
+	}
+	GC_call_with_alloc_lock([](void *arg) -> void*
+		{
+			for (RegisteredThread **p=&registeredThreads ; *p ;
+			     p=&(*p)->next)
+			{
+				if (*p == arg)
+				{
+					*p = (*p)->next;
+					break;
+				}
+			}
+			return nullptr;
+		}, this);
+}
+
+/**
+ * Save the registers and stack pointer in `from` and `fromSp` and continue
+ * from the registers saved in `to`.  Returns when something switches back to
+ * `from`.
+ */
+__attribute__((noinline))
+void switchContext(jmp_buf from, void **fromSp, jmp_buf to)
+{
+	// `jmp_buf` stores some registers mangled, so spill all of the
+	// callee-saved registers into this frame, where the collector will find
+	// any pointers in them when it scans the suspended stack.
+	__builtin_unwind_init();
+	volatile char marker = 0;
+	*fromSp = (void*)&marker;
+	if (_setjmp(from) == 0)
+	{
+		_longjmp(to, 1);
+	}
+}
+/**
+ * Tell the collector where the top of the stack that is about to run is, so
+ * that it scans the right range when it scans the current stack.
+ */
+void setStackTop(void *top)
+{
+	GC_stack_base base = threadStack;
+	base.mem_base = top;
+	GC_set_stackbottom(nullptr, &base);
+}
+/**
+ * Call the switch handlers.
+ */
+void switched(Task *from, Task *to)
+{
+	if (switchHandlers.empty())
+	{
+		return;
+	}
+	uint64_t fromId = from ? from->id : 0;
+	uint64_t toId = to ? to->id : 0;
+	// Handlers may add or remove handlers, so run a copy of the list.
+	auto current = switchHandlers;
+	for (auto &h : current)
+	{
+		h.second(fromId, toId);
+	}
+}
+/**
+ * Mark procedure for tasks.  Marks the task's argument and resumer and, if
+ * the task is suspended, everything referenced from the live part of its
+ * stack.  The stacks of running tasks are scanned by `pushRunningStacks()`.
+ */
+GC_ms_entry *markTask(GC_word *addr, GC_ms_entry *top, GC_ms_entry *limit,
+                      GC_word)
+{
+	Task *t = (Task*)addr;
+	top = GC_MARK_AND_PUSH(t->arg, top, limit, &t->arg);
+	top = GC_MARK_AND_PUSH(t->resumer, top, limit, (void**)&t->resumer);
+	if ((t->state != State::Suspended) || !t->sp || !t->stack)
+	{
+		return top;
+	}
+	void **start = (void**)((uintptr_t)t->sp & ~(sizeof(void*) - 1));
+	for (void **p=start ; p<(void**)t->stackTop ; p++)
+	{
+		top = GC_MARK_AND_PUSH(*p, top, limit, p);
+	}
+	return top;
+}
+/**
+ * Extra roots callback.  While a task is running, the collector only scans
+ * its stack, so push the stacks that are waiting for it to return: the
+ * thread's own stack and those of the tasks in the chain that resumed it.
+ * This is done for every thread that is running a task.
+ */
+void pushRunningStacks()
+{
+	for (RegisteredThread *r=registeredThreads ; r ; r=r->next)
+	{
+		Task *current = *r->current;
+		if (!current)
+		{
+			continue;
+		}
+		GC_push_all(*r->sp, r->stack->mem_base);
+		for (Task *t=current->resumer ; t ; t=t->resumer)
+		{
+			GC_push_all(t->sp, t->stackTop);
+		}
+	}
+	if (previousPushOtherRoots)
+	{
+		previousPushOtherRoots();
+	}
+}
+/**
+ * Unmap a task's stack.
+ */
+void releaseStack(Task *t)
+{
+	if (t->stack)
+	{
+		munmap(t->stack, t->mapSize);
+		t->stack = nullptr;
+	}
+}
+/**
+ * Finaliser for tasks that are collected while suspended.  Any frames on the
+ * stack are discarded without being unwound, so the destroy handlers are
+ * called first, to clean up anything that refers to them.
+ */
+void finalizeTask(void *obj, void *)
+{
+	Task *t = (Task*)obj;
+	{
+		std::lock_guard<std::mutex> lock(destroyHandlersLock);
+		for (auto &h : destroyHandlers)
+		{
+			h.second(t->id);
+		}
+	}
+	releaseStack(t);
+}
+/**
+ * The function that every task starts in.  Saves the task's initial registers
+ * and returns to `create()`, then runs the task's function when it is first
+ * resumed.
+ */
+void taskStart()
+{
+	Task *self = startingTask;
+	startingTask = nullptr;
+	if (_setjmp(self->context) == 0)
+	{
+		_longjmp(*creatorContext, 1);
+	}
+	Task *t = currentTask;
+	t->entry(t->arg);
+	t->state = State::Finished;
+	// This stack is never used again, so don't save anything.
+	_longjmp(t->resumer ? t->resumer->context : threadContext, 1);
+}
+/**
+ * Create the collector's object kind for tasks and install the callback that
+ * scans the stacks of running tasks.
+ */
+void initialise()
+{
+	std::call_once(taskKindCreated, []()
+		{
+			unsigned markProc = GC_new_proc(markTask);
+			taskKind = GC_new_kind(GC_new_free_list(),
+					GC_MAKE_PROC(markProc, 0), 0, 1);
+			previousPushOtherRoots = GC_get_push_other_roots();
+			GC_set_push_other_roots(pushRunningStacks);
+		});
+}
+}
+
+namespace Coroutine
+{
+Task *create(Entry entry, void *arg)
+{
+	initialise();
+	size_t pageSize = sysconf(_SC_PAGESIZE);
+	size_t mapSize = StackSize + pageSize;
+	void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (map == MAP_FAILED)
+	{
+		return nullptr;
+	}
+	// Make overflowing the stack fault, rather than corrupt whatever is
+	// mapped below it.
+	mprotect(map, pageSize, PROT_NONE);
+	Task *t = (Task*)GC_generic_malloc(sizeof(Task), taskKind);
+	t->stack = (char*)map;
+	t->mapSize = mapSize;
+	t->stackTop = (char*)map + mapSize;
+	t->entry = entry;
+	t->arg = arg;
+	t->id = nextTaskId++;
+	t->state = State::Suspended;
+	GC_register_finalizer_no_order(t, finalizeTask, nullptr, nullptr, nullptr);
+	// Run the start function on the new stack until it has saved its
+	// registers.  This is the only switch that uses `swapcontext()`, which
+	// makes a system call to save and restore the signal mask; every later
+	// switch is a `_longjmp()`.
+	ucontext_t creator, start;
+	getcontext(&start);
+	start.uc_stack.ss_sp = (char*)map + pageSize;
+	start.uc_stack.ss_size = StackSize;
+	start.uc_link = nullptr;
+	makecontext(&start, taskStart, 0);
+	jmp_buf created;
+	startingTask = t;
+	creatorContext = &created;
+	if (_setjmp(created) == 0)
+	{
+		swapcontext(&creator, &start);
+	}
+	return t;
+}
+
+bool resume(Task *t)
+{
+	if (!t || (t->state != State::Suspended) || !t->stack)
+	{
+		return false;
+	}
+	Task *from = currentTask;
+	if (!from && !haveThreadStack)
+	{
+		GC_get_stack_base(&threadStack);
+		haveThreadStack = true;
+		registration.add();
+	}
+	t->resumer = from;
+	t->state = State::Running;
+	switched(from, t);
+	currentTask = t;
+	setStackTop(t->stackTop);
+	switchContext(from ? from->context : threadContext,
+			from ? &from->sp : &threadSp, t->context);
+	// The task has suspended itself or finished.
+	currentTask = from;
+	setStackTop(from ? from->stackTop : threadStack.mem_base);
+	switched(t, from);
+	if (t->state == State::Finished)
+	{
+		releaseStack(t);
+		GC_register_finalizer_no_order(t, nullptr, nullptr, nullptr, nullptr);
+		return false;
+	}
+	return true;
+}
+
+void suspend()
+{
+	Task *self = currentTask;
+	assert(self && "Suspending outside of a task");
+	self->state = State::Suspended;
+	Task *to = self->resumer;
+	switchContext(self->context, &self->sp,
+			to ? to->context : threadContext);
+}
+
+Task *current()
+{
+	return currentTask;
+}
+
+State state(Task *t)
+{
+	return t->state;
+}
+
+bool liveStack(Task *t, void **&bottom, void **&top)
+{
+	if ((t->state != State::Suspended) || !t->sp || !t->stack)
+	{
+		return false;
+	}
+	bottom = (void**)((uintptr_t)t->sp & ~(sizeof(void*) - 1));
+	top = (void**)t->stackTop;
+	return true;
+}
+
+int addSwitchHandler(SwitchHandler h)
+{
+	int id = nextSwitchHandlerId++;
+	switchHandlers.emplace_back(id, std::move(h));
+	return id;
+}
+
+void removeSwitchHandler(int id)
+{
+	for (auto I=switchHandlers.begin(), E=switchHandlers.end() ; I!=E ; ++I)
+	{
+		if (I->first == id)
+		{
+			switchHandlers.erase(I);
+			return;
+		}
+	}
+}
+
+int addDestroyHandler(DestroyHandler h)
+{
+	std::lock_guard<std::mutex> lock(destroyHandlersLock);
+	int id = nextDestroyHandlerId++;
+	destroyHandlers.emplace_back(id, std::move(h));
+	return id;
+}
+
+void removeDestroyHandler(int id)
+{
+	std::lock_guard<std::mutex> lock(destroyHandlersLock);
+	for (auto I=destroyHandlers.begin(), E=destroyHandlers.end() ; I!=E ; ++I)
+	{
+		if (I->first == id)
+		{
+			destroyHandlers.erase(I);
+			return;
+		}
+	}
+}
+}
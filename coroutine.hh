@@ -0,0 +1,131 @@
+#pragma once
+#include <functional>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Coroutines.  Each coroutine (task) runs a function on its own stack and can
+ * suspend itself part way through, returning control to the code that resumed
+ * it, which can later resume it from the same point.  This lets a loop
+ * produce values one at a time for a consumer without either of them having
+ * to be written as a state machine, and works equally well when the producer
+ * is interpreted or compiled: suspending is just a call into the runtime,
+ * which switches stacks under whatever frames are on the current one.
+ *
+ * Tasks are garbage collected.  The collector scans the live part of a
+ * suspended task's stack only if the task is reachable, so an abandoned
+ * generator doesn't keep the objects on its stack alive, and the stack is
+ * unmapped when the task is collected or finishes.
+ *
+ * Stacks are switched without system calls, so a switch costs about as much
+ * as a function call that saves every callee-saved register.  Tasks must be
+ * resumed on the thread that created them.  Each thread has its own current
+ * task and switch handlers.
+ */
+namespace Coroutine
+{
+	/**
+	 * A task, with its stack and the saved state of its registers.
+	 */
+	struct Task;
+	/**
+	 * The function that a task runs.  The task finishes when it returns.
+	 */
+	typedef void (*Entry)(void *arg);
+	/**
+	 * The size of each task's stack, not counting its guard page.  Pages are
+	 * only allocated when they are used, but this must be large enough for
+	 * the JIT to compile code on a task's stack.
+	 */
+	const size_t StackSize = 1024 * 1024;
+	/**
+	 * The states of a task.
+	 */
+	enum class State
+	{
+		/**
+		 * The task has been created but not yet resumed, or it has suspended
+		 * itself.
+		 */
+		Suspended,
+		/**
+		 * The task is running, or has resumed another task that is running.
+		 */
+		Running,
+		/**
+		 * The task's function has returned.
+		 */
+		Finished
+	};
+	/**
+	 * Create a task that will call `entry(arg)` when it is first resumed.
+	 * `arg` should point to the start of a garbage-collected object (or to
+	 * memory that is not collected); the task keeps it alive.  Returns null
+	 * if the stack can't be allocated.
+	 */
+	Task *create(Entry entry, void *arg);
+	/**
+	 * Resume a suspended task, returning when it suspends itself again or
+	 * finishes.  Returns true if the task suspended itself, or false if it
+	 * finished or was not suspended.
+	 */
+	bool resume(Task *t);
+	/**
+	 * Suspend the current task, returning control to the code that resumed
+	 * it.  Must only be called from within a task.
+	 */
+	void suspend();
+	/**
+	 * Returns the task that is currently running, or null if the thread is
+	 * running on its own stack.
+	 */
+	Task *current();
+	/**
+	 * Returns the state of a task.
+	 */
+	State state(Task *t);
+	/**
+	 * If the task is suspended part way through its function, set `bottom`
+	 * and `top` to the bounds of the live part of its stack and return true.
+	 * The task's saved registers are on the stack too, so these words hold
+	 * everything that its frames refer to.  Used to find the objects that a
+	 * suspended task keeps alive for heap snapshots.
+	 */
+	bool liveStack(Task *t, void **&bottom, void **&top);
+	/**
+	 * A handler that is called whenever the thread switches between stacks,
+	 * with the identifiers of the tasks being switched from and to.  The
+	 * thread's own stack has the identifier 0 and every task has a unique
+	 * non-zero identifier, which is never reused.  Handlers are used to save
+	 * and restore per-stack state.
+	 */
+	typedef std::function<void(uint64_t from, uint64_t to)> SwitchHandler;
+	/**
+	 * Add a switch handler for the current thread.  Returns an identifier
+	 * that can be passed to `removeSwitchHandler()`.
+	 */
+	int addSwitchHandler(SwitchHandler h);
+	/**
+	 * Remove a switch handler that was added to the current thread.
+	 */
+	void removeSwitchHandler(int id);
+	/**
+	 * A handler that is called with a task's identifier when the task is
+	 * collected while it is suspended.  The frames on its stack are never
+	 * unwound, so handlers free any per-stack state that a switch handler
+	 * saved for it.  Handlers are called before the stack is unmapped, so
+	 * they may destroy objects that live on it.  They may be called on any
+	 * thread.
+	 */
+	typedef std::function<void(uint64_t id)> DestroyHandler;
+	/**
+	 * Add a destroy handler.  Returns an identifier that can be passed to
+	 * `removeDestroyHandler()`.
+	 */
+	int addDestroyHandler(DestroyHandler h);
+	/**
+	 * Remove a destroy handler.  Once this returns, the handler is not
+	 * running and won't be called again.
+	 */
+	void removeDestroyHandler(int id);
+}
@@ -0,0 +1,502 @@
+#include "eventloop.hh"
+#include "safepoint.hh"
+#include <algorithm>
+#include <chrono>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+using namespace MysoreScript;
+
+namespace EventLoop
+{
+/**
+ * A file that is being watched.  Entries are indexed by file descriptor.
+ */
+struct Watch
+{
+	/**
+	 * The file, or null if this entry is not in use.
+	 */
+	File     *file;
+	/**
+	 * The closure to call when the file is readable.
+	 */
+	Closure  *callback;
+	/**
+	 * The file status flags before the file was made non-blocking.
+	 */
+	intptr_t  flags;
+	/**
+	 * Is the file a listening socket, which is not read?
+	 */
+	bool      listening;
+	/**
+	 * Is the file one that epoll can't watch (a regular file), which is
+	 * always readable?
+	 */
+	bool      alwaysReady;
+};
+/**
+ * A timer.
+ */
+struct Timer
+{
+	/**
+	 * When the timer next expires, in milliseconds on the steady clock.
+	 */
+	int64_t   deadline;
+	/**
+	 * The interval between repeats, or 0 if the timer only runs once.
+	 */
+	int64_t   interval;
+	/**
+	 * The order in which timers were added, so that timers that expire at
+	 * the same time run in that order.
+	 */
+	uint64_t  sequence;
+	/**
+	 * The closure to call.
+	 */
+	Closure  *callback;
+};
+struct Loop
+{
+	/**
+	 * The epoll file descriptor.
+	 */
+	int       poller;
+	/**
+	 * Set by `stop()`.
+	 */
+	bool      stopping;
+	/**
+	 * The watched files, indexed by file descriptor.
+	 */
+	Watch    *watches;
+	size_t    watchCapacity;
+	size_t    watchCount;
+	/**
+	 * The number of watched files that are always ready.
+	 */
+	size_t    alwaysReadyCount;
+	/**
+	 * The timers, as a binary heap ordered so that the next one to expire is
+	 * first.
+	 */
+	Timer    *timers;
+	size_t    timerCapacity;
+	size_t    timerCount;
+	uint64_t  nextTimerSequence;
+};
+}
+
+using namespace EventLoop;
+
+namespace {
+/**
+ * The maximum number of events to handle for each wait.
+ */
+const int MaxEvents = 64;
+/**
+ * The longest that the loop waits before polling for a safepoint.
+ */
+const int64_t SafepointIntervalMilliseconds = 10;
+/**
+ * Create an epoll instance.
+ */
+int createPoller()
+{
+#ifdef __linux__
+	return epoll_create1(EPOLL_CLOEXEC);
+#else
+	return -1;
+#endif
+}
+/**
+ * Register a file descriptor for read events.  Fails with `EPERM` for
+ * regular files.
+ */
+bool addToPoller(int poller, int fd)
+{
+#ifdef __linux__
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	return epoll_ctl(poller, EPOLL_CTL_ADD, fd, &ev) == 0;
+#else
+	return false;
+#endif
+}
+/**
+ * Unregister a file descriptor.
+ */
+void removeFromPoller(int poller, int fd)
+{
+#ifdef __linux__
+	epoll_ctl(poller, EPOLL_CTL_DEL, fd, nullptr);
+#endif
+}
+/**
+ * Wait for events, storing the ready file descriptors in `fds`.  Returns the
+ * number of ready file descriptors, or -1 on error.
+ */
+int waitForEvents(int poller, int *fds, int timeout)
+{
+#ifdef __linux__
+	struct epoll_event events[MaxEvents];
+	int count = epoll_wait(poller, events, MaxEvents, timeout);
+	for (int i=0 ; i<count ; i++)
+	{
+		fds[i] = events[i].data.fd;
+	}
+	return count;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+/**
+ * The current time on the steady clock, in milliseconds.
+ */
+int64_t now()
+{
+	using namespace std::chrono;
+	return duration_cast<milliseconds>(
+			steady_clock::now().time_since_epoch()).count();
+}
+/**
+ * Heap order for timers: true if `a` expires after `b`, so that the earliest
+ * timer is at the top of the heap.
+ */
+bool expiresAfter(const Timer &a, const Timer &b)
+{
+	if (a.deadline != b.deadline)
+	{
+		return a.deadline > b.deadline;
+	}
+	return a.sequence > b.sequence;
+}
+/**
+ * Call a closure with one argument.
+ */
+void callClosure(Closure *callback, Obj arg)
+{
+	callCompiledClosure(callback->invoke, callback, &arg, 1);
+}
+/**
+ * Remove the watch for a file descriptor, restoring the file's flags if it is
+ * still open.
+ */
+void removeWatch(Loop *l, int fd)
+{
+	Watch &w = l->watches[fd];
+	if (!w.file)
+	{
+		return;
+	}
+	if (inputDescriptor(w.file) == fd)
+	{
+		fcntl(fd, F_SETFL, (int)w.flags);
+		if (!w.alwaysReady)
+		{
+			removeFromPoller(l->poller, fd);
+		}
+	}
+	if (w.alwaysReady)
+	{
+		l->alwaysReadyCount--;
+	}
+	memset(&w, 0, sizeof(w));
+	l->watchCount--;
+}
+/**
+ * Remove the watches for files that have been closed.  The kernel stops
+ * reporting events for them, so the loop would otherwise wait for them
+ * forever.
+ */
+void removeClosedWatches(Loop *l)
+{
+	for (size_t fd=0 ; (fd<l->watchCapacity) && (l->watchCount > 0) ; fd++)
+	{
+		File *f = l->watches[fd].file;
+		if (f && (inputDescriptor(f) != (int)fd))
+		{
+			removeWatch(l, fd);
+		}
+	}
+}
+/**
+ * Handle a readable file: read what is available into its buffer and call its
+ * closure.
+ */
+void dispatch(Loop *l, int fd)
+{
+	if ((size_t)fd >= l->watchCapacity)
+	{
+		return;
+	}
+	// Copy the entry, because the closure may change the watches.
+	Watch w = l->watches[fd];
+	if (!w.file)
+	{
+		return;
+	}
+	if (inputDescriptor(w.file) != fd)
+	{
+		removeWatch(l, fd);
+		return;
+	}
+	if (w.listening)
+	{
+		callClosure(w.callback, (Obj)w.file);
+		return;
+	}
+	intptr_t n = fillFileBuffer(w.file);
+	if ((n < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+	{
+		return;
+	}
+	callClosure(w.callback, (Obj)w.file);
+	// Once the end of the file has been reached (here, or by a read in the
+	// closure), or on an error, there will be nothing more to read, so stop
+	// watching the file unless the closure has already replaced this watch.
+	bool finished = (n < 0) || (w.file->buffer && w.file->buffer->eof);
+	if (finished && (l->watches[fd].file == w.file))
+	{
+		removeWatch(l, fd);
+	}
+}
+/**
+ * Run the timers that have expired.
+ */
+void runTimers(Loop *l, Obj loopObject)
+{
+	int64_t current = now();
+	while ((l->timerCount > 0) && (l->timers[0].deadline <= current) &&
+	       !l->stopping)
+	{
+		std::pop_heap(l->timers, l->timers + l->timerCount, expiresAfter);
+		Timer t = l->timers[--l->timerCount];
+		memset(&l->timers[l->timerCount], 0, sizeof(Timer));
+		if (t.interval > 0)
+		{
+			// Don't try to catch up on missed repeats.
+			t.deadline = std::max(t.deadline + t.interval, current + 1);
+			l->timers[l->timerCount++] = t;
+			std::push_heap(l->timers, l->timers + l->timerCount,
+					expiresAfter);
+		}
+		callClosure(t.callback, loopObject);
+	}
+}
+/**
+ * Close a loop's epoll instance when the loop is collected.
+ */
+void finalizeLoop(void *obj, void *)
+{
+	close(((Loop*)obj)->poller);
+}
+}
+
+namespace EventLoop
+{
+Loop *create()
+{
+	int poller = createPoller();
+	if (poller < 0)
+	{
+		return nullptr;
+	}
+	Loop *l = gcAlloc<Loop>(0, "EventLoop");
+	l->poller = poller;
+	GC_register_finalizer_no_order(l, finalizeLoop, nullptr, nullptr,
+			nullptr);
+	return l;
+}
+
+bool watch(Loop *l, File *file, Closure *callback)
+{
+	int fd = inputDescriptor(file);
+	if ((size_t)fd >= l->watchCapacity)
+	{
+		size_t capacity = std::max<size_t>(fd + 1, l->watchCapacity * 2);
+		Watch *watches = (Watch*)gcAllocBuffer(capacity * sizeof(Watch),
+				"EventLoop watches");
+		if (l->watches)
+		{
+			memcpy(watches, l->watches, l->watchCapacity * sizeof(Watch));
+		}
+		l->watches = watches;
+		l->watchCapacity = capacity;
+	}
+	Watch &w = l->watches[fd];
+	if (w.file == file)
+	{
+		w.callback = callback;
+		return true;
+	}
+	// A watch for a different file was left behind by a file that was closed
+	// and whose descriptor has been reused.  The new file has to be
+	// registered from scratch.
+	removeWatch(l, fd);
+	int flags = fcntl(fd, F_GETFL);
+	if (flags < 0)
+	{
+		return false;
+	}
+	int listening = 0;
+	socklen_t len = sizeof(listening);
+	if (getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &listening, &len) != 0)
+	{
+		listening = 0;
+	}
+	bool alwaysReady = false;
+	if (!addToPoller(l->poller, fd))
+	{
+		// Regular files can always be read without blocking, so epoll
+		// refuses them.
+		if (errno != EPERM)
+		{
+			return false;
+		}
+		alwaysReady = true;
+		l->alwaysReadyCount++;
+	}
+	fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+	w.file = file;
+	w.callback = callback;
+	w.flags = flags;
+	w.listening = listening;
+	w.alwaysReady = alwaysReady;
+	l->watchCount++;
+	return true;
+}
+
+void unwatch(Loop *l, File *file)
+{
+	int fd = inputDescriptor(file);
+	if (((size_t)fd < l->watchCapacity) && (l->watches[fd].file == file))
+	{
+		removeWatch(l, fd);
+	}
+}
+
+void addTimer(Loop *l, int64_t milliseconds, bool repeat, Closure *callback)
+{
+	if (l->timerCount == l->timerCapacity)
+	{
+		size_t capacity = std::max<size_t>(8, l->timerCapacity * 2);
+		Timer *timers = (Timer*)gcAllocBuffer(capacity * sizeof(Timer),
+				"EventLoop timers");
+		if (l->timers)
+		{
+			memcpy(timers, l->timers, l->timerCount * sizeof(Timer));
+		}
+		l->timers = timers;
+		l->timerCapacity = capacity;
+	}
+	Timer &t = l->timers[l->timerCount++];
+	t.deadline = now() + std::max<int64_t>(milliseconds, 0);
+	t.interval = repeat ? std::max<int64_t>(milliseconds, 1) : 0;
+	t.sequence = l->nextTimerSequence++;
+	t.callback = callback;
+	std::push_heap(l->timers, l->timers + l->timerCount, expiresAfter);
+}
+
+void run(Loop *l, Obj loopObject)
+{
+	l->stopping = false;
+	int ready[MaxEvents];
+	while (!l->stopping && ((l->watchCount > 0) || (l->timerCount > 0)))
+	{
+		// Wait until the next timer expires, but wake periodically to poll
+		// for safepoints, and don't wait at all if a regular file is being
+		// read.
+		int64_t timeout = SafepointIntervalMilliseconds;
+		if (l->alwaysReadyCount > 0)
+		{
+			timeout = 0;
+		}
+		else if (l->timerCount > 0)
+		{
+			timeout = std::min(timeout,
+					std::max<int64_t>(l->timers[0].deadline - now(), 0));
+		}
+		// Don't hold output back while waiting for input.
+		if (timeout > 0)
+		{
+			flushStandardOutput();
+		}
+		int count = waitForEvents(l->poller, ready, timeout);
+		if ((count < 0) && (errno != EINTR))
+		{
+			fprintf(stderr, "\nERROR: event loop failed: %s\n",
+					strerror(errno));
+			return;
+		}
+		for (int i=0 ; (i<count) && !l->stopping ; i++)
+		{
+			dispatch(l, ready[i]);
+		}
+		for (size_t fd=0 ; (fd<l->watchCapacity) &&
+		     (l->alwaysReadyCount > 0) && !l->stopping ; fd++)
+		{
+			if (l->watches[fd].alwaysReady)
+			{
+				dispatch(l, fd);
+			}
+		}
+		runTimers(l, loopObject);
+		removeClosedWatches(l);
+		if (Safepoint::poll())
+		{
+			return;
+		}
+	}
+}
+
+void stop(Loop *l)
+{
+	l->stopping = true;
+}
+
+void forEachReference(Loop *l,
+        const std::function<void(const char *, Obj)> &fn)
+{
+	for (size_t fd=0 ; fd<l->watchCapacity ; fd++)
+	{
+		Watch &w = l->watches[fd];
+		if (w.file)
+		{
+			fn("(watched file)", (Obj)w.file);
+			fn("(watch callback)", (Obj)w.callback);
+		}
+	}
+	for (size_t i=0 ; i<l->timerCount ; i++)
+	{
+		fn("(timer callback)", (Obj)l->timers[i].callback);
+	}
+}
+
+size_t heapSize(Loop *l)
+{
+	size_t size = GC_size(l);
+	if (l->watches)
+	{
+		size += GC_size(l->watches);
+	}
+	if (l->timers)
+	{
+		size += GC_size(l->timers);
+	}
+	return size;
+}
+}
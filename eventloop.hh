@@ -0,0 +1,71 @@
+#pragma once
+#include <functional>
+#include "runtime.hh"
+
+/**
+ * Event loops, which let one thread multiplex many files, pipes and Unix
+ * domain sockets.  Files that are being watched are made non-blocking and
+ * registered with epoll.  When one becomes readable, the loop reads as much
+ * as is available into the file's buffer in one system call and then calls
+ * the closure that is watching it, which can read the complete lines from the
+ * buffer without blocking.  Listening sockets are not read; their closures
+ * are expected to accept the waiting connections.
+ *
+ * Loops also run timers, which call a closure after a delay, either once or
+ * repeatedly.  A loop runs until it is stopped or has no files or timers left
+ * to wait for.
+ */
+namespace EventLoop
+{
+	/**
+	 * The state of a loop.  Loops are allocated in the garbage-collected
+	 * heap, so that the collector sees the files and closures that they
+	 * refer to.
+	 */
+	struct Loop;
+	/**
+	 * Create a loop.  Returns null if it can't be created.
+	 */
+	Loop *create();
+	/**
+	 * Call `callback` with `file` as its argument whenever data or the end of
+	 * the file arrives.  The file is unwatched after its closure has been
+	 * called for the end of the file.  Replaces any existing closure for the
+	 * same file.  Returns false if the file can't be watched.
+	 */
+	bool watch(Loop *l, MysoreScript::File *file,
+	           MysoreScript::Closure *callback);
+	/**
+	 * Stop watching a file, and make it blocking again.
+	 */
+	void unwatch(Loop *l, MysoreScript::File *file);
+	/**
+	 * Call `callback` with the loop's object as its argument after the
+	 * specified number of milliseconds and, if `repeat` is set, every time
+	 * that interval passes after that.
+	 */
+	void addTimer(Loop *l, int64_t milliseconds, bool repeat,
+	              MysoreScript::Closure *callback);
+	/**
+	 * Run the loop until it is stopped, it has nothing left to wait for, or
+	 * the thread is unwinding.  `loopObject` is the object passed to timer
+	 * closures.
+	 */
+	void run(Loop *l, MysoreScript::Obj loopObject);
+	/**
+	 * Make `run()` return once the current callback has finished.
+	 */
+	void stop(Loop *l);
+	/**
+	 * Call `fn` with each file and closure that the loop refers to, and a
+	 * description of the reference.  Used to find the objects that a loop
+	 * keeps alive for heap snapshots.
+	 */
+	void forEachReference(Loop *l,
+	        const std::function<void(const char *, MysoreScript::Obj)> &fn);
+	/**
+	 * Returns the number of bytes of the garbage-collected heap that the
+	 * loop and its tables of watches and timers occupy.
+	 */
+	size_t heapSize(Loop *l);
+}
@@ -0,0 +1,90 @@
+/**
+ * An example of embedding MysoreScript with more than one interpreter
+ * context.  Both contexts import the same module.  The module is parsed once
+ * and its method is compiled once, in the first context, but each context
+ * has its own copy of the module's global, which the compiled code must use.
+ *
+ * Run this from the examples directory, so that context_module.ms can be
+ * found.  It exits with a failure status if either context sees the other's
+ * global.
+ */
+#include <memory>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <gc.h>
+#include "../parser.hh"
+#include "../interpreter.hh"
+
+using namespace MysoreScript;
+
+namespace {
+/**
+ * The ASTs of the code that has been run.  Closures and classes refer to
+ * their AST nodes, so these must outlive the contexts.
+ */
+std::vector<std::unique_ptr<AST::Statements>> programs;
+
+/**
+ * Run `source` in context `C`.
+ */
+void run(Interpreter::Context &C, const std::string &source)
+{
+	Parser::MysoreScriptParser p;
+	pegmatite::StringInput input(source);
+	pegmatite::ErrorList el;
+	std::unique_ptr<AST::Statements> ast;
+	if (!p.parse(input, p.g.statements, p.g.ignored, el, ast))
+	{
+		Parser::reportErrors(el);
+		exit(EXIT_FAILURE);
+	}
+	ast->interpret(C);
+	programs.push_back(std::move(ast));
+}
+
+/**
+ * Read the module's global through the method, enough times for the method
+ * to be compiled, and check that the total matches this context's value.
+ * Returns true if it does.
+ */
+bool check(Interpreter::Context &C, const char *name, int value)
+{
+	run(C,
+		"var total = 0;\n"
+		"var i = 0;\n"
+		"while (i < 20)\n"
+		"{\n"
+		"	total = total + (new Reader.value());\n"
+		"	i = i + 1;\n"
+		"}\n");
+	Obj total = *C.lookupSymbol("total");
+	intptr_t expected = value * 20;
+	if (!isInteger(total) || (getInteger(total) != expected))
+	{
+		fprintf(stderr, "\nERROR: %s context read the wrong global: expected "
+		        "a total of %lld\n", name, (long long)expected);
+		return false;
+	}
+	printf("%s context: total %lld\n", name, (long long)expected);
+	return true;
+}
+}
+
+int main()
+{
+	GC_init();
+	Interpreter::Context first;
+	Interpreter::Context second;
+	run(first, "import \"context_module.ms\";\nValue = 1;\n");
+	run(second, "import \"context_module.ms\";\nValue = 2;\n");
+	bool ok = check(first, "First", 1);
+	// The method is compiled by now, so this runs code compiled in the first
+	// context.
+	ok &= check(second, "Second", 2);
+	// Running in the second context must not have changed the first one's
+	// copy.
+	ok &= check(first, "First", 1);
+	return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,54 @@
+/**
+ * An example of reloading a file with `Reload::reloadFile()`.  It loads
+ * reload_before.ms and then reloads reload_after.ms, which differs only in a
+ * string literal containing an escaped quote.  The reload must see that
+ * `message` has changed and that `unchanged` hasn't.
+ *
+ * Run this from the examples directory, so that the two files can be found.
+ * It exits with a failure status if the reload finds the wrong changes.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <gc.h>
+#include "../interpreter.hh"
+#include "../reload.hh"
+
+using namespace MysoreScript;
+
+namespace {
+/**
+ * Load or reload `file` into context `C` and check that the reload found
+ * the expected number of changed and unchanged functions.  Returns true if
+ * it did.
+ */
+bool reload(Interpreter::Context &C, const char *file, size_t changed,
+            size_t unchanged)
+{
+	Reload::Summary summary;
+	if (!Reload::reloadFile(C, file, summary))
+	{
+		return false;
+	}
+	printf("Reloaded %s: %zu unchanged, %zu changed\n", file,
+	       summary.unchanged, summary.changed);
+	if ((summary.changed != changed) || (summary.unchanged != unchanged))
+	{
+		fprintf(stderr, "\nERROR: expected %zu unchanged and %zu changed\n",
+		        unchanged, changed);
+		return false;
+	}
+	return true;
+}
+}
+
+int main()
+{
+	GC_init();
+	Interpreter::Context C;
+	// Nothing is defined yet, so both functions are new.
+	if (!reload(C, "reload_before.ms", 2, 0))
+	{
+		return EXIT_FAILURE;
+	}
+	return reload(C, "reload_after.ms", 1, 1) ? EXIT_SUCCESS : EXIT_FAILURE;
+}
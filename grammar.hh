@@ -1,3 +1,4 @@
+#pragma once
 #include "Pegmatite/pegmatite.hh"
 namespace Parser
 {
@@ -200,12 +201,17 @@ struct MysoreScriptGrammar
 	 */
 	Rule cls          = "class"_E >> identifier >> -(':'_E >> identifier) >> '{'
 	                     >> *decl >> *closure >> '}';
+	/**
+	 * An import statement: the keyword import followed by the path of the
+	 * module to load, as a string literal.
+	 */
+	Rule importStmt   = "import"_E >> string >> ';';
 	/**
 	 * All valid statement types.  Statements that are disambiguated by keywords
 	 * are first.  All expressions are valid statements.
 	 */
-	Rule statement    = cls | ret | ifStatement | whileLoop | decl |
-	                    ((assignment | expression) >> ';');
+	Rule statement    = cls | importStmt | ret | ifStatement | whileLoop |
+	                    decl | ((assignment | expression) >> ';');
 	/**
 	 * A list of statements: the top-level for programs in this grammar.
 	 */
@@ -0,0 +1,690 @@
+#include "heapsnapshot.hh"
+#include "allocprofiler.hh"
+#include "ast.hh"
+#include "channel.hh"
+#include "coroutine.hh"
+#include "eventloop.hh"
+#include <algorithm>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+#include <setjmp.h>
+#include <stdio.h>
+#ifdef __linux__
+#include <pthread.h>
+#endif
+
+using namespace MysoreScript;
+
+namespace {
+/**
+ * Indicates whether a particular object is a real pointer, rather than an
+ * integer hidden in the pointer value.
+ */
+inline bool needsGC(Obj o)
+{
+	return (o != nullptr) && (((intptr_t)o & 7) == 0);
+}
+/**
+ * Indicates whether `o` points to the start of an allocation in the GC'd
+ * heap, and so can be added to the graph.  Words on the stack and some
+ * fields of the built-in objects hold integers and pointers that merely
+ * look like objects.
+ */
+inline bool isHeapObject(Obj o)
+{
+	return needsGC(o) && (GC_base(o) == (void*)o);
+}
+/**
+ * A reference from one node in the snapshot to another.
+ */
+struct Edge
+{
+	/**
+	 * The name of the reference: an instance variable, bound variable or
+	 * global name, or an array index.
+	 */
+	std::string name;
+	/**
+	 * The index of the node that is referenced.
+	 */
+	uint32_t to;
+};
+/**
+ * A node in the heap graph.  Node 0 is the synthetic root, which refers to
+ * one synthetic node for each global and to every other root directly.  All
+ * other nodes are objects.
+ */
+struct Node
+{
+	/**
+	 * The object, or null for synthetic nodes.
+	 */
+	Obj object = nullptr;
+	/**
+	 * The name of the object's class, or a description of a synthetic node.
+	 */
+	std::string className;
+	/**
+	 * The number of bytes that this object occupies in the heap, including
+	 * any buffers that it owns exclusively.
+	 */
+	size_t size = 0;
+	/**
+	 * The number of bytes that would be freed if this object were collected:
+	 * its own size plus the sizes of all of the objects that it dominates.
+	 */
+	size_t retained = 0;
+	/**
+	 * The index of this node's immediate dominator.
+	 */
+	uint32_t idom = 0;
+	/**
+	 * The references from this node.
+	 */
+	std::vector<Edge> edges;
+};
+/**
+ * Builds the heap graph and computes retained sizes.
+ */
+class Snapshot
+{
+	/**
+	 * The nodes in the graph.
+	 */
+	std::vector<Node> nodes;
+	/**
+	 * The node index for each object that has been added to the graph.
+	 */
+	std::unordered_map<Obj, uint32_t> objectNodes;
+	/**
+	 * The classes whose instance layout we understand.  Objects with any
+	 * other class pointer are treated as opaque.
+	 */
+	std::unordered_set<Class*> knownClasses;
+	/**
+	 * The nodes that were added but whose references have not yet been
+	 * followed.
+	 */
+	std::vector<uint32_t> worklist;
+	/**
+	 * The nodes in depth-first postorder from the root.  Unreachable nodes
+	 * are not included.
+	 */
+	std::vector<uint32_t> postorder;
+	/**
+	 * The position of each node in `postorder`.
+	 */
+	std::vector<uint32_t> postorderIndex;
+	/**
+	 * Returns the node index for `o`, adding a new node if necessary.
+	 */
+	uint32_t nodeFor(Obj o);
+	/**
+	 * Add the references from a node to the graph.
+	 */
+	void addEdges(uint32_t n);
+	/**
+	 * Conservatively scan the current thread's stack for object pointers
+	 * and add them as roots.
+	 */
+	void scanStack();
+	/**
+	 * Compute the dominator tree, using the algorithm from Cooper, Harvey
+	 * and Kennedy's "A Simple, Fast Dominance Algorithm".
+	 */
+	void computeDominators();
+	/**
+	 * Sum the retained size for each key returned by `key`.  An object's
+	 * retained size is only counted if none of its dominators has the same
+	 * key, so that objects are not counted twice.  Nodes with an empty key
+	 * are not counted.
+	 */
+	template<typename F>
+	std::vector<std::pair<std::string, size_t>> retainedBy(F key);
+	/**
+	 * Returns the allocation site of a node as a string, or an empty string
+	 * if it is not known.
+	 */
+	std::string siteOf(uint32_t n);
+	public:
+	/**
+	 * Construct the graph from the roots of the given context.
+	 */
+	Snapshot(Interpreter::Context &c);
+	/**
+	 * Write the graph as JSON.
+	 */
+	bool write(const char *file);
+	/**
+	 * Print the largest retainers to the standard error stream.
+	 */
+	void report(size_t topN=20);
+};
+
+uint32_t Snapshot::nodeFor(Obj o)
+{
+	auto I = objectNodes.find(o);
+	if (I != objectNodes.end())
+	{
+		return I->second;
+	}
+	uint32_t n = nodes.size();
+	objectNodes[o] = n;
+	nodes.emplace_back();
+	Node &node = nodes.back();
+	node.object = o;
+	node.size = GC_size(o);
+	if (knownClasses.count(o->isa))
+	{
+		node.className = o->isa->className;
+	}
+	else
+	{
+		node.className = "(opaque)";
+	}
+	worklist.push_back(n);
+	return n;
+}
+
+void Snapshot::addEdges(uint32_t n)
+{
+	Obj o = nodes[n].object;
+	auto addEdge = [&](const std::string &name, Obj target)
+	{
+		if (isHeapObject(target))
+		{
+			uint32_t to = nodeFor(target);
+			nodes[n].edges.push_back({name, to});
+		}
+	};
+	if (!knownClasses.count(o->isa))
+	{
+		return;
+	}
+	if (o->isa == &StringClass)
+	{
+		return;
+	}
+	if (o->isa == &ArrayClass)
+	{
+		// The buffer is only ever referenced by the array, so count it as
+		// part of the array rather than as a separate node.
+		Array *arr = (Array*)o;
+		if (arr->buffer)
+		{
+			nodes[n].size += GC_size(arr->buffer);
+		}
+		intptr_t length = getInteger(arr->length);
+		for (intptr_t i=0 ; i<length ; i++)
+		{
+			addEdge("[" + std::to_string(i) + "]", arr->buffer[i]);
+		}
+		return;
+	}
+	// The built-in classes below have instance variables that are not
+	// objects, so only their object fields are followed.
+	if (o->isa == &FileClass)
+	{
+		// The descriptor is an integer and the buffer holds only bytes, which
+		// the file owns.
+		File *file = (File*)o;
+		if (file->buffer)
+		{
+			nodes[n].size += GC_size(file->buffer);
+		}
+		return;
+	}
+	if (o->isa == &GeneratorClass)
+	{
+		Generator *g = (Generator*)o;
+		addEdge("body", g->body);
+		addEdge("value", g->value);
+		if (!g->task)
+		{
+			return;
+		}
+		// The task and its stack are only reachable from the generator.  The
+		// stack isn't in the GC'd heap, but the objects that a suspended
+		// body's frames refer to are kept alive through it, so scan it
+		// conservatively, as the collector does.
+		nodes[n].size += GC_size(g->task);
+		void **bottom, **top;
+		if (Coroutine::liveStack(g->task, bottom, top))
+		{
+			std::unordered_set<Obj> seen;
+			for (void **p=bottom ; p<top ; p++)
+			{
+				Obj s = (Obj)*p;
+				if (isHeapObject(s) && knownClasses.count(s->isa) &&
+				    seen.insert(s).second)
+				{
+					addEdge("(generator stack)", s);
+				}
+			}
+		}
+		return;
+	}
+	if (o->isa == &ChannelClass)
+	{
+		ChannelObject *ch = (ChannelObject*)o;
+		if (ch->queue)
+		{
+			nodes[n].size += GC_size(ch->queue);
+			Channel::forEachValue(ch->queue, [&](Obj v)
+				{
+					addEdge("(queued)", v);
+				});
+		}
+		return;
+	}
+	if (o->isa == &EventLoopClass)
+	{
+		EventLoopObject *obj = (EventLoopObject*)o;
+		if (obj->loop)
+		{
+			nodes[n].size += EventLoop::heapSize(obj->loop);
+			EventLoop::forEachReference(obj->loop,
+				[&](const char *name, Obj v)
+				{
+					addEdge(name, v);
+				});
+		}
+		return;
+	}
+	if (o->isa == &ClosureClass)
+	{
+		// Bound variables are stored in the iteration order of the
+		// declaration's set of bound variables.
+		Closure *closure = (Closure*)o;
+		int i = 0;
+		for (auto &name : closure->AST->boundVars)
+		{
+			addEdge(name, closure->boundVars[i++]);
+		}
+		return;
+	}
+	Obj *ivars = (Obj*)(o + 1);
+	for (int32_t i=0 ; i<o->isa->indexedIVarCount ; i++)
+	{
+		addEdge(o->isa->indexedIVarNames[i], ivars[i]);
+	}
+}
+
+void Snapshot::scanStack()
+{
+#ifdef __linux__
+	// Spill callee-saved registers onto the stack so that they are scanned
+	// too.
+	jmp_buf registers;
+	setjmp(registers);
+	pthread_attr_t attr;
+	if (pthread_getattr_np(pthread_self(), &attr) != 0)
+	{
+		return;
+	}
+	void *stackAddr;
+	size_t stackSize;
+	pthread_attr_getstack(&attr, &stackAddr, &stackSize);
+	pthread_attr_destroy(&attr);
+	uintptr_t *top = (uintptr_t*)((char*)stackAddr + stackSize);
+	uintptr_t *bottom = (uintptr_t*)&registers;
+	for (uintptr_t *p=bottom ; p<top ; p++)
+	{
+		Obj o = (Obj)*p;
+		// Only accept pointers to the start of a heap allocation that look
+		// like objects.  This can still find dead objects in stale stack
+		// slots, just as the collector itself would.
+		if (!isHeapObject(o) || !knownClasses.count(o->isa))
+		{
+			continue;
+		}
+		uint32_t to = nodeFor(o);
+		nodes[0].edges.push_back({"(stack)", to});
+	}
+#endif
+}
+
+Snapshot::Snapshot(Interpreter::Context &c)
+{
+	for (Class *cls : registeredClasses())
+	{
+		knownClasses.insert(cls);
+	}
+	knownClasses.insert(&ClosureClass);
+	nodes.emplace_back();
+	nodes[0].className = "(roots)";
+	// Globals are added as synthetic nodes so that the amount of memory that
+	// each one keeps alive can be reported.  The class table doesn't need to
+	// be scanned: classes and their methods are not allocated in the GC'd
+	// heap and refer only to compiled code and the AST.
+	std::unordered_set<Obj*> globalAddresses;
+	std::vector<std::pair<std::string, Obj*>> globals(c.globalSymbols.begin(),
+			c.globalSymbols.end());
+	std::sort(globals.begin(), globals.end());
+	for (auto &global : globals)
+	{
+		// The compiler adds null entries for names that it looks up and
+		// doesn't find.
+		if (!global.second)
+		{
+			continue;
+		}
+		globalAddresses.insert(global.second);
+		if (!isHeapObject(*global.second))
+		{
+			continue;
+		}
+		uint32_t g = nodes.size();
+		nodes.emplace_back();
+		nodes[g].className = "global " + global.first;
+		nodes[0].edges.push_back({global.first, g});
+		uint32_t to = nodeFor(*global.second);
+		nodes[g].edges.push_back({global.first, to});
+	}
+	Interpreter::forEachValue([&](Obj *owner, Obj o)
+		{
+			if (!globalAddresses.count(owner) && isHeapObject(o))
+			{
+				uint32_t to = nodeFor(o);
+				nodes[0].edges.push_back({"(value)", to});
+			}
+		});
+	scanStack();
+	while (!worklist.empty())
+	{
+		uint32_t n = worklist.back();
+		worklist.pop_back();
+		addEdges(n);
+	}
+	// Every object that is still alive has been found, so the allocation
+	// sites of the others are no longer needed.
+	std::unordered_set<const void*> live;
+	live.reserve(objectNodes.size());
+	for (auto &object : objectNodes)
+	{
+		live.insert(object.first);
+	}
+	AllocProfiler::pruneSites(live);
+	computeDominators();
+}
+
+void Snapshot::computeDominators()
+{
+	const uint32_t none = UINT32_MAX;
+	size_t count = nodes.size();
+	// Compute the depth-first postorder without recursion, because object
+	// graphs (for example, long linked lists) can be very deep.
+	postorderIndex.assign(count, none);
+	std::vector<bool> visited(count, false);
+	std::vector<std::pair<uint32_t, size_t>> stack;
+	stack.emplace_back(0, 0);
+	visited[0] = true;
+	while (!stack.empty())
+	{
+		auto &top = stack.back();
+		std::vector<Edge> &edges = nodes[top.first].edges;
+		if (top.second < edges.size())
+		{
+			uint32_t next = edges[top.second++].to;
+			if (!visited[next])
+			{
+				visited[next] = true;
+				stack.emplace_back(next, 0);
+			}
+			continue;
+		}
+		postorderIndex[top.first] = postorder.size();
+		postorder.push_back(top.first);
+		stack.pop_back();
+	}
+	std::vector<std::vector<uint32_t>> predecessors(count);
+	for (uint32_t n=0 ; n<count ; n++)
+	{
+		for (auto &edge : nodes[n].edges)
+		{
+			predecessors[edge.to].push_back(n);
+		}
+	}
+	std::vector<uint32_t> idom(count, none);
+	idom[0] = 0;
+	auto intersect = [&](uint32_t a, uint32_t b)
+	{
+		while (a != b)
+		{
+			while (postorderIndex[a] < postorderIndex[b])
+			{
+				a = idom[a];
+			}
+			while (postorderIndex[b] < postorderIndex[a])
+			{
+				b = idom[b];
+			}
+		}
+		return a;
+	};
+	bool changed = true;
+	while (changed)
+	{
+		changed = false;
+		// Visit the nodes in reverse postorder, skipping the root.
+		for (size_t i=postorder.size()-1 ; i>0 ; i--)
+		{
+			uint32_t n = postorder[i-1];
+			uint32_t newIdom = none;
+			for (uint32_t p : predecessors[n])
+			{
+				if (idom[p] == none)
+				{
+					continue;
+				}
+				newIdom = (newIdom == none) ? p : intersect(p, newIdom);
+			}
+			if (idom[n] != newIdom)
+			{
+				idom[n] = newIdom;
+				changed = true;
+			}
+		}
+	}
+	// A node's dominator is always later in the postorder, so visiting the
+	// nodes in postorder accumulates retained sizes bottom up.
+	for (uint32_t n : postorder)
+	{
+		nodes[n].idom = idom[n];
+		nodes[n].retained += nodes[n].size;
+		if (n != 0)
+		{
+			nodes[idom[n]].retained += nodes[n].retained;
+		}
+	}
+}
+
+template<typename F>
+std::vector<std::pair<std::string, size_t>> Snapshot::retainedBy(F key)
+{
+	std::vector<std::vector<uint32_t>> children(nodes.size());
+	for (uint32_t n : postorder)
+	{
+		if (n != 0)
+		{
+			children[nodes[n].idom].push_back(n);
+		}
+	}
+	std::unordered_map<std::string, size_t> totals;
+	// The number of nodes on the current dominator tree path with each key.
+	std::unordered_map<std::string, int> active;
+	// Walk the dominator tree depth first.  Each stack entry is a node and
+	// the index of its next child to visit.
+	std::vector<std::pair<uint32_t, size_t>> stack;
+	stack.emplace_back(0, 0);
+	while (!stack.empty())
+	{
+		auto &top = stack.back();
+		uint32_t n = top.first;
+		if (top.second == 0)
+		{
+			std::string k = key(n);
+			if (!k.empty() && (active[k]++ == 0))
+			{
+				totals[k] += nodes[n].retained;
+			}
+		}
+		if (top.second < children[n].size())
+		{
+			uint32_t child = children[n][top.second++];
+			stack.emplace_back(child, 0);
+			continue;
+		}
+		std::string k = key(n);
+		if (!k.empty())
+		{
+			active[k]--;
+		}
+		stack.pop_back();
+	}
+	std::vector<std::pair<std::string, size_t>> sorted(totals.begin(),
+			totals.end());
+	std::sort(sorted.begin(), sorted.end(),
+		[](const std::pair<std::string, size_t> &a,
+		   const std::pair<std::string, size_t> &b)
+		{
+			return a.second > b.second;
+		});
+	return sorted;
+}
+
+std::string Snapshot::siteOf(uint32_t n)
+{
+	const char *file;
+	int line;
+	if (!nodes[n].object ||
+	    !AllocProfiler::siteOf(nodes[n].object, file, line))
+	{
+		return std::string();
+	}
+	return std::string(file ? file : "<input>") + ":" + std::to_string(line);
+}
+
+/**
+ * Write a string to a file as a JSON string literal.
+ */
+void writeJSONString(FILE *f, const std::string &str)
+{
+	fputc('"', f);
+	for (char ch : str)
+	{
+		unsigned char c = ch;
+		if ((c == '"') || (c == '\\'))
+		{
+			fprintf(f, "\\%c", c);
+		}
+		else if (c < 0x20)
+		{
+			fprintf(f, "\\u%04x", c);
+		}
+		else
+		{
+			fputc(c, f);
+		}
+	}
+	fputc('"', f);
+}
+
+bool Snapshot::write(const char *file)
+{
+	FILE *f = fopen(file, "w");
+	if (!f)
+	{
+		fprintf(stderr, "ERROR: Unable to open %s for the heap snapshot\n",
+				file);
+		return false;
+	}
+	fprintf(f, "{\"nodes\":[\n");
+	bool first = true;
+	for (uint32_t n : postorder)
+	{
+		Node &node = nodes[n];
+		fprintf(f, "%s{\"id\":%u,\"class\":", first ? "" : ",\n", n);
+		first = false;
+		writeJSONString(f, node.className);
+		fprintf(f, ",\"address\":\"%p\",\"size\":%zu,\"retained\":%zu,"
+				"\"idom\":%u,\"site\":", (void*)node.object, node.size,
+				node.retained, node.idom);
+		std::string site = siteOf(n);
+		if (site.empty())
+		{
+			fprintf(f, "null");
+		}
+		else
+		{
+			writeJSONString(f, site);
+		}
+		fprintf(f, ",\"edges\":[");
+		for (size_t i=0 ; i<node.edges.size() ; i++)
+		{
+			fprintf(f, "%s{\"name\":", i ? "," : "");
+			writeJSONString(f, node.edges[i].name);
+			fprintf(f, ",\"to\":%u}", node.edges[i].to);
+		}
+		fprintf(f, "]}");
+	}
+	fprintf(f, "\n]}\n");
+	return fclose(f) == 0;
+}
+
+void Snapshot::report(size_t topN)
+{
+	auto print = [&](const char *heading,
+	                 const std::vector<std::pair<std::string, size_t>> &rows)
+	{
+		fprintf(stderr, "%-50s %12s\n", heading, "Retained");
+		for (size_t i=0 ; (i<rows.size()) && (i<topN) ; i++)
+		{
+			fprintf(stderr, "%-50s %12zu\n", rows[i].first.c_str(),
+					rows[i].second);
+		}
+	};
+	fprintf(stderr, "Heap snapshot: %zu objects, %zu bytes reachable\n",
+			objectNodes.size(), nodes[0].retained);
+	print("Class", retainedBy([&](uint32_t n)
+		{
+			return nodes[n].object ? nodes[n].className : std::string();
+		}));
+	print("Allocation site", retainedBy([&](uint32_t n)
+		{
+			return siteOf(n);
+		}));
+	std::vector<std::pair<std::string, size_t>> globals;
+	for (auto &edge : nodes[0].edges)
+	{
+		if (!nodes[edge.to].object)
+		{
+			globals.emplace_back(edge.name, nodes[edge.to].retained);
+		}
+	}
+	std::sort(globals.begin(), globals.end(),
+		[](const std::pair<std::string, size_t> &a,
+		   const std::pair<std::string, size_t> &b)
+		{
+			return a.second > b.second;
+		});
+	print("Global", globals);
+}
+}
+
+namespace HeapSnapshot
+{
+bool write(Interpreter::Context &c, const char *file)
+{
+	Snapshot snapshot(c);
+	if (!snapshot.write(file))
+	{
+		return false;
+	}
+	snapshot.report();
+	return true;
+}
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+namespace Interpreter
+{
+	class Context;
+}
+
+/**
+ * Heap snapshots, for finding out what is keeping memory alive.  A snapshot
+ * walks the object graph from the roots (globals, other objects held by
+ * `Value`s and the stack) and computes the dominator tree of the graph, which
+ * gives the retained size of each object: the amount of memory that would be
+ * freed if it were no longer referenced.  Generators, channels and event
+ * loops refer to objects from outside the object layout: the frames on a
+ * suspended generator's stack, the values waiting in a channel and the
+ * files, callbacks and timers of a loop.  These are included as edges from
+ * the generator, channel or loop.
+ */
+namespace HeapSnapshot
+{
+	/**
+	 * Write a snapshot of the objects reachable from the roots of the given
+	 * context to the named file as JSON.  Each object is recorded with its
+	 * class, size, retained size, allocation site (if the allocation
+	 * profiler was running when it was allocated) and references.  A summary
+	 * of the retained sizes per class, per allocation site and per global is
+	 * printed to the standard error stream.  Returns false if the file can't
+	 * be written.
+	 */
+	bool write(Interpreter::Context &c, const char *file);
+}
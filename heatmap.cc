@@ -0,0 +1,111 @@
+#include "heatmap.hh"
+#include "ast.hh"
+#include <algorithm>
+#include <map>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace {
+/**
+ * All of the nodes that have counters.  This may contain duplicates.
+ */
+std::vector<AST::Statement*> nodes;
+/**
+ * The number of hottest nodes to list after the annotated sources.
+ */
+const size_t hottestNodes = 20;
+
+/**
+ * Write the annotated listing for one source file, given the highest count of
+ * any node starting on each line.
+ */
+void listFile(FILE *out, const char *file, std::map<int, uint64_t> &lines)
+{
+	fprintf(out, "==> %s <==\n", file);
+	FILE *src = fopen(file, "r");
+	if (!src)
+	{
+		// We can't show the source, so just show the counts.
+		for (auto &line : lines)
+		{
+			fprintf(out, "%12llu | line %d\n",
+					(unsigned long long)line.second, line.first);
+		}
+		return;
+	}
+	char *buffer = nullptr;
+	size_t size = 0;
+	ssize_t length;
+	// Pegmatite numbers lines from 1.
+	for (int line=1 ; (length = getline(&buffer, &size, src)) >= 0 ; line++)
+	{
+		auto count = lines.find(line);
+		if (count != lines.end())
+		{
+			fprintf(out, "%12llu | ", (unsigned long long)count->second);
+		}
+		else
+		{
+			fprintf(out, "%12s | ", "");
+		}
+		fwrite(buffer, 1, length, out);
+		if (length == 0 || buffer[length-1] != '\n')
+		{
+			putc('\n', out);
+		}
+	}
+	free(buffer);
+	fclose(src);
+}
+}
+
+namespace Heatmap
+{
+bool enabled;
+
+void registerNode(AST::Statement *s)
+{
+	nodes.push_back(s);
+}
+
+bool report(const char *file)
+{
+	FILE *out = fopen(file, "w");
+	if (!out)
+	{
+		return false;
+	}
+	std::sort(nodes.begin(), nodes.end());
+	nodes.erase(std::unique(nodes.begin(), nodes.end()), nodes.end());
+	// Nested nodes often start on the same line, so use the largest count on
+	// each line, rather than the sum, as the count for the line.  Files are
+	// compared by pointer: all nodes from the same file share a name.
+	std::map<const char*, std::map<int, uint64_t>> files;
+	for (auto *s : nodes)
+	{
+		uint64_t &count = files[s->sourceFile][s->sourceLine];
+		count = std::max(count, s->hits);
+	}
+	for (auto &f : files)
+	{
+		// Code entered in the REPL has no source file to annotate.
+		listFile(out, f.first ? f.first : "<repl>", f.second);
+	}
+	std::sort(nodes.begin(), nodes.end(),
+		[](AST::Statement *a, AST::Statement *b)
+		{
+			return a->hits > b->hits;
+		});
+	fprintf(out, "==> Hottest nodes <==\n");
+	for (size_t i=0 ; i<std::min(hottestNodes, nodes.size()) ; i++)
+	{
+		AST::Statement *s = nodes[i];
+		fprintf(out, "%12llu | %s:%d:%d\n", (unsigned long long)s->hits,
+				s->sourceFile ? s->sourceFile : "<repl>", s->sourceLine,
+				s->sourceColumn);
+	}
+	fclose(out);
+	return true;
+}
+}
@@ -0,0 +1,34 @@
+#pragma once
+#include <stdint.h>
+
+namespace AST
+{
+	struct Statement;
+}
+
+/**
+ * Per-statement execution counters.  When enabled, the interpreter counts each
+ * time that it executes a statement or evaluates an expression, and the
+ * compiler inserts code that counts each statement that compiled code runs.
+ * The counts are mapped back to source locations to produce an annotated
+ * listing of each file.
+ */
+namespace Heatmap
+{
+	/**
+	 * Is counting enabled?  Compiled code only contains counters if this was
+	 * set when it was compiled.
+	 */
+	extern bool enabled;
+	/**
+	 * Record that a node has a counter, so that it is included in the report.
+	 * It does not matter if a node is registered more than once.
+	 */
+	void registerNode(AST::Statement *s);
+	/**
+	 * Write the annotated source listing for each file that contains counted
+	 * nodes, followed by the hottest nodes, to the named file.  Returns false
+	 * if the file can not be opened.
+	 */
+	bool report(const char *file);
+}
@@ -0,0 +1,106 @@
+#include "hugepages.hh"
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unordered_set>
+#include <sys/mman.h>
+#include <gc.h>
+
+namespace {
+/**
+ * The huge pages in the GC heap that have already been advised.
+ */
+std::unordered_set<uintptr_t> advisedPages;
+/**
+ * The heap resize handler that was installed before ours, if any.
+ */
+GC_on_heap_resize_proc previousHeapResize;
+/**
+ * Advise every huge page of the GC heap that hasn't already been advised.
+ * The collector doesn't say where its heap sections are, so find them by
+ * looking for writeable anonymous mappings that contain heap pages.
+ */
+void adviseGCHeap()
+{
+#ifdef __linux__
+	FILE *maps = fopen("/proc/self/maps", "r");
+	if (!maps)
+	{
+		return;
+	}
+	char line[512];
+	while (fgets(line, sizeof(line), maps))
+	{
+		unsigned long start, end;
+		char perms[5];
+		char path[256] = "";
+		if (sscanf(line, "%lx-%lx %4s %*s %*s %*s %255s", &start, &end, perms,
+		           path) < 3)
+		{
+			continue;
+		}
+		// The collector gets memory with either mmap (anonymous mappings) or
+		// sbrk (the [heap] mapping, shared with malloc).
+		if ((perms[0] != 'r') || (perms[1] != 'w') ||
+		    ((path[0] != 0) && (strcmp(path, "[heap]") != 0)))
+		{
+			continue;
+		}
+		uintptr_t first = (start + HugePages::HugePageSize - 1) &
+			~(HugePages::HugePageSize - 1);
+		for (uintptr_t page=first ; page+HugePages::HugePageSize<=end ;
+		     page+=HugePages::HugePageSize)
+		{
+			if (!GC_is_heap_ptr((void*)page) || advisedPages.count(page))
+			{
+				continue;
+			}
+			if (HugePages::advise((void*)page, HugePages::HugePageSize))
+			{
+				advisedPages.insert(page);
+			}
+		}
+	}
+	fclose(maps);
+#endif
+}
+/**
+ * Heap resize handler.  Advises the new heap sections.
+ */
+void heapResized(GC_word newSize)
+{
+	adviseGCHeap();
+	if (previousHeapResize)
+	{
+		previousHeapResize(newSize);
+	}
+}
+}
+
+namespace HugePages
+{
+bool enabled;
+
+void enableForGCHeap()
+{
+	adviseGCHeap();
+	previousHeapResize = GC_get_on_heap_resize();
+	GC_set_on_heap_resize(heapResized);
+}
+
+bool advise(void *start, size_t size)
+{
+#ifdef MADV_HUGEPAGE
+	uintptr_t begin = ((uintptr_t)start + HugePageSize - 1) &
+		~(HugePageSize - 1);
+	uintptr_t end = ((uintptr_t)start + size) & ~(HugePageSize - 1);
+	if (end <= begin)
+	{
+		return false;
+	}
+	return madvise((void*)begin, end - begin, MADV_HUGEPAGE) == 0;
+#else
+	return false;
+#endif
+}
+}
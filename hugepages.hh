@@ -0,0 +1,34 @@
+#pragma once
+#include <stddef.h>
+
+/**
+ * Transparent huge page support.  Large heaps and large amounts of compiled
+ * code spread over many 4KB pages cause a lot of TLB misses.  When enabled,
+ * the kernel is asked to back the GC heap and the JIT's code arena with 2MB
+ * pages wherever they are large enough.  This is only a hint: if transparent
+ * huge pages are disabled system-wide, nothing changes.
+ */
+namespace HugePages
+{
+	/**
+	 * The size of a huge page.
+	 */
+	const size_t HugePageSize = 2 * 1024 * 1024;
+	/**
+	 * Should memory be backed by huge pages?  The JIT checks this when it
+	 * creates its code arena.
+	 */
+	extern bool enabled;
+	/**
+	 * Start backing the GC heap with huge pages.  The heap sections that
+	 * exist now are advised immediately, and new ones are advised whenever
+	 * the heap grows.  This must be called after `GC_init()`.
+	 */
+	void enableForGCHeap();
+	/**
+	 * Ask the kernel to back the huge-page-aligned parts of the given range
+	 * with huge pages.  Returns false if the advice was rejected or is not
+	 * supported on this platform.
+	 */
+	bool advise(void *start, size_t size);
+}
@@ -1,5 +1,17 @@
+#include <alloca.h>
+#include <atomic>
+#include <stdio.h>
 #include <string.h>
+#include <stdlib.h>
+#include <mutex>
 #include "parser.hh"
+#include "allocprofiler.hh"
+#include "coroutine.hh"
+#include "heatmap.hh"
+#include "profiler.hh"
+#include "safepoint.hh"
+#include "stats.hh"
+#include "trace.hh"
 
 using namespace AST;
 using namespace MysoreScript;
@@ -264,6 +276,45 @@ CompiledMethod methodTrampolines[] = {
 	(CompiledMethod)methodTrampoline9,
 	(CompiledMethod)methodTrampoline10
 };
+/**
+ * Record a method call from the interpreter in the tier statistics.  Calls to
+ * methods that are implemented in the runtime are not counted.
+ */
+void countMethodCall(Obj obj, Selector sel)
+{
+	if (!obj)
+	{
+		return;
+	}
+	Class *cls = isInteger(obj) ? &SmallIntClass : obj->isa;
+	Method *mth = methodForSelector(cls, sel);
+	if (!mth || !mth->AST)
+	{
+		return;
+	}
+	if (mth->function == methodTrampolines[mth->args])
+	{
+		Stats::interpreterToTrampoline++;
+	}
+	else
+	{
+		Stats::interpreterToCompiled++;
+	}
+}
+/**
+ * Record a closure call from the interpreter in the tier statistics.
+ */
+void countClosureCall(Closure *closure, size_t args)
+{
+	if (closure->invoke == Interpreter::closureTrampolines[args])
+	{
+		Stats::interpreterToTrampoline++;
+	}
+	else
+	{
+		Stats::interpreterToCompiled++;
+	}
+}
 } // end anonymous namespace
 
 namespace Interpreter
@@ -284,23 +335,91 @@ ClosureInvoke closureTrampolines[] = {
 	(ClosureInvoke)closureTrampoline9,
 	(ClosureInvoke)closureTrampoline10
 };
+/**
+ * The uncollectable storage that makes an object that a `Value` refers to
+ * visible to the GC.  All live holders are kept in a list, so that heap
+ * snapshots can find the objects that they keep alive.
+ */
+struct ValueHolder
+{
+	/**
+	 * The object.  This is the only field that the GC needs to see.
+	 */
+	Obj object;
+	/**
+	 * The address of the `object` field in the `Value` that owns this.
+	 */
+	Obj *owner;
+	/**
+	 * The previous holder in the list.
+	 */
+	ValueHolder *prev;
+	/**
+	 * The next holder in the list.
+	 */
+	ValueHolder *next;
+};
+namespace {
+/**
+ * The list of live value holders.  Values are only created and destroyed on
+ * the thread that runs the interpreter, so this doesn't need a lock.
+ */
+ValueHolder *valueHolders;
+/**
+ * Allocate a holder for the `Value` whose storage is at `owner` and add it to
+ * the list.
+ */
+ValueHolder *allocHolder(Obj *owner)
+{
+	ValueHolder *h =
+		(ValueHolder*)GC_malloc_uncollectable(sizeof(ValueHolder));
+	h->owner = owner;
+	h->prev = nullptr;
+	h->next = valueHolders;
+	if (valueHolders)
+	{
+		valueHolders->prev = h;
+	}
+	valueHolders = h;
+	return h;
+}
+/**
+ * Remove a holder from the list and free it.
+ */
+void freeHolder(ValueHolder *h)
+{
+	if (h->prev)
+	{
+		h->prev->next = h->next;
+	}
+	else
+	{
+		valueHolders = h->next;
+	}
+	if (h->next)
+	{
+		h->next->prev = h->prev;
+	}
+	GC_free(h);
+}
+}
 void Value::set(Obj o)
 {
 	if (needsGC(object) && !needsGC(o))
 	{
 		assert(holder != nullptr);
-		GC_free(holder);
+		freeHolder(holder);
 		holder = nullptr;
 	}
 	else if (!needsGC(object) && needsGC(o))
 	{
 		assert(holder == nullptr);
-		holder = (Obj*)GC_malloc_uncollectable(sizeof(Obj));
-		*holder = o;
+		holder = allocHolder(&object);
+		holder->object = o;
 	}
 	else if (needsGC(object) && needsGC(o))
 	{
-		*holder = o;
+		holder->object = o;
 	}
 	object = o;
 }
@@ -309,7 +428,14 @@ Value::~Value()
 	if (needsGC(object))
 	{
 		assert(holder != nullptr);
-		GC_free(holder);
+		freeHolder(holder);
+	}
+}
+void forEachValue(const std::function<void(Obj*, Obj)> &fn)
+{
+	for (ValueHolder *h=valueHolders ; h ; h=h->next)
+	{
+		fn(h->owner, h->object);
 	}
 }
 Obj *Context::lookupSymbol(const std::string &name)
@@ -336,6 +462,102 @@ Obj *Context::lookupSymbol(const std::string &name)
 	return nullptr;
 }
 
+namespace {
+/**
+ * The slot number of each global name.
+ */
+std::unordered_map<std::string, size_t> globalSlotNumbers;
+/**
+ * The names of the globals, indexed by slot number.
+ */
+std::vector<std::string> globalSlotNames;
+/**
+ * The number of global slots that have been assigned.  This can be read
+ * without holding the lock, to check whether a context's table is complete.
+ */
+std::atomic<size_t> globalSlotCount(0);
+/**
+ * Protects `globalSlotNumbers` and `globalSlotNames`.
+ */
+std::mutex globalSlotsLock;
+}
+
+Obj **currentGlobalSlots;
+
+size_t globalSlot(const std::string &name)
+{
+	std::lock_guard<std::mutex> guard(globalSlotsLock);
+	auto I = globalSlotNumbers.find(name);
+	if (I != globalSlotNumbers.end())
+	{
+		return I->second;
+	}
+	size_t slot = globalSlotNames.size();
+	globalSlotNames.push_back(name);
+	globalSlotNumbers[name] = slot;
+	globalSlotCount = slot + 1;
+	return slot;
+}
+
+Obj *Context::addGlobal(const std::string &name, Obj val)
+{
+	// Construct a new Value to hold the object.
+	globals.emplace_front(val);
+	// Get the address of the storage that we've allocated and store it in
+	// the symbol table
+	Obj *addr = globals.front().address();
+	globalSymbols[name] = addr;
+	// Give every slot before this one storage as well, so that there are no
+	// gaps in the table.
+	size_t slot = globalSlot(name);
+	while (globalSlots.size() < slot)
+	{
+		std::string other;
+		{
+			std::lock_guard<std::mutex> guard(globalSlotsLock);
+			other = globalSlotNames[globalSlots.size()];
+		}
+		Obj *&otherAddr = globalSymbols[other];
+		if (!otherAddr)
+		{
+			globals.emplace_front(nullptr);
+			otherAddr = globals.front().address();
+		}
+		globalSlots.push_back(otherAddr);
+	}
+	if (slot == globalSlots.size())
+	{
+		globalSlots.push_back(addr);
+	}
+	else
+	{
+		globalSlots[slot] = addr;
+	}
+	// The table may have moved.
+	if (currentContext == this)
+	{
+		currentGlobalSlots = globalSlots.data();
+	}
+	return addr;
+}
+
+void Context::makeCurrent()
+{
+	currentContext = this;
+	if (globalSlots.size() < globalSlotCount)
+	{
+		std::string last;
+		{
+			std::lock_guard<std::mutex> guard(globalSlotsLock);
+			last = globalSlotNames.back();
+		}
+		// The last slot isn't in the table, so this context has no storage
+		// for it.  Adding it fills in all of the slots before it.
+		addGlobal(last, nullptr);
+	}
+	currentGlobalSlots = globalSlots.data();
+}
+
 void Context::setSymbol(const std::string &name, Obj val)
 {
 	Obj *addr = lookupSymbol(name);
@@ -343,12 +565,7 @@ void Context::setSymbol(const std::string &name, Obj val)
 	// allocate some storage for it.
 	if (!addr)
 	{
-		// Construct a new Value to gold the object.
-		globals.emplace_front(val);
-		// Get the address of the storage that we've allocated and store it in
-		// the symbol table
-		addr = globals.front().address();
-		globalSymbols[name] = addr;
+		addGlobal(name, val);
 	}
 	else
 	{
@@ -361,6 +578,216 @@ void Context::setSymbol(const std::string &name, Obj *val)
 	(*symbols.back())[name] = val;
 }
 
+Context::Context()
+{
+	switchHandler = Coroutine::addSwitchHandler(
+		[this](uint64_t from, uint64_t to)
+		{
+			std::lock_guard<std::mutex> lock(suspendedSymbolsLock);
+			if (!symbols.empty())
+			{
+				suspendedSymbols[from].swap(symbols);
+			}
+			auto I = suspendedSymbols.find(to);
+			if (I != suspendedSymbols.end())
+			{
+				symbols.swap(I->second);
+				suspendedSymbols.erase(I);
+			}
+		});
+	destroyHandler = Coroutine::addDestroyHandler(
+		[this](uint64_t task)
+		{
+			std::vector<SymbolTable*> tables;
+			{
+				std::lock_guard<std::mutex> lock(suspendedSymbolsLock);
+				auto I = suspendedSymbols.find(task);
+				if (I == suspendedSymbols.end())
+				{
+					return;
+				}
+				tables.swap(I->second);
+				suspendedSymbols.erase(I);
+			}
+			// The tables are locals in frames on the coroutine's stack,
+			// which are discarded without being unwound, so destroy them
+			// here to free their entries.
+			for (SymbolTable *table : tables)
+			{
+				table->~SymbolTable();
+			}
+		});
+}
+
+Context::~Context()
+{
+	if (currentContext == this)
+	{
+		currentContext = nullptr;
+		currentGlobalSlots = nullptr;
+	}
+	clearBudget();
+	Coroutine::removeSwitchHandler(switchHandler);
+	Coroutine::removeDestroyHandler(destroyHandler);
+}
+
+void Context::setBudget(const Budget &b)
+{
+	clearBudget();
+	budget = b;
+	budgetStartTime = std::chrono::steady_clock::now();
+	budgetStartSteps = Safepoint::polls();
+	budgetHandler = Safepoint::addHandler([this]() { checkBudget(); });
+	if (budget.steps)
+	{
+		Safepoint::scheduleWithin(budget.steps);
+	}
+	// Charge this thread's allocations to this context from now on.  The
+	// allocator makes the next poll check the budget as soon as the limit is
+	// reached.
+	if (budget.allocatedBytes)
+	{
+		allocation = AllocationAccount();
+		allocation.limit = budget.allocatedBytes;
+		previousAccount = allocationAccount;
+		allocationAccount = &allocation;
+	}
+}
+
+void Context::clearBudget()
+{
+	if (budgetHandler < 0)
+	{
+		return;
+	}
+	Safepoint::removeHandler(budgetHandler);
+	budgetHandler = -1;
+	if (budget.allocatedBytes)
+	{
+		allocationAccount = previousAccount;
+	}
+	if (budgetExceeded)
+	{
+		Safepoint::setUnwinding(false);
+		budgetExceeded = nullptr;
+		isReturning = false;
+		retVal = nullptr;
+	}
+}
+
+void Context::checkBudget()
+{
+	if (budgetExceeded)
+	{
+		return;
+	}
+	if (budget.steps)
+	{
+		uint64_t used = Safepoint::polls() - budgetStartSteps;
+		if (used >= budget.steps)
+		{
+			budgetExceeded = "steps";
+		}
+		else
+		{
+			// Make sure that the next safepoint happens as soon as the
+			// budget runs out.
+			Safepoint::scheduleWithin(budget.steps - used);
+		}
+	}
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - budgetStartTime;
+	if ((budget.seconds > 0) && (elapsed.count() >= budget.seconds))
+	{
+		budgetExceeded = "time";
+	}
+	if (budget.allocatedBytes && (allocation.bytes >= budget.allocatedBytes))
+	{
+		budgetExceeded = "allocation";
+	}
+	if (budgetExceeded)
+	{
+		// Stop the interpreter executing statements and make compiled code
+		// return at every safepoint, until control gets back to the caller.
+		isReturning = true;
+		Safepoint::setUnwinding(true);
+	}
+}
+
+namespace {
+/**
+ * The ASTs for all of the modules that have been imported, indexed by their
+ * canonical path.  These are never freed, because classes and closures defined
+ * in a module refer to their AST nodes, which also cache their compiled code.
+ * The compiled code doesn't embed the addresses of any context's globals, so
+ * it can be shared.
+ */
+std::unordered_map<std::string, std::unique_ptr<Statements>> modules;
+/**
+ * Protects `modules`.
+ */
+std::mutex modulesLock;
+}
+
+bool importModule(Context &c, const std::string &path)
+{
+	std::string resolved = path;
+	if (!path.empty() && (path[0] != '/') && !c.moduleDirectories.empty())
+	{
+		resolved = c.moduleDirectories.back() + "/" + path;
+	}
+	// Use the canonical path as the key, so that the same file reached via
+	// different relative paths is only loaded once.
+	char *canonical = realpath(resolved.c_str(), nullptr);
+	if (!canonical)
+	{
+		fprintf(stderr, "ERROR: unable to find module %s\n", path.c_str());
+		return false;
+	}
+	std::string key(canonical);
+	free(canonical);
+	// If the module has already been executed in this context, or is still
+	// being executed because of a cyclic import, then there's nothing to do.
+	if (c.importedModules.count(key))
+	{
+		return true;
+	}
+	Statements *ast;
+	const char *file;
+	{
+		std::lock_guard<std::mutex> guard(modulesLock);
+		// References to elements in an unordered map remain valid even if
+		// later imports cause the table to be rehashed.  The same is true of
+		// the keys, so the AST can refer to the key as its file name.
+		auto &module = *modules.emplace(key, nullptr).first;
+		if (!module.second)
+		{
+			Parser::MysoreScriptParser p;
+			module.second = Parser::parseFile(p, module.first.c_str());
+			if (!module.second)
+			{
+				modules.erase(key);
+				return false;
+			}
+		}
+		ast = module.second.get();
+		file = module.first.c_str();
+	}
+	c.importedModules.insert(key);
+	// Imports inside this module are relative to the module's own directory.
+	std::string dir(file);
+	c.moduleDirectories.push_back(dir.substr(0, dir.rfind('/')));
+	ast->interpret(c);
+	c.moduleDirectories.pop_back();
+	return true;
+}
+
+Obj callClosure(Context &c, Closure *closure, Obj *args, int argCount)
+{
+	c.makeCurrent();
+	return callCompiledClosure(closure->invoke, closure, args, argCount);
+}
+
 }
 
 ////////////////////////////////////////////////////////////////////////////////
@@ -376,6 +803,16 @@ void Statements::interpret(Interpreter::Context &c)
 		{
 			return;
 		}
+		if (AllocProfiler::active)
+		{
+			AllocProfiler::currentStatement = s.get();
+		}
+		// Expressions count themselves when they are evaluated.
+		if (Heatmap::enabled && !dynamic_cast<Expression*>(s.get()) &&
+		    (s->hits++ == 0))
+		{
+			Heatmap::registerNode(s.get());
+		}
 		s->interpret(c);
 	}
 }
@@ -391,6 +828,10 @@ void Statements::collectVarUses(std::unordered_set<std::string> &decls,
 
 Obj Expression::evaluate(Interpreter::Context &c)
 {
+	if (Heatmap::enabled && (hits++ == 0))
+	{
+		Heatmap::registerNode(this);
+	}
 	// If this is a constant expression and we've cached the value, then return
 	// the cached result.
 	if (cache)
@@ -407,6 +848,22 @@ Obj Expression::evaluate(Interpreter::Context &c)
 	return r;
 }
 
+namespace {
+/**
+ * Restores the allocation profiler's current statement when a call returns, so
+ * that allocations made by the rest of the calling statement are not
+ * attributed to the last statement that the callee executed.
+ */
+struct StatementRestorer
+{
+	AST::Statement *saved = AllocProfiler::currentStatement;
+	~StatementRestorer()
+	{
+		AllocProfiler::currentStatement = saved;
+	}
+};
+}
+
 Obj Call::evaluateExpr(Interpreter::Context &c)
 {
 	// Array of arguments.  
@@ -414,6 +871,13 @@ Obj Call::evaluateExpr(Interpreter::Context &c)
 	// Get the callee, which is either a closure or some other object that will
 	// have a method on it invoked.
 	Obj obj = callee->evaluate(c);
+	// If a call in the callee or argument expressions returned because the
+	// thread is unwinding, then its result isn't real, so stop here rather
+	// than making any more calls.
+	if (Safepoint::isUnwinding())
+	{
+		return nullptr;
+	}
 	assert(obj);
 	auto &argsAST = arguments->arguments;
 	size_t i=0;
@@ -422,14 +886,30 @@ Obj Call::evaluateExpr(Interpreter::Context &c)
 	{
 		assert(i<(sizeof(args)/sizeof(Obj)));
 		args[i++] = Arg->evaluate(c);
+		if (Safepoint::isUnwinding())
+		{
+			return nullptr;
+		}
 	}
+	StatementRestorer restoreStatement;
 	// Get the class
-	currentContext = &c;
+	c.makeCurrent();
 	// If there's no method, then we're trying to invoke a closure.
 	if (!method)
 	{
 		assert(obj->isa == &ClosureClass);
 		Closure *closure = (Closure*)obj;
+		if (Stats::enabled)
+		{
+			countClosureCall(closure, i);
+		}
+		if (Trace::traceCalls && c.isTopLevel())
+		{
+			double start = Trace::now();
+			Obj result = callCompiledClosure(closure->invoke, closure, args, i);
+			Trace::complete("call", closure->AST->displayName(), start);
+			return result;
+		}
 		return callCompiledClosure(closure->invoke, closure, args, i);
 	}
 	// Look up the selector and method to call
@@ -437,6 +917,20 @@ Obj Call::evaluateExpr(Interpreter::Context &c)
 	assert(sel);
 	CompiledMethod mth = compiledMethodForSelector(obj, sel);
 	assert(mth);
+	if (Stats::enabled)
+	{
+		countMethodCall(obj, sel);
+	}
+	if (Trace::traceCalls && c.isTopLevel())
+	{
+		double start = Trace::now();
+		Obj result = callCompiledMethod(mth, obj, sel, args,
+				arguments->arguments.size());
+		Class *cls = isInteger(obj) ? &SmallIntClass : obj->isa;
+		Trace::complete("call", std::string(cls->className) + "." +
+				method->name, start);
+		return result;
+	}
 	// Call the method.
 	return callCompiledMethod(mth, obj, sel, args, arguments->arguments.size());
 }
@@ -493,7 +987,8 @@ Obj ClosureDecl::evaluateExpr(Interpreter::Context &c)
 	// wrapping function.  In these cases, we could potentially allocate them
 	// on the stack, but making this determination requires a write barrier for
 	// the store.
-	Closure *C = gcAlloc<Closure>(boundVars.size() * sizeof(Obj));
+	Closure *C = gcAlloc<Closure>(boundVars.size() * sizeof(Obj),
+			"Closure");
 	// Set up the class pointer
 	C->isa = &ClosureClass;
 	// Set up the parameter count
@@ -512,17 +1007,39 @@ Obj ClosureDecl::evaluateExpr(Interpreter::Context &c)
 	return (Obj)C;
 }
 
+std::string ClosureDecl::displayName()
+{
+	std::string qualifiedName = name->name;
+	if (ownerClass)
+	{
+		qualifiedName = std::string(ownerClass) + "." + qualifiedName;
+	}
+	return qualifiedName + ":" + std::to_string(sourceLine);
+}
+
 Obj ClosureDecl::interpretMethod(Interpreter::Context &c, Method *mth, Obj self,
 		Selector sel, Obj *args)
 {
 	check();
 	Class *cls = isInteger(self) ? &SmallIntClass : self->isa;
 	executionCount++;
+	if (Stats::enabled)
+	{
+		if (executionCount == 1)
+		{
+			Stats::registerFunction(this);
+		}
+		Stats::trampolineCalls++;
+	}
 	// If we've interpreted this method enough times then try to compile it.
 	if (executionCount == compileThreshold)
 	{
-		mth->function = compileMethod(cls, c.globalSymbols);
-		compiledClosure = (ClosureInvoke)mth->function;
+		// If the method can't be compiled, keep interpreting it.
+		if (CompiledMethod fn = compileMethod(cls, c.globalSymbols))
+		{
+			mth->function = fn;
+			compiledClosure = (ClosureInvoke)fn;
+		}
 	}
 	// If we now have a compiled version, try to execute it.
 	if (compiledClosure)
@@ -530,6 +1047,16 @@ Obj ClosureDecl::interpretMethod(Interpreter::Context &c, Method *mth, Obj self,
 		return callCompiledMethod((CompiledMethod)compiledClosure, self, sel,
 				args, parameters->arguments.objects().size());
 	}
+	if (Stats::enabled)
+	{
+		stats.interpretedCalls++;
+	}
+	// Poll on entry, as compiled methods do, and return immediately if the
+	// thread is unwinding.
+	if (Safepoint::poll())
+	{
+		return nullptr;
+	}
 	// Create a new symbol table for this method.
 	Interpreter::SymbolTable closureSymbols;
 	c.pushSymbols(closureSymbols);
@@ -543,44 +1070,98 @@ Obj ClosureDecl::interpretMethod(Interpreter::Context &c, Method *mth, Obj self,
 	// Add self and cmd (receiver and selector) to the symbol table
 	c.setSymbol("self", &self);
 	c.setSymbol("cmd", &cmdObj);
+	// Allocate space for the local variables.  This is on the stack, so that
+	// the GC can see the objects that they refer to, and each invocation has
+	// its own copy so that recursive calls don't clobber each other's locals.
+	Obj *locals = (Obj*)alloca(decls.size() * sizeof(Obj));
+	i = 0;
+	for (auto &local : decls)
+	{
+		locals[i] = nullptr;
+		c.setSymbol(local, &locals[i++]);
+	}
 	// Add the addresses of the ivars in the self object to the symbol table.
 	Obj *ivars = ((Obj*)(&self->isa)) + 1;
 	for (int32_t i=0 ; i<cls->indexedIVarCount ; i++)
 	{
 		c.setSymbol(cls->indexedIVarNames[i], &ivars[i]);
 	}
+	// Record the frame for the profiler.  The flag is cached so that entries
+	// and exits stay balanced even if the profiler stops in between.
+	bool profiling = Profiler::active;
+	if (profiling)
+	{
+		Profiler::enterFunction(this, false);
+	}
 	// Interpret the statements in this method;
 	body->interpret(c);
+	if (profiling)
+	{
+		Profiler::exitFunction();
+	}
 	// Return the return value.  Make sure it's set back to nullptr after we've
 	// copied it so that we always return null from any method that doesn't
 	// explicitly return.
 	Obj retVal = c.retVal;
 	c.retVal = nullptr;
-	c.isReturning = false;
+	// If a budget has been exceeded, then keep unwinding.
+	c.isReturning = (c.budgetExceeded != nullptr);
 	// Pop the symbols off the symbol table (very important, as they reference
 	// our stack frame!)
 	c.popSymbols();
 	return retVal;
 }
+bool ClosureDecl::compileNow(Interpreter::Context &c, Closure *self)
+{
+	if (!compiledClosure)
+	{
+		check();
+		compiledClosure = compileClosure(c.globalSymbols);
+	}
+	if (compiledClosure)
+	{
+		self->invoke = compiledClosure;
+	}
+	return compiledClosure != nullptr;
+}
 Obj ClosureDecl::interpretClosure(Interpreter::Context &c, Closure *self,
 		Obj *args)
 {
 	executionCount++;
+	if (Stats::enabled)
+	{
+		if (executionCount == 1)
+		{
+			Stats::registerFunction(this);
+		}
+		Stats::trampolineCalls++;
+	}
 	// If we've interpreted this enough times, compile it.
 	if (executionCount == compileThreshold)
 	{
 		// Note that we don't pass any symbols other than the globals into the
 		// compiler, because all of the bound variables are already copied into
 		// the closure object when it is created.
-		self->invoke = compileClosure(c.globalSymbols);
-		compiledClosure = self->invoke;
+		if (ClosureInvoke fn = compileClosure(c.globalSymbols))
+		{
+			self->invoke = fn;
+			compiledClosure = fn;
+		}
 	}
 	// If we now have a compiled version, call it
 	if (compiledClosure)
 	{
-		callCompiledClosure(compiledClosure, self, args,
+		return callCompiledClosure(compiledClosure, self, args,
 				parameters->arguments.objects().size());
 	}
+	if (Stats::enabled)
+	{
+		stats.interpretedCalls++;
+	}
+	if (Safepoint::poll())
+	{
+		return nullptr;
+	}
 	// Create a new symbol table for this closure
 	Interpreter::SymbolTable closureSymbols;
 	c.pushSymbols(closureSymbols);
@@ -591,20 +1172,38 @@ Obj ClosureDecl::interpretClosure(Interpreter::Context &c, Closure *self,
 		// Parameters are referenced from the arguments array
 		c.setSymbol(param->name, &args[i++]);
 	}
+	// Locals are stored on the stack, as in methods.
+	Obj *locals = (Obj*)alloca(decls.size() * sizeof(Obj));
+	i = 0;
+	for (auto &local : decls)
+	{
+		locals[i] = nullptr;
+		c.setSymbol(local, &locals[i++]);
+	}
 	i = 0;
 	for (auto &bound : boundVars)
 	{
 		// Bound variables are stored within the closure object
 		c.setSymbol(bound, &self->boundVars[i++]);
 	}
+	bool profiling = Profiler::active;
+	if (profiling)
+	{
+		Profiler::enterFunction(this, false);
+	}
 	// Interpret the body
 	body->interpret(c);
+	if (profiling)
+	{
+		Profiler::exitFunction();
+	}
 	// Return the return value.  Make sure it's set back to nullptr after we've
 	// copied it so that we always return null from any method that doesn't
 	// explicitly return.
 	Obj retVal = c.retVal;
 	c.retVal = nullptr;
-	c.isReturning = false;
+	// If a budget has been exceeded, then keep unwinding.
+	c.isReturning = (c.budgetExceeded != nullptr);
 	// Pop the symbols off the symbol table (very important, as they reference
 	// our stack frame!)
 	c.popSymbols();
@@ -614,7 +1213,7 @@ Obj ClosureDecl::interpretClosure(Interpreter::Context &c, Closure *self,
 Obj StringLiteral::evaluateExpr(Interpreter::Context &c)
 {
 	// Construct a string object.
-	String *str = gcAlloc<String>(value.size());
+	String *str = gcAlloc<String>(value.size(), "String");
 	assert(str != nullptr);
 	// Set the class pointer
 	str->isa = &StringClass;
@@ -634,9 +1233,13 @@ void IfStatement::interpret(Interpreter::Context &c)
 }
 void WhileLoop::interpret(Interpreter::Context &c)
 {
-	while (((intptr_t)condition->evaluate(c)) & ~7)
+	// Stop if a return statement in the body has been executed.
+	while (!c.isReturning && (((intptr_t)condition->evaluate(c)) & ~7))
 	{
 		body->interpret(c);
+		// Poll on the back edge, as compiled loops do.  If a budget has been
+		// exceeded, then the handler will have set `isReturning`.
+		Safepoint::poll();
 	}
 }
 void Decl::interpret(Interpreter::Context &c)
@@ -660,6 +1263,12 @@ Obj BinOp::evaluateExpr(Interpreter::Context &c)
 {
 	Obj LHS = lhs->evaluate(c);
 	Obj RHS = rhs->evaluate(c);
+	// Don't call methods on the results of calls that stopped because the
+	// thread is unwinding.
+	if (Safepoint::isUnwinding())
+	{
+		return nullptr;
+	}
 	// If this is a comparison, then we're doing a pointer-compare even if
 	// they're objects.  If both sides are small integers, then ask the subclass
 	// to look up their integer values.
@@ -675,6 +1284,11 @@ Obj BinOp::evaluateExpr(Interpreter::Context &c)
 	}
 	Selector sel = lookupSelector(methodName());
 	CompiledMethod mth = compiledMethodForSelector(LHS, sel);
+	if (Stats::enabled)
+	{
+		countMethodCall(LHS, sel);
+	}
+	c.makeCurrent();
 	return ((Obj(*)(Obj,Selector,Obj))mth)(LHS, sel, RHS);
 }
 
@@ -686,6 +1300,28 @@ void Return::interpret(Interpreter::Context &c)
 	c.isReturning = true;
 }
 
+namespace {
+/**
+ * Fill in the method table entry for a method declared in a class, so that it
+ * calls the interpreter until the method is compiled.
+ */
+void initMethod(Method *method, ClosureDecl *decl, const char *className)
+{
+	method->selector = lookupSelector(decl->name->name);
+	method->args = decl->parameters->arguments.size();
+	// Currently, we only have trampolines for up to 10 arguments.  We could
+	// reuse some of the JIT code to generate new ones at run time if this were
+	// intended for production use, but this is okay as an example.
+	assert(method->args <= 10);
+	// Insert a trampoline for the method
+	method->function = methodTrampolines[method->args];
+	// We retain ownership of the AST node, but the method will contain a
+	// pointer to it.
+	method->AST = decl;
+	decl->ownerClass = className;
+}
+}
+
 void ClassDecl::interpret(Interpreter::Context &c)
 {
 	// Construct the new class.  The class table persists over the lifetime of
@@ -704,19 +1340,7 @@ void ClassDecl::interpret(Interpreter::Context &c)
 	Method *method = cls->methodList;
 	for (auto &m : methods)
 	{
-		method->selector = lookupSelector(m->name->name);
-		method->args = m->parameters->arguments.size();
-		// Currently, we only have trampolines for up to 10 arguments.  We could
-		// reuse some of the JIT code to generate new ones at run time if
-		// this were intended for production use, but this is okay as an
-		// example.
-		assert(method->args <= 10);
-		// Insert a trampoline for the method
-		method->function = methodTrampolines[method->args];
-		// We retain ownership of the AST node, but the method will contain a
-		// pointer to it.
-		method->AST = m.get();
-		method++;
+		initMethod(method++, m.get(), cls->className);
 	}
 	// Set up the names of the instance variables.
 	cls->indexedIVarNames = new const char*[cls->indexedIVarCount];
@@ -728,9 +1352,48 @@ void ClassDecl::interpret(Interpreter::Context &c)
 	// Add the class to the class table.
 	registerClass(clsName, cls);
 }
+size_t ClassDecl::reloadInto(Class *cls)
+{
+	size_t kept = 0;
+	// Build a new method list, rather than editing the old one in place.  Like
+	// the rest of the class, the old list is never freed.
+	Method *methodList = new Method[methods.size()];
+	Method *method = methodList;
+	for (auto &m : methods)
+	{
+		Selector sel = lookupSelector(m->name->name);
+		Method *old = nullptr;
+		for (intptr_t i=0 ; i<cls->methodCount ; i++)
+		{
+			if (cls->methodList[i].selector == sel)
+			{
+				old = &cls->methodList[i];
+			}
+		}
+		if (old && old->AST && (old->AST->structuralHash == m->structuralHash))
+		{
+			*(method++) = *old;
+			kept++;
+			continue;
+		}
+		initMethod(method++, m.get(), cls->className);
+	}
+	cls->methodList = methodList;
+	cls->methodCount = methods.size();
+	return kept;
+}
 Obj NewExpr::evaluateExpr(Interpreter::Context &c)
 {
 	// Look up the class in the class table and create a new instance of it.
 	return newObject(lookupClass(className->name));
 }
+void ImportStatement::interpret(Interpreter::Context &c)
+{
+	if (!c.isTopLevel())
+	{
+		fprintf(stderr, "\nERROR: import is only allowed at the top level\n");
+		return;
+	}
+	Interpreter::importModule(c, path->getValue());
+}
 
@@ -1,13 +1,18 @@
 #pragma once
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
+#include <chrono>
 #include <forward_list>
+#include <functional>
+#include <mutex>
 #include <vector>
 #include "runtime.hh"
 
 namespace Interpreter
 {
 	using MysoreScript::Obj;
+	struct ValueHolder;
 	/**
 	 * Value wraps an object pointer.  It is responsible for informing the
 	 * garbage collector that the object is referenced outside of the GC'd heap
@@ -23,7 +28,7 @@ namespace Interpreter
 		 * sets that it supports.  To avoid hitting this limit, we allocate an
 		 * uncollectable buffer to hold this object.
 		 */
-		Obj *holder = nullptr;
+		ValueHolder *holder = nullptr;
 		/**
 		 * The object that this wraps.
 		 */
@@ -91,10 +96,36 @@ namespace Interpreter
 			return (intptr_t)object >> 3;
 		}
 	};
+	/**
+	 * Call `fn` for every object that is kept alive by a `Value`, with the
+	 * address of the `Value`'s storage (as returned by `Value::address()`) and
+	 * the object.  This is used to find the roots for heap snapshots.
+	 */
+	void forEachValue(const std::function<void(Obj*, Obj)> &fn);
 	/**
 	 * A symbol table stores the address of each allocation.
 	 */
 	typedef std::unordered_map<std::string, Obj*> SymbolTable;
+	/**
+	 * Limits on the resources that code running in a context may use.  A
+	 * limit of zero means no limit.
+	 */
+	struct Budget
+	{
+		/**
+		 * The maximum number of steps: loop iterations and function calls.
+		 */
+		uint64_t steps = 0;
+		/**
+		 * The maximum wall-clock time, in seconds.
+		 */
+		double seconds = 0;
+		/**
+		 * The maximum number of bytes that may be allocated from the GC heap
+		 * by the code running in the context.
+		 */
+		uint64_t allocatedBytes = 0;
+	};
 	class Context
 	{
 		/**
@@ -103,11 +134,80 @@ namespace Interpreter
 		 * important), allowing the symbol table to refer directly to them.
 		 */
 		std::forward_list<Value> globals;
+		/**
+		 * The address of each of this context's globals, indexed by slot
+		 * number.  Compiled code finds globals through this table, rather
+		 * than by their addresses, because it may have been compiled in a
+		 * different context.  Every slot up to the end of the table refers
+		 * to storage.
+		 */
+		std::vector<Obj*> globalSlots;
+		/**
+		 * Allocate storage for a global, initialised to `val`, and add it to
+		 * the symbol table and the slot table.
+		 */
+		Obj *addGlobal(const std::string &name, Obj val);
 		/**
 		 * A stack of symbol tables.  When interpreting a closure, we push a
 		 * new symbol table on top, and then pop it off at the end.
 		 */
 		std::vector<SymbolTable*> symbols;
+		/**
+		 * The symbol table stacks of coroutines that are not running, indexed
+		 * by coroutine identifier.  A generator's body can be suspended in the
+		 * middle of interpreting a closure, so each coroutine has its own
+		 * stack, swapped in whenever the thread switches to it.  Stacks of
+		 * generators that are abandoned while suspended are never swapped back
+		 * in.  Their entries are removed, and the tables destroyed, when the
+		 * generator is collected.
+		 */
+		std::unordered_map<uint64_t, std::vector<SymbolTable*>>
+			suspendedSymbols;
+		/**
+		 * Protects `suspendedSymbols`, which the destroy handler modifies
+		 * from whichever thread runs finalisers.
+		 */
+		std::mutex suspendedSymbolsLock;
+		/**
+		 * The identifier of the coroutine switch handler that swaps the
+		 * symbol table stacks.
+		 */
+		int switchHandler;
+		/**
+		 * The identifier of the coroutine destroy handler that frees the
+		 * symbol table stacks of collected coroutines.
+		 */
+		int destroyHandler;
+		/**
+		 * The budget being enforced, if any.
+		 */
+		Budget budget;
+		/**
+		 * The identifier of the safepoint handler that checks the budget, or
+		 * -1 if no budget is being enforced.
+		 */
+		int budgetHandler = -1;
+		/**
+		 * The time and this thread's number of safepoint polls when the
+		 * budget started.
+		 */
+		std::chrono::steady_clock::time_point budgetStartTime;
+		uint64_t budgetStartSteps;
+		/**
+		 * The bytes allocated on this thread since the budget started, if it
+		 * limits allocation.  Other threads' allocations aren't counted.
+		 */
+		MysoreScript::AllocationAccount allocation;
+		/**
+		 * The allocation account that was current when the budget started,
+		 * which is restored when it is cleared.
+		 */
+		MysoreScript::AllocationAccount *previousAccount = nullptr;
+		/**
+		 * Check whether any limit in the budget has been exceeded and, if so,
+		 * start unwinding.  Called at safepoints.
+		 */
+		void checkBudget();
 		public:
 		/**
 		 * Global symbols.  These all refer to values in the `globals` list.
@@ -124,6 +224,47 @@ namespace Interpreter
 		 * Are we currently returning?
 		 */
 		bool isReturning = false;
+		/**
+		 * The directories containing the modules that are currently being
+		 * loaded, innermost last.  Relative import paths are resolved against
+		 * the last entry, or against the current working directory if this is
+		 * empty.
+		 */
+		std::vector<std::string> moduleDirectories;
+		/**
+		 * The canonical paths of the modules that have been executed in this
+		 * context.  The ASTs of modules are shared by every context, but each
+		 * context executes a module the first time that it imports it, so
+		 * that it gets its own copies of the module's globals.
+		 */
+		std::unordered_set<std::string> importedModules;
+		/**
+		 * The name of the budget limit that was exceeded ("steps", "time" or
+		 * "allocation"), or null if none has been.  Once a limit is exceeded,
+		 * every function returns null as soon as it reaches a safepoint, and
+		 * the interpreter stops executing statements, so that control
+		 * returns to the caller of `interpret()`.
+		 */
+		const char *budgetExceeded = nullptr;
+		/**
+		 * Start enforcing a budget for the code run in this context on the
+		 * current thread, counting from now.
+		 */
+		void setBudget(const Budget &b);
+		/**
+		 * Stop enforcing the budget, and clear `budgetExceeded` so that the
+		 * context can be used again.
+		 */
+		void clearBudget();
+		Context();
+		~Context();
+		/**
+		 * Make this the context that interpreted and compiled code runs in.
+		 * Globals that another context has declared but this one hasn't are
+		 * given storage here, initialised to null, so that code compiled in
+		 * that context can run in this one.
+		 */
+		void makeCurrent();
 		/**
 		 * Push a new symbol table on top of the stack.
 		 */
@@ -132,6 +273,11 @@ namespace Interpreter
 		 * Pop the top symbol table off the stack.
 		 */
 		void popSymbols() { symbols.pop_back(); }
+		/**
+		 * Returns true if the interpreter is executing top-level code, outside
+		 * of any closure or method.
+		 */
+		bool isTopLevel() { return symbols.empty(); }
 		/**
 		 * Look up a symbol, walking up the symbol table stack until it's found.
 		 */
@@ -147,6 +293,34 @@ namespace Interpreter
 		 */
 		void setSymbol(const std::string &name, Obj val);
 	};
+	/**
+	 * Returns the slot number of the named global.  Each name has the same
+	 * slot in every context.
+	 */
+	size_t globalSlot(const std::string &name);
+	/**
+	 * The global slot table of the current context.  Compiled code loads the
+	 * address of each global that it uses from here.
+	 */
+	extern Obj **currentGlobalSlots;
+	/**
+	 * Import the module at the specified path into the given context.  The
+	 * first import of a module in a context executes its top-level
+	 * statements, and later imports of the same file in that context do
+	 * nothing.  The AST is parsed once and cached for the lifetime of the
+	 * process, along with any compiled code for its closures and methods, and
+	 * is shared by every context.  Compiled code reaches globals through the
+	 * slot table of the current context, so each context uses its own copy
+	 * of the module's globals.  Returns false if the module could not be
+	 * loaded.
+	 */
+	bool importModule(Context &c, const std::string &path);
+	/**
+	 * Call a closure from C++ code.  Any interpreted code that it calls runs
+	 * in context `c`.
+	 */
+	Obj callClosure(Context &c, MysoreScript::Closure *closure, Obj *args,
+	                int argCount);
 	/**
 	 * Array of trampolines, indexed by number or arguments.  
 	 */
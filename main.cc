@@ -18,9 +18,12 @@
  * IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN
  * CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
  */
+#include <algorithm>
+#include <chrono>
 #include <iostream>
 #include <ctype.h>
 #include <fcntl.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/resource.h>
@@ -29,6 +32,21 @@
 #include <gc.h>
 #include "parser.hh"
 #include "interpreter.hh"
+#include "allocprofiler.hh"
+#ifndef MYSORESCRIPT_NO_JIT
+#include "compiler.hh"
+#endif
+#include "heapsnapshot.hh"
+#include "heatmap.hh"
+#include "hugepages.hh"
+#include "perfcounters.hh"
+#include "perfmap.hh"
+#include "profiler.hh"
+#include "reload.hh"
+#include "safepoint.hh"
+#include "startup.hh"
+#include "stats.hh"
+#include "trace.hh"
 
 /**
  * Flag indicating whether we should print timing information.
@@ -53,23 +71,155 @@ static void logTimeSince(clock_t c1, const char *msg)
  */
 void usage(const char *cmd)
 {
-	fprintf(stderr, "usage: %s [-himt] [-f {file name}]\n", cmd);
+	fprintf(stderr, "usage: %s [-hijJmrst] [-a {bytes}] [-p {profile}] [-f {file name}] [-e {code}]\n", cmd);
+	fprintf(stderr, " -a {bytes}  Profile allocation sites, sampling once every {bytes}\n");
+	fprintf(stderr, "             bytes allocated (1 records every allocation)\n");
+	fprintf(stderr, " -e {code}   Execute code after any files.  May be repeated.  If\n");
+	fprintf(stderr, "             the code declares a process function, implies -r\n");
 	fprintf(stderr, " -h          Display this help\n");
-	fprintf(stderr, " -i          Interpreter, enable REPL mode\n");
+	fprintf(stderr, " -i          Interpreter, enable REPL mode.  The command\n");
+	fprintf(stderr, "             :reload {file} reloads the functions and methods\n");
+	fprintf(stderr, "             in file that have changed\n");
+	fprintf(stderr, " -j          Write a perf map of JIT-compiled functions\n");
+	fprintf(stderr, " -J          Write a perf map and a jitdump file\n");
 	fprintf(stderr, " -m          Display memory usage stats on exit\n");
+	fprintf(stderr, " -p {file}   Profile execution, writing folded stacks to file\n");
+	fprintf(stderr, " -r          Record mode: after the program has run, call its\n");
+	fprintf(stderr, "             process(line) function for each line of standard\n");
+	fprintf(stderr, "             input.  process is compiled before the first line.\n");
+	fprintf(stderr, "             The program must be given with -f or -e\n");
+	fprintf(stderr, " -s          Display per-function execution statistics on exit\n");
 	fprintf(stderr, " -t          Display timing information\n");
-	fprintf(stderr, " -f {file}   Load and execute file\n");
+	fprintf(stderr, " -f {file}   Load and execute file.  May be repeated, in which\n");
+	fprintf(stderr, "             case the files are parsed in parallel and then\n");
+	fprintf(stderr, "             executed in the order given\n");
+	fprintf(stderr, " --dump-ir {dir}\n");
+	fprintf(stderr, "             Write the IR of each compiled function before and\n");
+	fprintf(stderr, "             after optimisation, the optimisation remarks and\n");
+	fprintf(stderr, "             the per-pass timings to dir\n");
+	fprintf(stderr, " --heap-snapshot {file}\n");
+	fprintf(stderr, "             Write a snapshot of the live heap with retained\n");
+	fprintf(stderr, "             sizes to file on exit.  In REPL mode, the command\n");
+	fprintf(stderr, "             :heapsnapshot {file} writes one immediately\n");
+	fprintf(stderr, " --heatmap {file}\n");
+	fprintf(stderr, "             Count executions of each statement and write an\n");
+	fprintf(stderr, "             annotated source listing to file on exit\n");
+	fprintf(stderr, " --huge-pages\n");
+	fprintf(stderr, "             Back the GC heap and compiled code with transparent\n");
+	fprintf(stderr, "             huge pages, to reduce TLB misses\n");
+	fprintf(stderr, " --max-alloc {bytes}\n");
+	fprintf(stderr, "             Stop a script that allocates more than {bytes}\n");
+	fprintf(stderr, " --max-seconds {seconds}\n");
+	fprintf(stderr, "             Stop a script that runs for longer than {seconds}\n");
+	fprintf(stderr, " --max-steps {steps}\n");
+	fprintf(stderr, "             Stop a script that executes more than {steps} loop\n");
+	fprintf(stderr, "             iterations and function calls.  In REPL mode, the\n");
+	fprintf(stderr, "             limits apply to each line separately\n");
+	fprintf(stderr, " --perf-counters\n");
+	fprintf(stderr, "             Report hardware performance counters for setup,\n");
+	fprintf(stderr, "             parsing, execution, compilation and GC on exit\n");
+	fprintf(stderr, " --startup-profile\n");
+	fprintf(stderr, "             Report the time taken by each step between the\n");
+	fprintf(stderr, "             process starting and the first statement running\n");
+	fprintf(stderr, " --trace {file}\n");
+	fprintf(stderr, "             Write a Chrome trace of parsing, compilation and\n");
+	fprintf(stderr, "             garbage collection to file\n");
+	fprintf(stderr, " --trace-calls\n");
+	fprintf(stderr, "             Also trace calls made from top-level code\n");
+}
+/**
+ * Record mode: call `process` with each line of standard input, until the
+ * input ends or the budget is exceeded.  Returns the exit status.
+ */
+static int processRecords(Interpreter::Context &C,
+                          MysoreScript::Closure *process)
+{
+	using namespace MysoreScript;
+	if (getInteger(process->parameters) != 1)
+	{
+		fprintf(stderr, "ERROR: process must take one argument, the line\n");
+		return EXIT_FAILURE;
+	}
+	// The function will be called for every line, so compile it now rather
+	// than interpreting it for the first few lines.
+	process->AST->compileNow(C, process);
+	// Standard input is read through a File's buffer, so each read system
+	// call returns as many lines as are available.
+	File *input = (File*)newObject(&FileClass);
+	while (String *line = nextLine(input))
+	{
+		Obj arg = (Obj)line;
+		Interpreter::callClosure(C, process, &arg, 1);
+		if (C.budgetExceeded)
+		{
+			fprintf(stderr, "ERROR: process exceeded its %s budget\n",
+					C.budgetExceeded);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
 }
 
 int main(int argc, char **argv)
 {
+	Startup::mark("Static initialisers");
 	clock_t c1;
 	// Are we in read-evaluate-print-loop mode?
 	bool repl = false;
 	// Are memory usage statistics requested?
 	bool memstats = false;
-	// What file should we print?
-	const char *file = nullptr;
+	// What files should we execute?
+	std::vector<const char*> files;
+	// What code from the command line should we execute?
+	std::vector<std::string> expressions;
+	// Should we call `process` for each line of standard input?  Set by -r,
+	// or by -e if the code declares `process`.
+	bool records = false;
+	// Should we tell perf about compiled code?  0 for no, 1 for a perf map, 2
+	// for a perf map and jitdump.
+	int perfMap = 0;
+	// Where should profiling output go, if anywhere?
+	const char *profileFile = nullptr;
+	// How often should the allocation profiler sample?  0 if it is not used.
+	long allocSampleBytes = 0;
+	// Where should the trace go, if anywhere?
+	const char *traceFile = nullptr;
+	// Should the trace include calls from top-level code?
+	bool traceCalls = false;
+	// Where should the heatmap go, if anywhere?
+	const char *heatmapFile = nullptr;
+	// Where should compiled IR be dumped, if anywhere?
+	const char *dumpDirectory = nullptr;
+	// Should hardware performance counters be reported for each phase?
+	bool perfCounters = false;
+	// Where should the heap snapshot go, if anywhere?
+	const char *heapSnapshotFile = nullptr;
+	// The limits on the resources that scripts may use.
+	Interpreter::Budget budget;
+	// The status to exit with.
+	int exitStatus = EXIT_SUCCESS;
+	// Long options.  These return values that can't be short options.
+	enum { TraceOption = 256, TraceCallsOption, HeatmapOption,
+	       DumpIROption, PerfCountersOption, StartupProfileOption,
+	       HeapSnapshotOption, HugePagesOption, MaxStepsOption,
+	       MaxSecondsOption, MaxAllocOption };
+	static const struct option longOptions[] = {
+		{ "trace",           required_argument, nullptr, TraceOption },
+		{ "trace-calls",     no_argument,       nullptr, TraceCallsOption },
+		{ "heatmap",         required_argument, nullptr, HeatmapOption },
+		{ "dump-ir",         required_argument, nullptr, DumpIROption },
+		{ "perf-counters",   no_argument,       nullptr, PerfCountersOption },
+		{ "startup-profile", no_argument,       nullptr, StartupProfileOption },
+		{ "heap-snapshot",   required_argument, nullptr, HeapSnapshotOption },
+		{ "huge-pages",      no_argument,       nullptr, HugePagesOption },
+		{ "max-steps",       required_argument, nullptr, MaxStepsOption },
+		{ "max-seconds",     required_argument, nullptr, MaxSecondsOption },
+		{ "max-alloc",       required_argument, nullptr, MaxAllocOption },
+		{ "help",            no_argument,       nullptr, 'h' },
+		{ nullptr,           0,                 nullptr, 0 }
+	};
+	// Total wall-clock time spent executing code, for the statistics report.
+	double executionSeconds = 0;
 	if (argc < 1)
 	{
 		usage(argv[0]);
@@ -77,7 +227,8 @@ int main(int argc, char **argv)
 	}
 	int c;
 	// Parse the options that we understand
-	while ((c = getopt(argc, argv, "hmitf:")) != -1)
+	while ((c = getopt_long(argc, argv, "hmirstjJa:e:f:p:", longOptions,
+	                        nullptr)) != -1)
 	{
 		switch (c)
 		{
@@ -85,7 +236,13 @@ int main(int argc, char **argv)
 				repl = true;
 				break;
 			case 'f':
-				file = optarg;
+				files.push_back(optarg);
+				break;
+			case 'e':
+				expressions.push_back(optarg);
+				break;
+			case 'r':
+				records = true;
 				break;
 			case 't':
 				enableTiming = true;
@@ -93,47 +250,223 @@ int main(int argc, char **argv)
 			case 'm':
 				memstats = true;
 				break;
+			case 'p':
+				profileFile = optarg;
+				break;
+			case 'a':
+				allocSampleBytes = std::max(1L, strtol(optarg, nullptr, 10));
+				break;
+			case 's':
+				Stats::enabled = true;
+				break;
+			case 'j':
+				perfMap = std::max(perfMap, 1);
+				break;
+			case 'J':
+				perfMap = 2;
+				break;
+			case TraceOption:
+				traceFile = optarg;
+				break;
+			case TraceCallsOption:
+				traceCalls = true;
+				break;
+			case DumpIROption:
+				dumpDirectory = optarg;
+				break;
+			case PerfCountersOption:
+				perfCounters = true;
+				break;
+			case StartupProfileOption:
+				Startup::active = true;
+				break;
+			case HeapSnapshotOption:
+				heapSnapshotFile = optarg;
+				break;
+			case HugePagesOption:
+				HugePages::enabled = true;
+				break;
+			case MaxStepsOption:
+				budget.steps = strtoull(optarg, nullptr, 10);
+				break;
+			case MaxSecondsOption:
+				budget.seconds = strtod(optarg, nullptr);
+				break;
+			case MaxAllocOption:
+				budget.allocatedBytes = strtoull(optarg, nullptr, 10);
+				break;
+			case HeatmapOption:
+				heatmapFile = optarg;
+				Heatmap::enabled = true;
+				break;
 			case 'h':
 				usage(argv[0]);
 				break;
 		}
 	}
+	// Record mode reads standard input as records, so the program that
+	// processes them has to come from somewhere else.
+	if (records && files.empty() && expressions.empty())
+	{
+		fprintf(stderr, "ERROR: -r needs a program, given with -f or -e\n");
+		usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+	Startup::mark("Option parsing");
+	// Open the counters before anything else happens, so that setup is
+	// measured and the parser threads inherit them.
+	if (perfCounters)
+	{
+		PerfCounters::start();
+	}
+	PerfCounters::Scope setup(PerfCounters::Setup);
 	c1 = clock();
 	//Initialise the garbage collection library.  This must be called before
 	//any objects are allocated.
 	GC_init();
+	// Hooks into the collector can only be installed once it is initialised.
+	PerfCounters::measureCollections();
+	if (HugePages::enabled)
+	{
+		HugePages::enableForGCHeap();
+	}
+	Startup::mark("GC_init");
+	// Start tracing as early as possible, but after the collector is ready to
+	// report its events.
+	if (traceFile && !Trace::start(traceFile, traceCalls))
+	{
+		fprintf(stderr, "Unable to open trace file %s\n", traceFile);
+	}
 
-	// Set up a parser and interpreter context to use.
+#ifdef MYSORESCRIPT_NO_JIT
+	if (dumpDirectory)
+	{
+		fprintf(stderr, "IR can't be dumped: this build has no JIT compiler\n");
+	}
+#else
+	if (dumpDirectory && !Compiler::dumpTo(dumpDirectory))
+	{
+		fprintf(stderr, "Unable to create IR dump directory %s\n",
+				dumpDirectory);
+	}
+#endif
+	Startup::mark("Tracing and IR dump setup");
+	// Set up a parser and interpreter context to use.  Constructing the first
+	// parser also constructs the grammar.
 	Parser::MysoreScriptParser p;
 	Interpreter::Context C;
+	// This thread runs MysoreScript code, so must stop when the world does.
+	Safepoint::Mutator mutator;
+	Startup::mark("Parser and grammar construction");
 	// Log the time taken for all of the program setup.
 	logTimeSince(c1, "Setup");
-	// The AST for the program loaded from a file, if there is one
-	std::unique_ptr<AST::Statements> ast = 0;
-	// If a filename was specified, then try to parse and execute it.
-	if (file)
+	setup.end();
+	if (perfMap && !PerfMap::enable(perfMap == 2))
+	{
+		fprintf(stderr, "Unable to create perf map files\n");
+	}
+	if (profileFile && !Profiler::start())
+	{
+		fprintf(stderr, "Unable to start the profiler\n");
+		profileFile = nullptr;
+	}
+	// Heap snapshots use the allocation profiler to find out where each object
+	// was allocated, so run it (without sampling, if it wasn't requested).
+	if (allocSampleBytes || heapSnapshotFile)
+	{
+		AllocProfiler::start(allocSampleBytes, heapSnapshotFile != nullptr);
+	}
+	Startup::mark("Profiler setup");
+	// Is there any limit on the resources that scripts may use?
+	bool limited = budget.steps || (budget.seconds > 0) ||
+		budget.allocatedBytes;
+	// The ASTs for the program loaded from files, if there are any.
+	std::vector<Parser::SourceChunk> program;
+	// If any files or code were specified, then try to parse and execute them.
+	if (!files.empty() || !expressions.empty())
 	{
 		c1 = clock();
-		// Open the file
-		pegmatite::AsciiFileInput input(open(file, O_RDONLY));
-		pegmatite::ErrorList el;
-		c1 = clock();
-		// Parse one or more statements, report errors if there are any
-		if (!p.parse(input, p.g.statements, p.g.ignored, el, ast))
+		PerfCounters::Scope parse(PerfCounters::Parse);
+		// Parse all of the files, report errors if there are any
+		if (!files.empty() && !Parser::parseFiles(files, program))
+		{
+			return EXIT_FAILURE;
+		}
+		// Code from the command line runs after the files, in the order
+		// given.
+		for (auto &code : expressions)
 		{
-			std::cerr << "errors: \n";
-			for (auto &err : el)
+			pegmatite::StringInput input(code);
+			std::unique_ptr<AST::Statements> ast;
+			pegmatite::ErrorList el;
+			if (!p.parse(input, p.g.statements, p.g.ignored, el, ast))
 			{
-				std::cerr << "line " << err.start.line
-						  << ", col " << err.finish.col <<  ": ";
-				std::cerr << "syntax error" << std::endl;
+				Parser::reportErrors(el, "-e");
+				return EXIT_FAILURE;
 			}
-			return EXIT_FAILURE;
+			// Code on the command line that declares `process` is a filter,
+			// so run it in record mode.  Only the command line counts, so
+			// that loading a library that happens to define `process`
+			// doesn't make the program wait for standard input.
+			for (auto &s : ast->statements)
+			{
+				auto *fn = dynamic_cast<AST::ClosureDecl*>(s.get());
+				if (fn && fn->name && (fn->name->name == "process"))
+				{
+					records = true;
+				}
+			}
+			program.push_back({ "-e", std::move(ast) });
 		}
+		parse.end();
+		Startup::mark("Parsing");
 		logTimeSince(c1, "Parsing program");
 		c1 = clock();
-		// Now interpret the parsed 
-		ast->interpret(C);
+		PerfCounters::Scope execution(PerfCounters::Execution);
+		auto start = std::chrono::steady_clock::now();
+		// The budget covers the whole program.
+		if (limited)
+		{
+			C.setBudget(budget);
+		}
+		// Now interpret the parsed chunks, in order.
+		for (auto &chunk : program)
+		{
+			// Modules imported by a file are found relative to its directory.
+			std::string dir(chunk.file);
+			size_t slash = dir.rfind('/');
+			C.moduleDirectories.push_back(slash == std::string::npos ? "." :
+					dir.substr(0, slash));
+			chunk.ast->interpret(C);
+			C.moduleDirectories.pop_back();
+			if (C.budgetExceeded)
+			{
+				fprintf(stderr, "ERROR: %s exceeded its %s budget\n",
+						chunk.file, C.budgetExceeded);
+				exitStatus = EXIT_FAILURE;
+				repl = false;
+				records = false;
+				break;
+			}
+		}
+		// In record mode, pass each line of standard input to `process`.
+		MysoreScript::Obj *process = C.lookupSymbol("process");
+		bool haveProcess = process && *process &&
+			!MysoreScript::isInteger(*process) &&
+			((*process)->isa == &MysoreScript::ClosureClass);
+		if (records && !haveProcess)
+		{
+			fprintf(stderr, "ERROR: record mode needs a process(line) function\n");
+			exitStatus = EXIT_FAILURE;
+		}
+		else if (records && !C.budgetExceeded)
+		{
+			exitStatus = processRecords(C, (MysoreScript::Closure*)*process);
+			repl = false;
+		}
+		C.clearBudget();
+		executionSeconds += Stats::secondsSince(start);
+		execution.end();
 		logTimeSince(c1, "Executing program");
 	}
 	// Keep all of the ASTs that we've parsed in the REPL environment in case
@@ -147,7 +480,8 @@ int main(int argc, char **argv)
 		GC_gcollect();
 		logTimeSince(c1, "Garbage collection");
 		std::string buffer;
-		// Print the prompt
+		// Print the prompt, after anything that the last line wrote
+		flushStandardOutput();
 		std::cout << "\nMysoreScript> ";
 		// Get a line
 		std::getline(std::cin, buffer);
@@ -157,31 +491,90 @@ int main(int argc, char **argv)
 			repl = false;
 			break;
 		}
+		// Heap snapshots are requested with a command, rather than code.
+		const std::string snapshotCommand = ":heapsnapshot ";
+		if (buffer.compare(0, snapshotCommand.size(), snapshotCommand) == 0)
+		{
+			HeapSnapshot::write(C, buffer.c_str() + snapshotCommand.size());
+			continue;
+		}
+		const std::string reloadCommand = ":reload ";
+		if (buffer.compare(0, reloadCommand.size(), reloadCommand) == 0)
+		{
+			const char *file = buffer.c_str() + reloadCommand.size();
+			Reload::Summary summary;
+			if (Reload::reloadFile(C, file, summary))
+			{
+				fprintf(stderr, "Reloaded %s: %zu unchanged, %zu changed, "
+						"%zu classes replaced\n", file, summary.unchanged,
+						summary.changed, summary.replacedClasses);
+			}
+			continue;
+		}
 		// Parse the line
 		pegmatite::StringInput input(buffer);
 		std::unique_ptr<AST::Statements> ast = 0;
 		pegmatite::ErrorList el;
 		c1 = clock();
+		Trace::Span parse("parse", "<repl>");
+		PerfCounters::Scope parseCounters(PerfCounters::Parse);
 		if (!p.parse(input, p.g.statements, p.g.ignored, el, ast))
 		{
-			std::cerr << "errors: \n";
-			for (auto &err : el)
-			{
-				std::cerr << "line " << err.start.line
-						  << ", col " << err.finish.col <<  ": ";
-				std::cerr << "syntax error" << std::endl;
-			}
+			Parser::reportErrors(el);
 			continue;
 		}
+		parse.end();
+		parseCounters.end();
 		logTimeSince(c1, "Parsing program");
 		c1 = clock();
 		// Interpret the resulting AST
+		PerfCounters::Scope execution(PerfCounters::Execution);
+		auto start = std::chrono::steady_clock::now();
+		if (limited)
+		{
+			C.setBudget(budget);
+		}
 		ast->interpret(C);
+		if (C.budgetExceeded)
+		{
+			fprintf(stderr, "ERROR: Input exceeded its %s budget\n",
+					C.budgetExceeded);
+		}
+		C.clearBudget();
+		executionSeconds += Stats::secondsSince(start);
+		execution.end();
 		logTimeSince(c1, "Executing program");
 		// Keep the AST around - it may contain things that we refer to later
 		// (e.g. functions / classes).
 		replASTs.push_back(std::move(ast));
 	}
+	if (profileFile)
+	{
+		Profiler::stop(profileFile);
+	}
+	PerfMap::close();
+	Trace::stop();
+#ifndef MYSORESCRIPT_NO_JIT
+	Compiler::finishDump();
+#endif
+	if (Stats::enabled)
+	{
+		Stats::report(executionSeconds);
+	}
+	PerfCounters::report();
+	Startup::report();
+	if (heapSnapshotFile)
+	{
+		HeapSnapshot::write(C, heapSnapshotFile);
+	}
+	if (allocSampleBytes)
+	{
+		AllocProfiler::report();
+	}
+	if (heatmapFile && !Heatmap::report(heatmapFile))
+	{
+		fprintf(stderr, "Unable to write heatmap to %s\n", heatmapFile);
+	}
 	// Print some memory usage stats, if requested.
 	if (memstats)
 	{
@@ -189,11 +582,12 @@ int main(int argc, char **argv)
 					long)GC_get_total_bytes());
 		fprintf(stderr, "GC heap size: %lld bytes.\n",
 				(long long)GC_get_heap_size());
-		ast = nullptr;
+		fprintf(stderr, "GC collections: %lld\n", (long long)GC_get_gc_no());
+		program.clear();
 		replASTs.clear();
 		GC_gcollect_and_unmap();
 		fprintf(stderr, "After collection, GC heap size: %lld bytes.\n",
 				(long long)GC_get_heap_size());
 	}
-	return 0;
+	return exitStatus;
 }
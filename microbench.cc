@@ -0,0 +1,338 @@
+/**
+ * Microbenchmarks for the runtime primitives that MysoreScript code spends
+ * most of its time in.  Each benchmark calls the C++ functions directly, so
+ * that their costs can be measured without the interpreter or compiled code
+ * around them.
+ *
+ * Each benchmark is warmed up, then the number of iterations per sample is
+ * calibrated so that a sample takes at least a few milliseconds, and then a
+ * number of samples are timed.  The median, mean, standard deviation and
+ * minimum time per iteration are reported.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <functional>
+#include <string>
+#include <vector>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <gc.h>
+#include "parser.hh"
+#include "interpreter.hh"
+
+using namespace MysoreScript;
+
+namespace {
+/**
+ * The number of timed samples taken for each benchmark.
+ */
+int samples = 20;
+/**
+ * The minimum duration of a single sample, in seconds.  Short samples are
+ * dominated by timer overhead.
+ */
+const double minSampleSeconds = 0.005;
+/**
+ * If set, only benchmarks whose names contain this string are run.
+ */
+const char *filter = nullptr;
+/**
+ * A value that benchmarks write their results to, so that the compiler can't
+ * discard the work that they do.
+ */
+volatile uintptr_t sink;
+
+typedef std::chrono::steady_clock Clock;
+
+/**
+ * Returns the number of seconds taken to run `fn` `iterations` times.
+ */
+double timeIterations(const std::function<void()> &fn, size_t iterations)
+{
+	auto start = Clock::now();
+	for (size_t i=0 ; i<iterations ; i++)
+	{
+		fn();
+	}
+	std::chrono::duration<double> elapsed = Clock::now() - start;
+	return elapsed.count();
+}
+/**
+ * Run a benchmark and print a line of statistics about it.  The `fn` argument
+ * runs a single iteration.
+ */
+void bench(const std::string &name, const std::function<void()> &fn)
+{
+	if (filter && name.find(filter) == std::string::npos)
+	{
+		return;
+	}
+	// Warm up the caches and branch predictors and find a number of
+	// iterations that takes long enough to time accurately.
+	size_t iterations = 1;
+	while (timeIterations(fn, iterations) < minSampleSeconds)
+	{
+		iterations *= 2;
+	}
+	std::vector<double> times;
+	for (int i=0 ; i<samples ; i++)
+	{
+		times.push_back(timeIterations(fn, iterations) * 1e9 / iterations);
+	}
+	std::sort(times.begin(), times.end());
+	double mean = 0;
+	for (double t : times)
+	{
+		mean += t;
+	}
+	mean /= times.size();
+	double variance = 0;
+	for (double t : times)
+	{
+		variance += (t - mean) * (t - mean);
+	}
+	variance /= times.size() > 1 ? times.size() - 1 : 1;
+	size_t mid = times.size() / 2;
+	double median = (times.size() & 1) ? times[mid] :
+		(times[mid-1] + times[mid]) / 2;
+	printf("%-36s %12.1f %12.1f %10.1f %12.1f %10zu\n", name.c_str(), median,
+			mean, std::sqrt(variance), times[0], iterations);
+}
+/**
+ * Create a string object containing `length` copies of `c`.
+ */
+String *makeString(size_t length, char c)
+{
+	String *str = gcAlloc<String>(length, "String");
+	str->isa = &StringClass;
+	str->length = createSmallInteger(length);
+	memset(str->characters, c, length);
+	return str;
+}
+/**
+ * A method that does nothing, used to measure the cost of the call itself.
+ */
+Obj emptyMethod(Obj self, Selector)
+{
+	return self;
+}
+/**
+ * Construct a linear class hierarchy, `depth` classes deep, where only the
+ * root class has any methods.  The root has `methods` methods and the one with
+ * the selector `sel` is last, so every lookup from the leaf searches the whole
+ * hierarchy.  Returns the leaf class.  The classes are never freed.
+ */
+Class *makeHierarchy(int depth, int methods, Selector sel)
+{
+	Class *cls = new Class();
+	cls->className = "MicrobenchRoot";
+	cls->methodCount = methods;
+	cls->methodList = new Method[methods];
+	for (int i=0 ; i<methods ; i++)
+	{
+		std::string name = "microbenchMethod" + std::to_string(i);
+		cls->methodList[i].selector = (i == methods - 1) ? sel :
+			lookupSelector(name);
+		cls->methodList[i].args = 0;
+		cls->methodList[i].function = (CompiledMethod)emptyMethod;
+		cls->methodList[i].AST = nullptr;
+	}
+	for (int i=1 ; i<depth ; i++)
+	{
+		Class *subclass = new Class();
+		subclass->superclass = cls;
+		subclass->className = "MicrobenchSubclass";
+		subclass->methodList = nullptr;
+		cls = subclass;
+	}
+	return cls;
+}
+
+void benchMethodLookup()
+{
+	Selector sel = lookupSelector("microbenchTarget");
+	for (int depth : { 1, 4, 16, 64 })
+	{
+		Class *cls = makeHierarchy(depth, 8, sel);
+		bench("methodForSelector depth " + std::to_string(depth), [=]()
+			{
+				sink = (uintptr_t)methodForSelector(cls, sel);
+			});
+	}
+}
+
+void benchSelectorLookup()
+{
+	// Populate the selector table with a realistic number of entries before
+	// timing lookups of existing selectors.
+	std::vector<std::string> names;
+	for (int i=0 ; i<5000 ; i++)
+	{
+		names.push_back("selector" + std::to_string(i));
+		lookupSelector(names.back());
+	}
+	size_t next = 0;
+	bench("lookupSelector (5000 selectors)", [&]()
+		{
+			sink = lookupSelector(names[next]);
+			next = (next + 1) % names.size();
+		});
+}
+
+void benchArrayAtPut()
+{
+	Class *arrayClass = lookupClass("Array");
+	Selector atPut = lookupSelector("atPut");
+	for (intptr_t length : { 16, 256, 4096 })
+	{
+		// Grow a fresh array to `length` elements, one element at a time, as a
+		// MysoreScript loop appending to an array would.
+		bench("ArrayAtPut grow to " + std::to_string(length), [=]()
+			{
+				Obj arr = newObject(arrayClass);
+				CompiledMethod m = compiledMethodForSelector(arr, atPut);
+				for (intptr_t i=0 ; i<length ; i++)
+				{
+					Obj idx = createSmallInteger(i);
+					((Obj(*)(Obj, Selector, Obj, Obj))m)(arr, atPut, idx, idx);
+				}
+				sink = (uintptr_t)arr;
+			});
+	}
+}
+
+void benchStrings()
+{
+	Selector add = lookupSelector("add");
+	Selector compare = lookupSelector("compare");
+	for (size_t length : { 8, 64, 1024 })
+	{
+		// Keep the strings live in a GC-visible place for the duration.
+		Interpreter::Value a((Obj)makeString(length, 'a'));
+		Interpreter::Value b((Obj)makeString(length, 'a'));
+		Obj lhs = a;
+		Obj rhs = b;
+		typedef Obj(*BinaryMethod)(Obj, Selector, Obj);
+		BinaryMethod addFn = (BinaryMethod)compiledMethodForSelector(lhs, add);
+		BinaryMethod cmpFn =
+			(BinaryMethod)compiledMethodForSelector(lhs, compare);
+		bench("StringAdd length " + std::to_string(length), [=]()
+			{
+				sink = (uintptr_t)addFn(lhs, add, rhs);
+			});
+		// Equal strings are the worst case for comparison, because every
+		// character must be inspected.
+		bench("StringCmp length " + std::to_string(length), [=]()
+			{
+				sink = (uintptr_t)cmpFn(lhs, compare, rhs);
+			});
+	}
+}
+
+void benchCallCompiledMethod()
+{
+	Obj args[4] = { createSmallInteger(1), createSmallInteger(2),
+	                createSmallInteger(3), createSmallInteger(4) };
+	Obj receiver = createSmallInteger(42);
+	Selector sel = lookupSelector("microbenchTarget");
+	for (int argCount=0 ; argCount<=4 ; argCount++)
+	{
+		bench("callCompiledMethod " + std::to_string(argCount) + " args",
+			[&, argCount]()
+			{
+				sink = (uintptr_t)callCompiledMethod((CompiledMethod)emptyMethod,
+						receiver, sel, args, argCount);
+			});
+	}
+}
+
+void benchValue()
+{
+	Interpreter::Value obj((Obj)makeString(8, 'a'));
+	Obj heapObj = obj;
+	Obj smallInt = createSmallInteger(42);
+	Interpreter::Value v;
+	// Switching between objects that do and don't need to be visible to the
+	// GC allocates and frees the uncollectable holder each time.
+	bench("Value::set holder churn", [&]()
+		{
+			v = heapObj;
+			v = smallInt;
+		});
+	v = heapObj;
+	bench("Value::set object to object", [&]()
+		{
+			v = heapObj;
+		});
+}
+
+void benchCompile()
+{
+	Parser::MysoreScriptParser p;
+	Interpreter::Context C;
+	std::string source =
+		"func microbench(a, b)\n"
+		"{\n"
+		"	var c = a + b;\n"
+		"	if (c > 10) { return c - 10; }\n"
+		"	return c;\n"
+		"};\n";
+	pegmatite::StringInput input(source);
+	pegmatite::ErrorList el;
+	std::unique_ptr<AST::Statements> ast;
+	if (!p.parse(input, p.g.statements, p.g.ignored, el, ast))
+	{
+		Parser::reportErrors(el);
+		return;
+	}
+	// Interpreting the declaration creates the closure, which gives us its AST.
+	ast->interpret(C);
+	Closure *closure = (Closure*)*C.lookupSymbol("microbench");
+	AST::ClosureDecl *decl = closure->AST;
+	// Each compilation adds another module to the shared execution engine,
+	// which never frees modules or code, so this benchmark uses a noticeable
+	// amount of memory.
+	bench("compileClosure (small function)", [&]()
+		{
+			sink = (uintptr_t)decl->compileClosure(C.globalSymbols);
+		});
+}
+}
+
+int main(int argc, char **argv)
+{
+	int c;
+	while ((c = getopt(argc, argv, "hn:")) != -1)
+	{
+		switch (c)
+		{
+			case 'n':
+				samples = std::max(1, atoi(optarg));
+				break;
+			case 'h':
+			default:
+				fprintf(stderr, "usage: %s [-n {samples}] [filter]\n", argv[0]);
+				fprintf(stderr, " -n {samples}  Number of timed samples per benchmark\n");
+				fprintf(stderr, " filter        Only run benchmarks whose names contain filter\n");
+				return c == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+	if (optind < argc)
+	{
+		filter = argv[optind];
+	}
+	GC_init();
+	printf("%-36s %12s %12s %10s %12s %10s\n", "Benchmark", "Median ns",
+			"Mean ns", "Stddev", "Min ns", "Iterations");
+	benchMethodLookup();
+	benchSelectorLookup();
+	benchArrayAtPut();
+	benchStrings();
+	benchCallCompiledMethod();
+	benchValue();
+	benchCompile();
+	return 0;
+}
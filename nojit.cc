@@ -0,0 +1,163 @@
+/**
+ * Replacements for the JIT compiler, used by the interpreter-only build.  This
+ * is linked instead of compiler.cc, so that the resulting program doesn't
+ * depend on LLVM at all.
+ *
+ * The interpreter asks closures and methods to compile themselves when they
+ * become hot.  Here, that always fails, so they continue to be interpreted.
+ * None of the other functions can be reached without a `Compiler::Context`,
+ * which can't be created in this build, but they must exist because they are
+ * virtual functions of the AST classes.
+ */
+#include "ast.hh"
+#include <stdio.h>
+#include <stdlib.h>
+
+using namespace MysoreScript;
+using namespace AST;
+
+namespace {
+/**
+ * Report that code generation was reached in a build without a JIT, and abort.
+ */
+[[noreturn]] void noJIT(const char *fn)
+{
+	fprintf(stderr, "ERROR: %s called in a build without the JIT\n", fn);
+	abort();
+}
+}
+
+CompiledMethod ClosureDecl::compileMethod(Class *, Interpreter::SymbolTable &)
+{
+	return nullptr;
+}
+
+ClosureInvoke ClosureDecl::compileClosure(Interpreter::SymbolTable &)
+{
+	return nullptr;
+}
+
+llvm::Value *ClosureDecl::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Call::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void Statements::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void Return::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void ImportStatement::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void IfStatement::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void WhileLoop::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *StringLiteral::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Number::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void Decl::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+void Assignment::compile(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *VarRef::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *NewExpr::compileExpression(Compiler::Context &)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpNe::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpEq::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpGt::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpLt::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpGE::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *CmpLE::compileBinOp(Compiler::Context &, llvm::Value *,
+                                 llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Subtract::compileBinOp(Compiler::Context &, llvm::Value *,
+                                    llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Add::compileBinOp(Compiler::Context &, llvm::Value *,
+                               llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Multiply::compileBinOp(Compiler::Context &, llvm::Value *,
+                                    llvm::Value *)
+{
+	noJIT(__func__);
+}
+
+llvm::Value *Divide::compileBinOp(Compiler::Context &, llvm::Value *,
+                                  llvm::Value *)
+{
+	noJIT(__func__);
+}
@@ -1,12 +1,24 @@
 #include "parser.hh"
+#include "trace.hh"
 #include <sstream>
 #include <algorithm>
+#include <iostream>
+#include <atomic>
+#include <thread>
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
 
 namespace AST 
 {
+thread_local const char *currentSourceFile;
+
 void Number::construct(const pegmatite::InputRange &r,
                        pegmatite::ASTStack &st)
 {
+	Expression::construct(r, st);
 	std::stringstream stream;
 	for (char c : r)
 	{
@@ -28,6 +40,7 @@ void Identifier::construct(const pegmatite::InputRange &r,
 void StringLiteral::construct(const pegmatite::InputRange &r,
                        pegmatite::ASTStack &st)
 {
+	Expression::construct(r, st);
 	std::stringstream stream;
 	for (char c : r)
 	{
@@ -41,4 +54,377 @@ void StringLiteral::construct(const pegmatite::InputRange &r,
 		value.replace(newline, 2, "\n");
 	}
 }
+void ClosureDecl::construct(const pegmatite::InputRange &r,
+                            pegmatite::ASTStack &st)
+{
+	Expression::construct(r, st);
+	// FNV-1a over the text of the declaration, skipping comments and
+	// whitespace.  Whitespace between two word characters is hashed as a
+	// single space, so that it still separates the tokens.
+	uint64_t hash = 14695981039346656037ULL;
+	char last = 0;
+	bool space = false;
+	auto add = [&](char ch)
+	{
+		hash = (hash ^ (unsigned char)ch) * 1099511628211ULL;
+		last = ch;
+	};
+	auto isWord = [](char ch) { return isalnum(ch) || (ch == '_'); };
+	auto token = [&](char ch)
+	{
+		if (space && isWord(last) && isWord(ch))
+		{
+			add(' ');
+		}
+		space = false;
+		add(ch);
+	};
+	bool inString = false;
+	// Set after a backslash in a string.  As in the grammar, a backslash
+	// stops the quote after it from ending the string.
+	bool escape = false;
+	bool inComment = false;
+	// Set after a '/' that may start a comment.
+	bool slash = false;
+	char prev = 0;
+	for (char ch : r)
+	{
+		if (inComment)
+		{
+			if ((prev == '*') && (ch == '/'))
+			{
+				inComment = false;
+				space = true;
+				ch = 0;
+			}
+			prev = ch;
+			continue;
+		}
+		if (inString)
+		{
+			add(ch);
+			inString = escape || (ch != '"');
+			escape = (ch == '\\');
+			continue;
+		}
+		if (slash)
+		{
+			slash = false;
+			if (ch == '*')
+			{
+				inComment = true;
+				prev = 0;
+				continue;
+			}
+			token('/');
+		}
+		if (ch == '/')
+		{
+			slash = true;
+		}
+		else if (isspace(ch))
+		{
+			space = true;
+		}
+		else
+		{
+			token(ch);
+			inString = (ch == '"');
+		}
+	}
+	if (slash)
+	{
+		token('/');
+	}
+	structuralHash = hash;
+}
 } // namespace AST
+
+namespace Parser
+{
+void reportErrors(const pegmatite::ErrorList &el, const char *file)
+{
+	std::cerr << "errors: \n";
+	for (auto &err : el)
+	{
+		if (file)
+		{
+			std::cerr << file << ": ";
+		}
+		std::cerr << "line " << err.start.line
+		          << ", col " << err.finish.col <<  ": ";
+		std::cerr << "syntax error" << std::endl;
+	}
+}
+std::unique_ptr<AST::Statements> parseFile(MysoreScriptParser &p,
+                                           const char *file)
+{
+	std::unique_ptr<AST::Statements> ast;
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		fprintf(stderr, "ERROR: unable to open %s\n", file);
+		return nullptr;
+	}
+	Trace::Span span("parse", file);
+	pegmatite::AsciiFileInput input(fd);
+	pegmatite::ErrorList el;
+	AST::currentSourceFile = file;
+	bool parsed = p.parse(input, p.g.statements, p.g.ignored, el, ast);
+	AST::currentSourceFile = nullptr;
+	if (!parsed)
+	{
+		reportErrors(el, file);
+		return nullptr;
+	}
+	return ast;
+}
+
+namespace {
+/**
+ * Files smaller than this are always parsed as a single chunk: splitting them
+ * would cost more in thread start-up than it saves.
+ */
+const size_t minChunkSize = 64 * 1024;
+/**
+ * A unit of work for the parser threads.
+ */
+struct ParseJob
+{
+	/**
+	 * The file that this job is parsing part of.
+	 */
+	const char *file;
+	/**
+	 * The source text to parse.
+	 */
+	std::string text;
+	/**
+	 * The errors reported while parsing, if any.
+	 */
+	pegmatite::ErrorList errors;
+	/**
+	 * The resulting AST.
+	 */
+	std::unique_ptr<AST::Statements> ast;
+	/**
+	 * Set if the chunk parsed successfully.
+	 */
+	bool succeeded = false;
+};
+/**
+ * Read the entire contents of a file into a string.  Returns false if the file
+ * can't be read.
+ */
+bool readFile(const char *file, std::string &contents)
+{
+	int fd = open(file, O_RDONLY);
+	if (fd < 0)
+	{
+		return false;
+	}
+	char buffer[65536];
+	ssize_t len;
+	while ((len = read(fd, buffer, sizeof(buffer))) > 0)
+	{
+		contents.append(buffer, len);
+	}
+	close(fd);
+	return len == 0;
+}
+/**
+ * Returns true if `keyword` appears at index `i` in `src` as a complete word.
+ */
+bool isKeywordAt(const std::string &src, size_t i, const char *keyword)
+{
+	size_t len = strlen(keyword);
+	if (src.compare(i, len, keyword) != 0)
+	{
+		return false;
+	}
+	return (i + len >= src.size()) || !isalnum(src[i + len]);
+}
+/**
+ * Find the places where a source file can be split into independently
+ * parseable chunks.  These are the starts of lines that begin a top-level
+ * `class` or `func` declaration: outside of any braces, brackets, comments or
+ * strings, and after the end of the previous statement.  Splitting at the
+ * start of a line means that column numbers in the chunk are unchanged.
+ */
+std::vector<size_t> findSplitPoints(const std::string &src)
+{
+	std::vector<size_t> points;
+	int braces = 0;
+	int brackets = 0;
+	// The last character that was not whitespace or part of a comment.
+	char lastSignificant = ';';
+	size_t lineStart = 0;
+	bool onlySpaceOnLine = true;
+	for (size_t i=0 ; i<src.size() ; i++)
+	{
+		char c = src[i];
+		if (c == '\n')
+		{
+			lineStart = i + 1;
+			onlySpaceOnLine = true;
+			continue;
+		}
+		if (isspace(c))
+		{
+			continue;
+		}
+		// Skip comments.  Comments don't nest.
+		if ((c == '/') && (i + 1 < src.size()) && (src[i+1] == '*'))
+		{
+			size_t end = src.find("*/", i + 2);
+			if (end == std::string::npos)
+			{
+				break;
+			}
+			// If the comment spans lines, then whatever follows it isn't at
+			// the start of a line.
+			if (src.find('\n', i) < end)
+			{
+				onlySpaceOnLine = false;
+			}
+			i = end + 1;
+			continue;
+		}
+		if (onlySpaceOnLine && (braces == 0) && (brackets == 0) &&
+		    ((lastSignificant == ';') || (lastSignificant == '}')) &&
+		    (isKeywordAt(src, i, "class") || isKeywordAt(src, i, "func")) &&
+		    (lineStart > 0))
+		{
+			points.push_back(lineStart);
+		}
+		onlySpaceOnLine = false;
+		lastSignificant = c;
+		switch (c)
+		{
+			case '{': braces++; break;
+			case '}': braces--; break;
+			case '(': brackets++; break;
+			case ')': brackets--; break;
+			case '"':
+			{
+				// Skip the string, including escaped quotes.
+				for (i++ ; (i < src.size()) && (src[i] != '"') ; i++)
+				{
+					if (src[i] == '\\')
+					{
+						i++;
+					}
+				}
+				break;
+			}
+		}
+	}
+	return points;
+}
+/**
+ * Split the contents of a file into at most `maxChunks` jobs of roughly equal
+ * size and append them to `jobs`.
+ */
+void addJobs(const char *file, const std::string &src, size_t maxChunks,
+             std::vector<ParseJob> &jobs)
+{
+	size_t chunks = std::min(maxChunks, src.size() / minChunkSize);
+	std::vector<size_t> starts = { 0 };
+	if (chunks > 1)
+	{
+		std::vector<size_t> points = findSplitPoints(src);
+		// Pick the split point closest to each of the ideal boundaries.
+		auto point = points.begin();
+		for (size_t i=1 ; i<chunks ; i++)
+		{
+			size_t ideal = src.size() / chunks * i;
+			point = std::lower_bound(point, points.end(), ideal);
+			if (point == points.end())
+			{
+				break;
+			}
+			starts.push_back(*(point++));
+		}
+	}
+	starts.push_back(src.size());
+	size_t line = 1;
+	size_t lineCountedTo = 0;
+	for (size_t i=0 ; i+1<starts.size() ; i++)
+	{
+		line += std::count(src.begin() + lineCountedTo,
+		                   src.begin() + starts[i], '\n');
+		lineCountedTo = starts[i];
+		jobs.emplace_back();
+		ParseJob &job = jobs.back();
+		job.file = file;
+		// Pad the chunk with a newline for each line that precedes it, so
+		// that the line numbers that Pegmatite reports (and that the AST
+		// records) match the original file.  Skipping blank lines is very
+		// cheap in comparison to parsing real statements.
+		job.text.assign(line - 1, '\n');
+		job.text.append(src, starts[i], starts[i+1] - starts[i]);
+	}
+}
+}
+
+bool parseFiles(const std::vector<const char*> &files,
+                std::vector<SourceChunk> &chunks)
+{
+	size_t threads = std::max(1U, std::thread::hardware_concurrency());
+	std::vector<ParseJob> jobs;
+	for (const char *file : files)
+	{
+		std::string src;
+		if (!readFile(file, src))
+		{
+			fprintf(stderr, "ERROR: unable to read %s\n", file);
+			return false;
+		}
+		addJobs(file, src, threads, jobs);
+	}
+	// Make sure that the grammar singleton is constructed before any of the
+	// worker threads need it.
+	MysoreScriptGrammar::get();
+	// Each worker claims the next unparsed job until there are none left.
+	// Every thread uses its own parser, because the parser delegate holds the
+	// AST construction state.
+	std::atomic<size_t> nextJob(0);
+	auto worker = [&]()
+	{
+		MysoreScriptParser p;
+		for (size_t i = nextJob++ ; i<jobs.size() ; i = nextJob++)
+		{
+			ParseJob &job = jobs[i];
+			Trace::Span span("parse", job.file);
+			pegmatite::StringInput input(job.text);
+			AST::currentSourceFile = job.file;
+			job.succeeded = p.parse(input, p.g.statements, p.g.ignored,
+			                        job.errors, job.ast);
+		}
+		AST::currentSourceFile = nullptr;
+	};
+	std::vector<std::thread> workers;
+	for (size_t i=1 ; i<std::min(threads, jobs.size()) ; i++)
+	{
+		workers.emplace_back(worker);
+	}
+	// The main thread does its share of the work too.
+	worker();
+	for (auto &t : workers)
+	{
+		t.join();
+	}
+	bool succeeded = true;
+	for (auto &job : jobs)
+	{
+		if (!job.succeeded)
+		{
+			reportErrors(job.errors, job.file);
+			succeeded = false;
+			continue;
+		}
+		chunks.push_back({ job.file, std::move(job.ast) });
+	}
+	return succeeded;
+}
+} // namespace Parser
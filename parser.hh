@@ -1,3 +1,4 @@
+#pragma once
 #include "grammar.hh"
 #include "ast.hh"
 
@@ -36,6 +37,7 @@ namespace Parser
 		CONNECT(Statements, statements);
 		CONNECT(ClassDecl, cls);
 		CONNECT(NewExpr, newExpr);
+		CONNECT(ImportStatement, importStmt);
 #undef CONNECT
 		public:
 		/**
@@ -43,4 +45,43 @@ namespace Parser
 		 */
 		const MysoreScriptGrammar &g = MysoreScriptGrammar::get();
 	};
+	/**
+	 * Print the errors from a failed parse to the standard error stream.  If
+	 * a file name is provided, then it is included in each message.
+	 */
+	void reportErrors(const pegmatite::ErrorList &el, const char *file=nullptr);
+	/**
+	 * Parse the named file, reporting any errors.  Returns the AST for the
+	 * statements in the file, or a null pointer if the file could not be
+	 * opened or contained syntax errors.
+	 */
+	std::unique_ptr<AST::Statements> parseFile(MysoreScriptParser &p,
+	                                           const char *file);
+	/**
+	 * A piece of a source file that has been parsed independently of the rest
+	 * of the file.
+	 */
+	struct SourceChunk
+	{
+		/**
+		 * The name of the file that this chunk came from.
+		 */
+		const char *file;
+		/**
+		 * The statements in this chunk.
+		 */
+		std::unique_ptr<AST::Statements> ast;
+	};
+	/**
+	 * Parse a set of files, using one thread per core.  Each file is parsed
+	 * independently and large files are also split into several chunks at
+	 * top-level `class` and `func` declarations, because the grammar has no
+	 * context that crosses a top-level statement boundary.  On success, the
+	 * chunks are returned in source order (all of the first file, then all of
+	 * the second, and so on) and executing them in turn is equivalent to
+	 * executing the concatenation of the files.  Errors are reported with the
+	 * correct file name and line number and cause this to return false.
+	 */
+	bool parseFiles(const std::vector<const char*> &files,
+	                std::vector<SourceChunk> &chunks);
 }
@@ -0,0 +1,273 @@
+#include "perfcounters.hh"
+#include <chrono>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <gc.h>
+#ifdef __linux__
+#	include <linux/perf_event.h>
+#	include <sys/syscall.h>
+#endif
+
+namespace {
+/**
+ * A hardware event that we try to count.
+ */
+struct Counter
+{
+	/**
+	 * The name used in the report.
+	 */
+	const char *name;
+	/**
+	 * The `perf_event_attr` type of the event.
+	 */
+	uint32_t type;
+	/**
+	 * The `perf_event_attr` config of the event.
+	 */
+	uint64_t config;
+	/**
+	 * The file descriptor for the counter, or -1 if it could not be opened.
+	 */
+	int fd;
+};
+#ifdef __linux__
+/**
+ * Encode a cache event as a `perf_event_attr` config value.
+ */
+constexpr uint64_t cacheMisses(uint64_t cache)
+{
+	return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+		(PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+Counter counters[] = {
+	{ "Instructions",  PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, -1 },
+	{ "Cycles",        PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1 },
+	{ "Branch misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, -1 },
+	{ "L1D misses",    PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_L1D), -1 },
+	{ "LLC misses",    PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_LL), -1 },
+	{ "dTLB misses",   PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_DTLB), -1 },
+	{ "iTLB misses",   PERF_TYPE_HW_CACHE, cacheMisses(PERF_COUNT_HW_CACHE_ITLB), -1 }
+};
+#else
+Counter counters[] = {
+	{ "Instructions",  0, 0, -1 },
+	{ "Cycles",        0, 0, -1 },
+	{ "Branch misses", 0, 0, -1 },
+	{ "L1D misses",    0, 0, -1 },
+	{ "LLC misses",    0, 0, -1 },
+	{ "dTLB misses",   0, 0, -1 },
+	{ "iTLB misses",   0, 0, -1 }
+};
+#endif
+/**
+ * The number of counters.
+ */
+const int counterCount = sizeof(counters) / sizeof(counters[0]);
+/**
+ * The names of the phases, indexed by `PerfCounters::Phase`.
+ */
+const char *phaseNames[] = { "Setup", "Parse", "Execution", "Compile", "GC" };
+/**
+ * The counts and time accumulated for a phase.
+ */
+struct PhaseData
+{
+	/**
+	 * The nesting depth of the phase.  Only the outermost `begin()` and
+	 * `end()` pair is measured.
+	 */
+	int depth;
+	/**
+	 * The number of times that the phase was entered.
+	 */
+	uint64_t count;
+	/**
+	 * The counter values and time when the outermost `begin()` was called.
+	 */
+	uint64_t startValues[counterCount];
+	std::chrono::steady_clock::time_point startTime;
+	/**
+	 * The accumulated counts for the phase.
+	 */
+	uint64_t totals[counterCount];
+	/**
+	 * The accumulated time for the phase, in seconds.
+	 */
+	double seconds;
+} phases[PerfCounters::PhaseCount];
+/**
+ * The collection event handler that was installed before ours, if any.
+ */
+GC_on_collection_event_proc previousGCEvent;
+
+/**
+ * Read the current value of each counter.  Counters that are multiplexed with
+ * others are scaled up to estimate the full count.  The values of counters
+ * that are not open are set to zero.
+ */
+void readCounters(uint64_t *values)
+{
+	for (int i=0 ; i<counterCount ; i++)
+	{
+		values[i] = 0;
+		// The value, the time enabled and the time running.
+		uint64_t data[3];
+		if (counters[i].fd < 0 ||
+		    read(counters[i].fd, data, sizeof(data)) != sizeof(data))
+		{
+			continue;
+		}
+		values[i] = data[0];
+		if (data[2] != 0 && data[2] < data[1])
+		{
+			values[i] = (uint64_t)((double)data[0] * data[1] / data[2]);
+		}
+	}
+}
+/**
+ * Collection event handler.  Measures the time spent in the collector.
+ */
+void gcEvent(GC_EventType event)
+{
+	if (event == GC_EVENT_START)
+	{
+		PerfCounters::begin(PerfCounters::GC);
+	}
+	else if (event == GC_EVENT_END)
+	{
+		PerfCounters::end(PerfCounters::GC);
+	}
+	if (previousGCEvent)
+	{
+		previousGCEvent(event);
+	}
+}
+}
+
+namespace PerfCounters
+{
+bool active;
+
+bool start()
+{
+	int opened = 0;
+	int error = ENOSYS;
+#ifdef __linux__
+	for (auto &c : counters)
+	{
+		struct perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = c.type;
+		attr.config = c.config;
+		attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED |
+			PERF_FORMAT_TOTAL_TIME_RUNNING;
+		// Count only this process's user-space work, including the parser
+		// threads, so that the counts are as repeatable as possible.
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		attr.inherit = 1;
+		c.fd = syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+		if (c.fd < 0)
+		{
+			error = errno;
+			continue;
+		}
+		opened++;
+	}
+#endif
+	if (opened == 0)
+	{
+		fprintf(stderr, "Hardware performance counters unavailable (%s), "
+				"reporting times only\n", strerror(error));
+	}
+	active = true;
+	return opened > 0;
+}
+
+void measureCollections()
+{
+	if (!active)
+	{
+		return;
+	}
+	previousGCEvent = GC_get_on_collection_event();
+	GC_set_on_collection_event(gcEvent);
+}
+
+void begin(Phase p)
+{
+	PhaseData &data = phases[p];
+	if (!active || data.depth++ > 0)
+	{
+		return;
+	}
+	data.count++;
+	data.startTime = std::chrono::steady_clock::now();
+	readCounters(data.startValues);
+}
+
+void end(Phase p)
+{
+	PhaseData &data = phases[p];
+	if (!active || data.depth == 0 || --data.depth > 0)
+	{
+		return;
+	}
+	uint64_t values[counterCount];
+	readCounters(values);
+	std::chrono::duration<double> elapsed =
+		std::chrono::steady_clock::now() - data.startTime;
+	data.seconds += elapsed.count();
+	for (int i=0 ; i<counterCount ; i++)
+	{
+		data.totals[i] += values[i] - data.startValues[i];
+	}
+}
+
+void report()
+{
+	if (!active)
+	{
+		return;
+	}
+	fprintf(stderr, "%-10s %8s %10s", "Phase", "Count", "Seconds");
+	for (auto &c : counters)
+	{
+		fprintf(stderr, " %15s", c.name);
+	}
+	fprintf(stderr, " %6s\n", "IPC");
+	for (int p=0 ; p<PhaseCount ; p++)
+	{
+		PhaseData &data = phases[p];
+		fprintf(stderr, "%-10s %8llu %10.6f", phaseNames[p],
+				(unsigned long long)data.count, data.seconds);
+		for (int i=0 ; i<counterCount ; i++)
+		{
+			if (counters[i].fd < 0)
+			{
+				fprintf(stderr, " %15s", "-");
+			}
+			else
+			{
+				fprintf(stderr, " %15llu", (unsigned long long)data.totals[i]);
+			}
+		}
+		// Instructions per cycle.
+		if (counters[0].fd >= 0 && counters[1].fd >= 0 && data.totals[1])
+		{
+			fprintf(stderr, " %6.2f\n",
+					(double)data.totals[0] / (double)data.totals[1]);
+		}
+		else
+		{
+			fprintf(stderr, " %6s\n", "-");
+		}
+	}
+	fprintf(stderr, "Execution includes Compile and GC, and any phase may "
+			"include GC.\n");
+}
+}
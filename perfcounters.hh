@@ -0,0 +1,101 @@
+#pragma once
+#include <stdint.h>
+
+/**
+ * Hardware performance counters, read around each phase of execution.  Wall
+ * clock times are noisy on shared machines, but counts such as the number of
+ * instructions retired are almost deterministic and so make a much better
+ * signal for spotting small regressions.
+ *
+ * On Linux, the counters are read with `perf_event_open`.  Only user-space
+ * events are counted.  Counters that the kernel or the hardware doesn't
+ * support are left out of the report.  If none are available, only the times
+ * are reported.
+ */
+namespace PerfCounters
+{
+	/**
+	 * The phases that counters are accumulated for.  Phases may nest: the
+	 * execution phase includes any compilation and collection that happens
+	 * while code is running, and any phase may include garbage collection.
+	 */
+	enum Phase
+	{
+		Setup,
+		Parse,
+		Execution,
+		Compile,
+		GC,
+		PhaseCount
+	};
+	/**
+	 * Are phases being measured?
+	 */
+	extern bool active;
+	/**
+	 * Open the counters and start measuring phases.  This must be called
+	 * before any threads are created, so that they inherit the counters.
+	 * Returns false if no hardware counters could be opened, in which case
+	 * phases are still timed.
+	 */
+	bool start();
+	/**
+	 * Start measuring garbage collections as the `GC` phase.  This installs
+	 * a collector event hook, so it must be called after `GC_init()`, which
+	 * happens after `start()` so that initialising the collector is counted
+	 * as part of setup.  Does nothing if `start()` has not been called.
+	 */
+	void measureCollections();
+	/**
+	 * Print the counts and times for each phase to the standard error stream.
+	 */
+	void report();
+	/**
+	 * Start measuring a phase.  If the phase is already being measured then
+	 * this only increments its nesting depth.
+	 */
+	void begin(Phase p);
+	/**
+	 * Stop measuring a phase, adding the counts since the matching `begin()`
+	 * to its totals.
+	 */
+	void end(Phase p);
+	/**
+	 * Measures a phase for the lifetime of this object.
+	 */
+	class Scope
+	{
+		/**
+		 * The phase being measured, or `PhaseCount` if nothing is being
+		 * measured.
+		 */
+		Phase phase = PhaseCount;
+		public:
+		/**
+		 * Start measuring the specified phase, if counters are active.
+		 */
+		Scope(Phase p)
+		{
+			if (active)
+			{
+				phase = p;
+				begin(p);
+			}
+		}
+		/**
+		 * Stop measuring the phase now, rather than when this is destroyed.
+		 */
+		void end()
+		{
+			if (phase != PhaseCount)
+			{
+				PerfCounters::end(phase);
+				phase = PhaseCount;
+			}
+		}
+		/**
+		 * Stops measuring the phase, if it has not already been stopped.
+		 */
+		~Scope() { end(); }
+	};
+}
@@ -0,0 +1,219 @@
+#include "perfmap.hh"
+#include <elf.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+/**
+ * The perf map file, if one is being written.
+ */
+FILE *perfMap;
+/**
+ * The jitdump file, if one is being written.
+ */
+FILE *jitDump;
+/**
+ * The mapping of the jitdump file.  Perf finds the jitdump file by looking for
+ * an executable mapping of it in the profile, so this must exist for as long
+ * as the file is being written, but it is never accessed.
+ */
+void *jitDumpMarker;
+/**
+ * The number of functions written to the jitdump file so far.  Each one must
+ * have a unique index.
+ */
+uint64_t codeIndex;
+
+/**
+ * The header at the start of a jitdump file.
+ */
+struct JitDumpHeader
+{
+	/** Magic number: 'JiTD' */
+	uint32_t magic;
+	/** The version of the format. */
+	uint32_t version;
+	/** The size of this header. */
+	uint32_t totalSize;
+	/** The ELF machine architecture of the code. */
+	uint32_t elfMach;
+	/** Padding, must be zero. */
+	uint32_t pad1;
+	/** The process ID of the JIT. */
+	uint32_t pid;
+	/** The time at which the file was created. */
+	uint64_t timestamp;
+	/** Flags, currently unused. */
+	uint64_t flags;
+};
+/**
+ * The record types in a jitdump file that we use.
+ */
+enum JitDumpRecordType
+{
+	/** A function has been loaded. */
+	JitCodeLoad = 0,
+	/** The JIT has finished writing records. */
+	JitCodeClose = 3
+};
+/**
+ * The prefix of every record in a jitdump file.
+ */
+struct JitDumpRecordHeader
+{
+	/** The record type. */
+	uint32_t id;
+	/** The size of the record, including this header. */
+	uint32_t totalSize;
+	/** The time at which the event occurred. */
+	uint64_t timestamp;
+};
+/**
+ * A record describing a newly loaded function.  This is followed by the
+ * null-terminated function name and then by the code.
+ */
+struct JitDumpCodeLoad
+{
+	/** The common record header. */
+	JitDumpRecordHeader header;
+	/** The process ID. */
+	uint32_t pid;
+	/** The thread ID. */
+	uint32_t tid;
+	/** The virtual address of the code. */
+	uint64_t vma;
+	/** The address of the code.  This is the same as `vma` for us. */
+	uint64_t codeAddr;
+	/** The size of the code. */
+	uint64_t codeSize;
+	/** A unique index for this function. */
+	uint64_t codeIndex;
+};
+
+/**
+ * Returns the current time in nanoseconds, using the clock that `perf record
+ * -k mono` uses for its own timestamps.
+ */
+uint64_t timestamp()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+/**
+ * Returns the ELF machine type for the architecture that we are running on.
+ */
+uint32_t elfMachine()
+{
+#if defined(__x86_64__)
+	return EM_X86_64;
+#elif defined(__aarch64__)
+	return EM_AARCH64;
+#else
+	return EM_NONE;
+#endif
+}
+/**
+ * Open the jitdump file and write its header.
+ */
+bool openJitDump()
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/jit-%d.dump", (int)getpid());
+	int fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0666);
+	if (fd < 0)
+	{
+		return false;
+	}
+	jitDumpMarker = mmap(nullptr, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC,
+			MAP_PRIVATE, fd, 0);
+	if (jitDumpMarker == MAP_FAILED)
+	{
+		jitDumpMarker = nullptr;
+		::close(fd);
+		return false;
+	}
+	jitDump = fdopen(fd, "wb");
+	JitDumpHeader header;
+	memset(&header, 0, sizeof(header));
+	header.magic = 0x4A695444;
+	header.version = 1;
+	header.totalSize = sizeof(header);
+	header.elfMach = elfMachine();
+	header.pid = getpid();
+	header.timestamp = timestamp();
+	fwrite(&header, sizeof(header), 1, jitDump);
+	return true;
+}
+}
+
+namespace PerfMap
+{
+bool enable(bool jitdump)
+{
+	char path[64];
+	snprintf(path, sizeof(path), "/tmp/perf-%d.map", (int)getpid());
+	perfMap = fopen(path, "w");
+	if (!perfMap)
+	{
+		return false;
+	}
+	return !jitdump || openJitDump();
+}
+
+void recordFunction(const char *name, const void *start, size_t size)
+{
+	if (perfMap)
+	{
+		fprintf(perfMap, "%lx %zx %s\n", (unsigned long)start, size, name);
+		// Flush after every entry so that the map is complete even if the
+		// process is killed while it is being profiled.
+		fflush(perfMap);
+	}
+	if (jitDump)
+	{
+		size_t nameSize = strlen(name) + 1;
+		JitDumpCodeLoad record;
+		record.header.id = JitCodeLoad;
+		record.header.totalSize = sizeof(record) + nameSize + size;
+		record.header.timestamp = timestamp();
+		record.pid = getpid();
+		record.tid = syscall(SYS_gettid);
+		record.vma = (uintptr_t)start;
+		record.codeAddr = (uintptr_t)start;
+		record.codeSize = size;
+		record.codeIndex = codeIndex++;
+		fwrite(&record, sizeof(record), 1, jitDump);
+		fwrite(name, nameSize, 1, jitDump);
+		fwrite(start, size, 1, jitDump);
+		fflush(jitDump);
+	}
+}
+
+void close()
+{
+	if (perfMap)
+	{
+		fclose(perfMap);
+		perfMap = nullptr;
+	}
+	if (jitDump)
+	{
+		JitDumpRecordHeader record;
+		record.id = JitCodeClose;
+		record.totalSize = sizeof(record);
+		record.timestamp = timestamp();
+		fwrite(&record, sizeof(record), 1, jitDump);
+		fclose(jitDump);
+		jitDump = nullptr;
+		munmap(jitDumpMarker, sysconf(_SC_PAGESIZE));
+		jitDumpMarker = nullptr;
+	}
+}
+}
@@ -0,0 +1,30 @@
+#pragma once
+#include <stddef.h>
+
+/**
+ * Support for telling Linux `perf` about JIT-compiled code.  Two formats are
+ * supported.  The first is the simple perf map file, `/tmp/perf-{pid}.map`,
+ * which `perf report` reads to symbolise addresses in anonymous memory.  The
+ * second is the jitdump format, which also contains a copy of the generated
+ * code so that `perf annotate` can disassemble it.  The jitdump file must be
+ * merged into a profile with `perf inject --jit`, and the profile must be
+ * recorded with `perf record -k mono` so that the timestamps match.
+ */
+namespace PerfMap
+{
+	/**
+	 * Start recording compiled functions.  The perf map is always written; if
+	 * `jitdump` is true then a jitdump file is written as well.  Returns false
+	 * if the files could not be created.
+	 */
+	bool enable(bool jitdump);
+	/**
+	 * Record a function that the JIT has emitted.  Does nothing unless
+	 * recording has been enabled.
+	 */
+	void recordFunction(const char *name, const void *start, size_t size);
+	/**
+	 * Finish recording and close the files.
+	 */
+	void close();
+}
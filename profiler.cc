@@ -0,0 +1,341 @@
+#include "profiler.hh"
+#include "ast.hh"
+#include "coroutine.hh"
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <ucontext.h>
+
+#ifndef MAP_NORESERVE
+#	define MAP_NORESERVE 0
+#endif
+
+namespace {
+/**
+ * The maximum depth of the shadow stack.  Frames deeper than this are not
+ * recorded, and samples taken while they are running are marked as truncated.
+ */
+const int maxDepth = 256;
+/**
+ * The shadow stack.  Each entry is a pointer to the AST for the closure or
+ * method that is running, with the low bit set if it is compiled code.
+ */
+uintptr_t shadowStack[maxDepth];
+/**
+ * The number of MysoreScript frames that are currently live.  This may exceed
+ * `maxDepth`.  Only the signal handler reads this asynchronously, and it runs
+ * on the same thread, so this only needs to be protected against the compiler
+ * reordering accesses.
+ */
+volatile sig_atomic_t depth;
+/**
+ * The number of words reserved for the sample buffer.  The buffer is only
+ * reserved, not committed, so memory is only used as samples are recorded.
+ */
+const size_t bufferWords = 32 * 1024 * 1024;
+/**
+ * The buffer that samples are recorded in.  Each sample is recorded as the
+ * stack depth, the interrupted program counter and then one word for each
+ * recorded frame, from the outermost inwards.  The signal handler can't
+ * allocate memory, so samples are aggregated when the profiler is stopped.
+ */
+uintptr_t *buffer;
+/**
+ * The number of words in `buffer` that have been used.
+ */
+volatile size_t bufferUsed;
+/**
+ * The number of samples that were discarded because the buffer was full.
+ */
+volatile size_t droppedSamples;
+/**
+ * Map from the start address of each function that the JIT has emitted to its
+ * end address.
+ */
+std::map<uintptr_t, uintptr_t> compiledCode;
+/**
+ * The shadow stack of a coroutine that is not running.  Each stack (the
+ * thread's own and each generator's) has its own frames, which are swapped in
+ * and out of `shadowStack` as the thread switches between them.
+ */
+struct SavedFrames
+{
+	/**
+	 * The saved depth, which may exceed `maxDepth`.
+	 */
+	int depth;
+	/**
+	 * The recorded frames, at most `maxDepth` of them.
+	 */
+	std::vector<uintptr_t> frames;
+};
+/**
+ * The shadow stacks of the stacks that aren't running, indexed by task
+ * identifier.
+ */
+std::unordered_map<uint64_t, SavedFrames> suspendedFrames;
+/**
+ * Lock protecting `suspendedFrames`.  Destroy handlers may run on any thread.
+ */
+std::mutex suspendedFramesLock;
+/**
+ * The identifiers of the coroutine switch and destroy handlers that save and
+ * discard the shadow stacks of suspended coroutines.
+ */
+int switchHandler = -1;
+int destroyHandler = -1;
+
+/**
+ * Save the shadow stack of the stack being switched away from and install the
+ * one for the stack being switched to.  Without this, frames from a generator
+ * and its consumer would be interleaved, and a generator that was abandoned
+ * while suspended would leave its frames on the stack forever.
+ */
+void switchFrames(uint64_t from, uint64_t to)
+{
+	int d = depth;
+	int recorded = d < maxDepth ? d : maxDepth;
+	std::lock_guard<std::mutex> lock(suspendedFramesLock);
+	if (d > 0)
+	{
+		SavedFrames &saved = suspendedFrames[from];
+		saved.depth = d;
+		saved.frames.assign(shadowStack, shadowStack + recorded);
+	}
+	// Hide the frames from the signal handler while they are replaced.
+	depth = 0;
+	std::atomic_signal_fence(std::memory_order_seq_cst);
+	auto I = suspendedFrames.find(to);
+	if (I == suspendedFrames.end())
+	{
+		return;
+	}
+	std::copy(I->second.frames.begin(), I->second.frames.end(), shadowStack);
+	std::atomic_signal_fence(std::memory_order_release);
+	depth = I->second.depth;
+	suspendedFrames.erase(I);
+}
+
+/**
+ * Extract the interrupted program counter from the context passed to a signal
+ * handler.  Returns 0 on unsupported platforms.
+ */
+uintptr_t programCounter(void *context)
+{
+	ucontext_t *uc = (ucontext_t*)context;
+#if defined(__linux__) && defined(__x86_64__)
+	return uc->uc_mcontext.gregs[REG_RIP];
+#elif defined(__FreeBSD__) && defined(__x86_64__)
+	return uc->uc_mcontext.mc_rip;
+#else
+	(void)uc;
+	return 0;
+#endif
+}
+/**
+ * Returns true if the address is inside a function emitted by the JIT.
+ */
+bool isCompiledCode(uintptr_t pc)
+{
+	auto I = compiledCode.upper_bound(pc);
+	if (I == compiledCode.begin())
+	{
+		return false;
+	}
+	--I;
+	return pc < I->second;
+}
+/**
+ * The `SIGPROF` handler.  Copies the shadow stack into the sample buffer.
+ */
+void takeSample(int, siginfo_t *, void *context)
+{
+	int d = depth;
+	int recorded = d < maxDepth ? d : maxDepth;
+	size_t used = bufferUsed;
+	if (used + recorded + 2 > bufferWords)
+	{
+		droppedSamples = droppedSamples + 1;
+		return;
+	}
+	buffer[used] = d;
+	buffer[used+1] = programCounter(context);
+	for (int i=0 ; i<recorded ; i++)
+	{
+		buffer[used+2+i] = shadowStack[i];
+	}
+	bufferUsed = used + recorded + 2;
+}
+}
+
+namespace Profiler
+{
+bool active;
+
+bool start(int frequency)
+{
+	buffer = (uintptr_t*)mmap(nullptr, bufferWords * sizeof(uintptr_t),
+			PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANON | MAP_NORESERVE, -1, 0);
+	if (buffer == MAP_FAILED)
+	{
+		buffer = nullptr;
+		return false;
+	}
+	struct sigaction sa;
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_sigaction = takeSample;
+	// Restart any system calls that the sample interrupts, so that the
+	// profiler doesn't change the behaviour of I/O.
+	sa.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigemptyset(&sa.sa_mask);
+	if (sigaction(SIGPROF, &sa, nullptr) != 0)
+	{
+		return false;
+	}
+	switchHandler = Coroutine::addSwitchHandler(switchFrames);
+	destroyHandler = Coroutine::addDestroyHandler([](uint64_t task)
+		{
+			std::lock_guard<std::mutex> lock(suspendedFramesLock);
+			suspendedFrames.erase(task);
+		});
+	active = true;
+	struct itimerval interval;
+	interval.it_interval.tv_sec = 0;
+	interval.it_interval.tv_usec = 1000000 / frequency;
+	interval.it_value = interval.it_interval;
+	if (setitimer(ITIMER_PROF, &interval, nullptr) != 0)
+	{
+		active = false;
+		return false;
+	}
+	return true;
+}
+
+void stop(const char *file)
+{
+	if (!buffer)
+	{
+		return;
+	}
+	struct itimerval off;
+	memset(&off, 0, sizeof(off));
+	setitimer(ITIMER_PROF, &off, nullptr);
+	signal(SIGPROF, SIG_IGN);
+	active = false;
+	Coroutine::removeSwitchHandler(switchHandler);
+	Coroutine::removeDestroyHandler(destroyHandler);
+	{
+		std::lock_guard<std::mutex> lock(suspendedFramesLock);
+		suspendedFrames.clear();
+	}
+	// Aggregate the samples by stack.  Names are cached because constructing
+	// them is relatively expensive and each function appears in many samples.
+	std::map<std::string, size_t> stacks;
+	std::unordered_map<uintptr_t, std::string> names;
+	for (size_t i=0 ; i<bufferUsed ; )
+	{
+		int d = buffer[i];
+		uintptr_t pc = buffer[i+1];
+		uintptr_t *frames = &buffer[i+2];
+		int recorded = d < maxDepth ? d : maxDepth;
+		std::string stack = recorded ? "" : "[toplevel]";
+		for (int j=0 ; j<recorded ; j++)
+		{
+			std::string &name = names[frames[j]];
+			if (name.empty())
+			{
+				auto *fn = (AST::ClosureDecl*)(frames[j] & ~(uintptr_t)1);
+				name = fn->displayName();
+				// Flame graph tools colour frames with this suffix as JIT
+				// compiled code.
+				if (frames[j] & 1)
+				{
+					name += "_[j]";
+				}
+			}
+			if (j > 0)
+			{
+				stack += ';';
+			}
+			stack += name;
+		}
+		if (d > maxDepth)
+		{
+			stack += ";[truncated]";
+		}
+		// If the innermost frame is compiled, but the sample wasn't taken in
+		// JIT-compiled code, then it was taken in a runtime function called
+		// from the compiled code (method lookup, allocation and so on).
+		else if (recorded && (frames[recorded-1] & 1) && pc &&
+		         !isCompiledCode(pc))
+		{
+			stack += ";[runtime]";
+		}
+		stacks[stack]++;
+		i += recorded + 2;
+	}
+	munmap(buffer, bufferWords * sizeof(uintptr_t));
+	buffer = nullptr;
+	bufferUsed = 0;
+	FILE *out = fopen(file, "w");
+	if (!out)
+	{
+		fprintf(stderr, "ERROR: unable to write profile to %s\n", file);
+		return;
+	}
+	for (auto &s : stacks)
+	{
+		fprintf(out, "%s %zu\n", s.first.c_str(), s.second);
+	}
+	fclose(out);
+	if (droppedSamples)
+	{
+		fprintf(stderr, "Profiler buffer full, %zu samples dropped\n",
+				(size_t)droppedSamples);
+	}
+}
+
+void enterFunction(AST::ClosureDecl *fn, bool compiled)
+{
+	int d = depth;
+	if (d < maxDepth)
+	{
+		shadowStack[d] = (uintptr_t)fn | (compiled ? 1 : 0);
+	}
+	// Make sure that the frame is written before it becomes visible to the
+	// signal handler.
+	std::atomic_signal_fence(std::memory_order_release);
+	depth = d + 1;
+}
+
+void exitFunction()
+{
+	depth = depth - 1;
+}
+
+void registerCompiledCode(const void *start, size_t size)
+{
+	compiledCode[(uintptr_t)start] = (uintptr_t)start + size;
+}
+}
+
+extern "C"
+{
+void mysoreScriptProfilerEnter(AST::ClosureDecl *fn)
+{
+	Profiler::enterFunction(fn, true);
+}
+void mysoreScriptProfilerExit()
+{
+	Profiler::exitFunction();
+}
+}
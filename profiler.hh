@@ -0,0 +1,63 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+
+namespace AST
+{
+	struct ClosureDecl;
+}
+
+/**
+ * A sampling profiler for MysoreScript code.  The profiler maintains a shadow
+ * stack of the MysoreScript closures and methods that are currently executing,
+ * in both the interpreter and compiled code, and a `SIGPROF` timer records a
+ * copy of it at regular intervals of CPU time.  When profiling stops, the
+ * samples are written in the 'folded stacks' format used by flame graph tools.
+ *
+ * Each generator runs on its own stack and has its own shadow stack, which is
+ * saved when it yields and restored when it is resumed, so samples taken in a
+ * generator body show only the generator's frames.
+ */
+namespace Profiler
+{
+	/**
+	 * Is the profiler running?  The interpreter only maintains the shadow stack
+	 * while this is set, and the compiler only inserts the calls that maintain
+	 * it into functions that are compiled while it is set.
+	 */
+	extern bool active;
+	/**
+	 * Start collecting samples, at approximately the specified number per
+	 * second of CPU time.  Returns false if the timer could not be installed.
+	 */
+	bool start(int frequency=1000);
+	/**
+	 * Stop collecting samples and write the folded stacks to the named file.
+	 */
+	void stop(const char *file);
+	/**
+	 * Record entry into a MysoreScript closure or method.
+	 */
+	void enterFunction(AST::ClosureDecl *fn, bool compiled);
+	/**
+	 * Record exit from the most recently entered function.
+	 */
+	void exitFunction();
+	/**
+	 * Record that the JIT has emitted code for a function, so that samples
+	 * taken while executing it can be attributed to compiled code.
+	 */
+	void registerCompiledCode(const void *start, size_t size);
+}
+
+extern "C"
+{
+/**
+ * Called on entry to compiled functions when the profiler is active.
+ */
+void mysoreScriptProfilerEnter(AST::ClosureDecl *fn);
+/**
+ * Called on every exit from compiled functions when the profiler is active.
+ */
+void mysoreScriptProfilerExit();
+}
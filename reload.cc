@@ -0,0 +1,206 @@
+#include "reload.hh"
+#include "parser.hh"
+#include "safepoint.hh"
+#include <memory>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace AST;
+using namespace MysoreScript;
+
+namespace {
+/**
+ * The ASTs of files that have been reloaded.  These are never freed, because
+ * the closures and methods that they define refer to their AST nodes.
+ */
+std::vector<std::unique_ptr<Statements>> reloaded;
+/**
+ * The names of the files that have been reloaded.  The AST nodes refer to
+ * these, and the elements of an unordered set don't move.
+ */
+std::unordered_set<std::string> fileNames;
+/**
+ * Returns the value as a closure, or null if it is not one.
+ */
+Closure *asClosure(Obj o)
+{
+	if (!o || isInteger(o) || (o->isa != &ClosureClass))
+	{
+		return nullptr;
+	}
+	return (Closure*)o;
+}
+/**
+ * Returns true if a class declaration has the same superclass and instance
+ * variables as an existing class, so that existing instances still fit it.
+ */
+bool sameLayout(ClassDecl *decl, Class *cls)
+{
+	Class *superclass = decl->name ?
+		lookupClass(decl->superclassName->name) : nullptr;
+	if ((superclass != cls->superclass) ||
+	    ((size_t)cls->indexedIVarCount != decl->ivars.size()))
+	{
+		return false;
+	}
+	size_t i = 0;
+	for (auto &ivar : decl->ivars)
+	{
+		if (ivar->name->name != cls->indexedIVarNames[i++])
+		{
+			return false;
+		}
+	}
+	return true;
+}
+/**
+ * Point everything that referred to a replaced function at its replacement:
+ * global variables and the bound variables of closures stored in globals,
+ * which capture the values of the functions that they call.
+ */
+void rebind(Interpreter::Context &c,
+            const std::unordered_map<Obj, Obj> &replacements)
+{
+	if (replacements.empty())
+	{
+		return;
+	}
+	auto replace = [&](Obj &o)
+	{
+		auto I = replacements.find(o);
+		if (I != replacements.end())
+		{
+			o = I->second;
+		}
+	};
+	for (auto &global : c.globalSymbols)
+	{
+		replace(*global.second);
+		Closure *closure = asClosure(*global.second);
+		if (!closure || !closure->AST)
+		{
+			continue;
+		}
+		for (size_t i=0, e=closure->AST->boundVariableCount() ; i<e ; i++)
+		{
+			replace(closure->boundVars[i]);
+		}
+	}
+}
+}
+
+namespace Reload
+{
+bool reloadFile(Interpreter::Context &c, const char *file, Summary &summary)
+{
+	file = fileNames.insert(file).first->c_str();
+	Parser::MysoreScriptParser p;
+	std::unique_ptr<Statements> ast = Parser::parseFile(p, file);
+	if (!ast)
+	{
+		return false;
+	}
+	// Imports are relative to the file's directory.
+	std::string dir(file);
+	size_t slash = dir.rfind('/');
+	c.moduleDirectories.push_back(slash == std::string::npos ? "." :
+			dir.substr(0, slash));
+	// The functions that have been replaced, mapped to their replacements.
+	std::unordered_map<Obj, Obj> replacements;
+	// Declarations are swapped in with the world stopped, but initialisers
+	// and imports run arbitrary code, so the world is restarted for them.
+	bool stopped = false;
+	auto stop = [&]()
+	{
+		if (!stopped)
+		{
+			Safepoint::stopTheWorld();
+			stopped = true;
+		}
+	};
+	auto resume = [&]()
+	{
+		if (stopped)
+		{
+			Safepoint::resumeTheWorld();
+			stopped = false;
+		}
+	};
+	for (auto &s : ast->statements)
+	{
+		if (ClosureDecl *fn = dynamic_cast<ClosureDecl*>(s.get()))
+		{
+			const std::string &name = fn->name->name;
+			Obj *slot = c.lookupSymbol(name);
+			Closure *old = slot ? asClosure(*slot) : nullptr;
+			if (old && old->AST &&
+			    (old->AST->structuralHash == fn->structuralHash))
+			{
+				summary.unchanged++;
+				continue;
+			}
+			stop();
+			// Evaluating the declaration stores the new closure in the
+			// function's global.
+			fn->evaluate(c);
+			if (old)
+			{
+				replacements[(Obj)old] = *c.lookupSymbol(name);
+			}
+			summary.changed++;
+		}
+		else if (ClassDecl *cls = dynamic_cast<ClassDecl*>(s.get()))
+		{
+			const std::string &name = cls->name ? cls->name->name :
+				cls->superclassName->name;
+			Class *existing = lookupClass(name);
+			stop();
+			if (existing && sameLayout(cls, existing))
+			{
+				size_t kept = cls->reloadInto(existing);
+				summary.unchanged += kept;
+				summary.changed += cls->methods.size() - kept;
+				continue;
+			}
+			cls->interpret(c);
+			summary.changed += cls->methods.size();
+			if (!existing)
+			{
+				continue;
+			}
+			// Existing instances can't be given the new layout, so they keep
+			// the old class, but subclasses inherit from the new one.
+			summary.replacedClasses++;
+			Class *replacement = lookupClass(name);
+			for (Class *sub : registeredClasses())
+			{
+				if (sub->superclass == existing)
+				{
+					sub->superclass = replacement;
+				}
+			}
+		}
+		else if (Decl *decl = dynamic_cast<Decl*>(s.get()))
+		{
+			// Reloading doesn't reset variables that already exist.
+			if (!c.lookupSymbol(decl->name->name))
+			{
+				resume();
+				decl->interpret(c);
+			}
+		}
+		else if (dynamic_cast<ImportStatement*>(s.get()))
+		{
+			resume();
+			s->interpret(c);
+		}
+	}
+	stop();
+	rebind(c, replacements);
+	resume();
+	c.moduleDirectories.pop_back();
+	reloaded.push_back(std::move(ast));
+	return true;
+}
+}
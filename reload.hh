@@ -0,0 +1,46 @@
+#pragma once
+#include "interpreter.hh"
+
+/**
+ * Hot reloading.  Reloading a file parses it again and compares each
+ * top-level function and each method with the one that is currently defined,
+ * using the structural hashes computed by the parser.  Unchanged functions
+ * and methods are kept, along with any code that has been compiled for them,
+ * so only the ones that changed start again in the interpreter.
+ *
+ * Changed functions are swapped in through their global variables and
+ * changed methods through their classes' method tables, with every other
+ * thread stopped at a safepoint.  Closures that captured a replaced function
+ * are updated to refer to the new one.  Top-level statements other than
+ * declarations are not run again, so reloading doesn't reset the program's
+ * state; `var` declarations only run for variables that don't exist yet.
+ */
+namespace Reload
+{
+	/**
+	 * What a reload changed.
+	 */
+	struct Summary
+	{
+		/**
+		 * Functions and methods that were kept.
+		 */
+		size_t unchanged = 0;
+		/**
+		 * Functions and methods that are new or have changed.
+		 */
+		size_t changed = 0;
+		/**
+		 * Classes whose superclass or instance variables changed.  These are
+		 * replaced by new classes, and existing instances keep the old one.
+		 */
+		size_t replacedClasses = 0;
+	};
+	/**
+	 * Reload a file into the given context, which must be executing
+	 * top-level code.  Returns false, without changing anything, if the file
+	 * can't be parsed.
+	 */
+	bool reloadFile(Interpreter::Context &c, const char *file,
+	                Summary &summary);
+}
@@ -1,8 +1,18 @@
 #include "runtime.hh"
+#include "channel.hh"
+#include "coroutine.hh"
+#include "eventloop.hh"
+#include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <algorithm>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 #include <gc.h>
@@ -20,8 +30,10 @@ std::vector<std::string> selNames;
 
 /**
  * Invalid method function.  Returned when method lookup fails.  This logs a
- * message indicating the error.
+ * message indicating the error.  It is only called when a program has a bug,
+ * so it is marked as cold to keep it away from the code that matters.
  */
+__attribute__((cold))
 Obj invalidMethod(Obj obj, Selector sel)
 {
 	auto selName = selNames[sel];
@@ -37,17 +49,6 @@ Obj invalidMethod(Obj obj, Selector sel)
 	return nullptr;
 }
 
-/**
- * The structure representing MysoreScript `File` objects.
- */
-struct File
-{
-	/** The class pointer. */
-	Class    *isa;
-	/** The file descriptor to use. */
-	intptr_t  fd;
-};
-
 /**
  * The `open` method on `File` objects.  Files can only be opened in one mode
  * by MysoreScript (read/write, create if doesn't exist).
@@ -58,6 +59,7 @@ File *FileOpen(File *f, Selector sel, String *file)
 	{
 		close(f->fd);
 	}
+	f->buffer = nullptr;
 	// The file name must be a string
 	if (file == nullptr || isInteger((Obj)file) || file->isa != &StringClass)
 	{
@@ -78,41 +80,147 @@ Obj FileClose(File *f, Selector sel)
 		close(f->fd);
 		f->fd = 0;
 	}
+	f->buffer = nullptr;
 	return (Obj)f;
 }
 
 /**
  * The `readline` method on `File` objects.  Constructs a `String` containing
- * the line.
+ * the line, or returns null for an empty line.  If the file is non-blocking
+ * (because it is being watched by an event loop) and a complete line has not
+ * arrived yet, then this returns null and leaves the partial line in the
+ * buffer.
  */
 String *FileReadLine(File *f, Selector sel)
 {
-	int fd = f->fd ? f->fd : STDIN_FILENO;
-	std::string buffer;
-	char c;
-	// This is very inefficient
-	while (1 == read(fd, &c, 1))
+	String *line = nextLine(f);
+	if (line && (getInteger(line->length) == 0))
+	{
+		return nullptr;
+	}
+	return line;
+}
+
+/**
+ * The `atEnd` method on `File` objects.  Returns 1 if a read has reached the
+ * end of the file and every line has been read, 0 otherwise.
+ */
+Obj FileAtEnd(File *f, Selector sel)
+{
+	FileBuffer *b = f->buffer;
+	return createSmallInteger(b && b->eof && (b->start == b->end));
+}
+
+/**
+ * The longest that `writeAll()` waits for a file descriptor to become
+ * writable before polling for a safepoint, in milliseconds.
+ */
+const int WriteWaitMilliseconds = 10;
+/**
+ * Write all of `length` bytes from `data`, waiting if the file descriptor is
+ * non-blocking.  While waiting for a slow reader, this polls for safepoints,
+ * so budgets still apply and the thread can be stopped.  Returns false if the
+ * write fails or the thread starts unwinding before it finishes.
+ */
+bool writeAll(int fd, const char *data, size_t length)
+{
+	while (length > 0)
 	{
-		if (c == '\n')
+		ssize_t written = write(fd, data, length);
+		if (written > 0)
 		{
-			break;
+			data += written;
+			length -= written;
+			continue;
 		}
-		buffer.push_back(c);
+		if ((written < 0) && (errno == EINTR))
+		{
+			continue;
+		}
+		if ((written < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK)))
+		{
+			struct pollfd writable = { fd, POLLOUT, 0 };
+			poll(&writable, 1, WriteWaitMilliseconds);
+			if (Safepoint::poll())
+			{
+				return false;
+			}
+			continue;
+		}
+		return false;
 	}
-	uintptr_t len = buffer.size();
-	if (len == 0)
+	return true;
+}
+
+/**
+ * The buffer for standard output.  Scripts used as filters write a short
+ * string for each line of input, so this turns many small writes into one
+ * system call per buffer-full.
+ */
+const size_t StandardOutputBufferSize = 64 * 1024;
+char standardOutputBuffer[StandardOutputBufferSize];
+/**
+ * The number of bytes in `standardOutputBuffer`.
+ */
+size_t standardOutputUsed;
+/**
+ * Protects the buffer, which is shared by every thread.
+ */
+std::mutex standardOutputLock;
+/**
+ * Is standard output buffered?  Decided on the first write.
+ */
+enum { Undecided, Buffered, Unbuffered } standardOutputMode = Undecided;
+
+/**
+ * Write the contents of the standard output buffer.  Must be called with
+ * `standardOutputLock` held.
+ */
+bool flushStandardOutputLocked()
+{
+	size_t used = standardOutputUsed;
+	standardOutputUsed = 0;
+	return writeAll(STDOUT_FILENO, standardOutputBuffer, used);
+}
+
+/**
+ * Write to standard output, through the buffer unless it is a terminal, in
+ * which case output should appear immediately.
+ */
+bool writeStandardOutput(const char *data, size_t length)
+{
+	std::lock_guard<std::mutex> guard(standardOutputLock);
+	if (standardOutputMode == Undecided)
 	{
-		return nullptr;
+		standardOutputMode = isatty(STDOUT_FILENO) ? Unbuffered : Buffered;
+		if (standardOutputMode == Buffered)
+		{
+			atexit(flushStandardOutput);
+		}
 	}
-	String *newStr = gcAlloc<String>(len);
-	newStr->isa = &StringClass;
-	newStr->length = createSmallInteger(len);
-	memcpy(newStr->characters, buffer.c_str(), len);
-	return newStr;
+	if (standardOutputMode == Unbuffered)
+	{
+		return writeAll(STDOUT_FILENO, data, length);
+	}
+	if ((standardOutputUsed + length > StandardOutputBufferSize) &&
+	    !flushStandardOutputLocked())
+	{
+		return false;
+	}
+	// Strings that don't fit in the buffer are written directly.
+	if (length >= StandardOutputBufferSize)
+	{
+		return writeAll(STDOUT_FILENO, data, length);
+	}
+	memcpy(standardOutputBuffer + standardOutputUsed, data, length);
+	standardOutputUsed += length;
+	return true;
 }
 
 /**
- * The `write` method on `File` objects.
+ * The `write` method on `File` objects.  Waits until all of the data has been
+ * written, even if the file is non-blocking.  Writes to standard output are
+ * buffered.
  */
 Obj FileWrite(File *f, Selector sel, String *data)
 {
@@ -121,10 +229,435 @@ Obj FileWrite(File *f, Selector sel, String *data)
 	{
 		return nullptr;
 	}
-	int fd = f->fd ? f->fd : STDOUT_FILENO;
-	// FIXME: Handle interrupted system calls correctly!
-	write(fd, data->characters, getInteger(data->length));
-	return (Obj)f;
+	size_t length = getInteger(data->length);
+	bool written = f->fd ? writeAll(f->fd, data->characters, length) :
+		writeStandardOutput(data->characters, length);
+	return written ? (Obj)f : nullptr;
+}
+
+/**
+ * Fill in the address of the Unix domain socket named by `path`.  Returns
+ * false if `path` is not a string or is too long.
+ */
+bool unixSocketAddress(String *path, struct sockaddr_un &addr)
+{
+	if (path == nullptr || isInteger((Obj)path) || path->isa != &StringClass)
+	{
+		return false;
+	}
+	size_t len = getInteger(path->length);
+	if (len >= sizeof(addr.sun_path))
+	{
+		return false;
+	}
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	memcpy(addr.sun_path, path->characters, len);
+	return true;
+}
+/**
+ * The `listen` method on `File` objects.  Creates a Unix domain socket at the
+ * specified path, replacing any existing socket there, and listens for
+ * connections, which are returned by `accept`.
+ */
+File *FileListen(File *f, Selector sel, String *path)
+{
+	FileClose(f, sel);
+	struct sockaddr_un addr;
+	if (!unixSocketAddress(path, addr))
+	{
+		return nullptr;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+	unlink(addr.sun_path);
+	if ((bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) ||
+	    (listen(fd, SOMAXCONN) != 0))
+	{
+		close(fd);
+		return nullptr;
+	}
+	f->fd = fd;
+	return f;
+}
+/**
+ * The `connect` method on `File` objects.  Connects to the Unix domain socket
+ * at the specified path.
+ */
+File *FileConnect(File *f, Selector sel, String *path)
+{
+	FileClose(f, sel);
+	struct sockaddr_un addr;
+	if (!unixSocketAddress(path, addr))
+	{
+		return nullptr;
+	}
+	int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0)
+	{
+		close(fd);
+		return nullptr;
+	}
+	f->fd = fd;
+	return f;
+}
+/**
+ * The `accept` method on `File` objects that are listening.  Returns a new
+ * `File` for the next connection, or null if there isn't one waiting and the
+ * socket is non-blocking.
+ */
+Obj FileAccept(File *f, Selector sel)
+{
+	int fd;
+	do
+	{
+		fd = accept(f->fd, nullptr, nullptr);
+	} while ((fd < 0) && (errno == EINTR));
+	if (fd < 0)
+	{
+		return nullptr;
+	}
+	File *connection = (File*)newObject(&FileClass);
+	connection->fd = fd;
+	return (Obj)connection;
+}
+
+/**
+ * The function that a generator's coroutine runs.  Calls the body, passing the
+ * generator as the argument.
+ */
+void GeneratorRun(void *arg)
+{
+	Obj generator = (Obj)arg;
+	Closure *body = (Closure*)((Generator*)arg)->body;
+	callCompiledClosure(body->invoke, body, &generator, 1);
+}
+/**
+ * The `start` method on `Generator` objects.  Sets the closure that produces
+ * the values.  The closure does not start running until the first call to
+ * `next`.
+ */
+Obj GeneratorStart(Generator *g, Selector sel, Obj body)
+{
+	if (body == nullptr || isInteger(body) || body->isa != &ClosureClass)
+	{
+		fprintf(stderr, "\nERROR: a generator's body must be a closure\n");
+		return nullptr;
+	}
+	if (g->task)
+	{
+		fprintf(stderr, "\nERROR: generator has already been started\n");
+		return nullptr;
+	}
+	g->body = body;
+	g->task = Coroutine::create(GeneratorRun, g);
+	if (!g->task)
+	{
+		fprintf(stderr, "\nERROR: unable to allocate a generator stack\n");
+		return nullptr;
+	}
+	return (Obj)g;
+}
+/**
+ * The `next` method on `Generator` objects.  Runs the body until it yields a
+ * value, and returns that value, or returns null if the body has finished.
+ */
+Obj GeneratorNext(Generator *g, Selector sel)
+{
+	if (!g->task)
+	{
+		return nullptr;
+	}
+	if (Coroutine::state(g->task) == Coroutine::State::Running)
+	{
+		fprintf(stderr, "\nERROR: generator resumed while it is running\n");
+		return nullptr;
+	}
+	if (!Coroutine::resume(g->task))
+	{
+		return nullptr;
+	}
+	Obj value = g->value;
+	g->value = nullptr;
+	return value;
+}
+/**
+ * The `yield` method on `Generator` objects.  Passes a value to the consumer
+ * and suspends the body until the consumer asks for the next one.  This may
+ * only be called from the generator's own body, or from functions that it
+ * calls.
+ */
+Obj GeneratorYield(Generator *g, Selector sel, Obj value)
+{
+	if (!g->task || (Coroutine::current() != g->task))
+	{
+		fprintf(stderr, "\nERROR: yield called outside of the generator\n");
+		return nullptr;
+	}
+	g->value = value;
+	Coroutine::suspend();
+	return nullptr;
+}
+/**
+ * The `finished` method on `Generator` objects.  Returns 1 if the body has
+ * returned (or was never started) and 0 otherwise.
+ */
+Obj GeneratorFinished(Generator *g, Selector sel)
+{
+	bool finished = !g->task ||
+		(Coroutine::state(g->task) == Coroutine::State::Finished);
+	return createSmallInteger(finished);
+}
+
+/**
+ * Returns the channel's queue, or logs an error and returns null if the
+ * channel has not been opened.
+ */
+Channel::Queue *queueForChannel(ChannelObject *ch)
+{
+	if (!ch->queue)
+	{
+		fprintf(stderr, "\nERROR: channel has not been opened\n");
+	}
+	return ch->queue;
+}
+/**
+ * The `open` method on `Channel` objects.  Creates the queue, with room for
+ * the specified number of values.  Channels must be opened before they are
+ * used.
+ */
+Obj ChannelOpen(ChannelObject *ch, Selector sel, Obj capacity)
+{
+	if (!isInteger(capacity) || (getInteger(capacity) < 1))
+	{
+		fprintf(stderr, "\nERROR: channel capacity must be a positive number\n");
+		return nullptr;
+	}
+	if ((size_t)getInteger(capacity) > Channel::MaxCapacity)
+	{
+		fprintf(stderr, "\nERROR: channel capacity must be at most %zu\n",
+				Channel::MaxCapacity);
+		return nullptr;
+	}
+	Channel::Queue *q = Channel::create(getInteger(capacity));
+	if (!q)
+	{
+		fprintf(stderr, "\nERROR: unable to allocate channel\n");
+		return nullptr;
+	}
+	ch->queue = q;
+	return (Obj)ch;
+}
+/**
+ * The `send` method on `Channel` objects.  Returns the channel, or null if it
+ * is full or closed.  Nothing else can run while the program waits, so this
+ * doesn't wait for space.
+ */
+Obj ChannelSend(ChannelObject *ch, Selector sel, Obj value)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	return (q && Channel::send(q, value)) ? (Obj)ch : nullptr;
+}
+/**
+ * The `trySend` method on `Channel` objects.  Returns 1 if the value was sent
+ * or 0 if the channel was full or closed.
+ */
+Obj ChannelTrySend(ChannelObject *ch, Selector sel, Obj value)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	return createSmallInteger(q && Channel::send(q, value));
+}
+/**
+ * The `receive` method on `Channel` objects.  Returns null if the channel is
+ * empty, without waiting for a value.
+ */
+Obj ChannelReceive(ChannelObject *ch, Selector sel)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	return q ? Channel::receive(q) : nullptr;
+}
+/**
+ * The `tryReceive` method on `Channel` objects.  Returns null if the channel
+ * is empty.
+ */
+Obj ChannelTryReceive(ChannelObject *ch, Selector sel)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	return q ? Channel::receive(q) : nullptr;
+}
+/**
+ * The `receiveMany` method on `Channel` objects.  Returns an array of all of
+ * the values that are waiting, up to the specified maximum, or null if the
+ * channel is empty.
+ */
+Obj ChannelReceiveMany(ChannelObject *ch, Selector sel, Obj max)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	if (!q || !isInteger(max) || (getInteger(max) < 1))
+	{
+		return nullptr;
+	}
+	// There can never be more values waiting than the channel holds, so
+	// don't allocate space for more.
+	size_t size = std::min((size_t)getInteger(max), Channel::capacity(q));
+	// Receive directly into the new array's buffer.
+	Obj *buffer = (Obj*)gcAllocBuffer(size * sizeof(Obj), "Array buffer");
+	if (!buffer)
+	{
+		fprintf(stderr, "\nERROR: unable to allocate array\n");
+		return nullptr;
+	}
+	size_t count = Channel::receiveMany(q, buffer, size);
+	if (count == 0)
+	{
+		return nullptr;
+	}
+	Array *arr = (Array*)newObject(&ArrayClass);
+	arr->buffer = buffer;
+	arr->bufferSize = createSmallInteger(size);
+	arr->length = createSmallInteger(count);
+	return (Obj)arr;
+}
+/**
+ * The `close` method on `Channel` objects.
+ */
+Obj ChannelClose(ChannelObject *ch, Selector sel)
+{
+	Channel::Queue *q = queueForChannel(ch);
+	if (q)
+	{
+		Channel::close(q);
+	}
+	return (Obj)ch;
+}
+
+/**
+ * Returns the loop for an `EventLoop` object, creating it if necessary, or
+ * logs an error and returns null if it can't be created.
+ */
+EventLoop::Loop *loopForObject(EventLoopObject *obj)
+{
+	if (!obj->loop)
+	{
+		obj->loop = EventLoop::create();
+		if (!obj->loop)
+		{
+			fprintf(stderr, "\nERROR: unable to create an event loop\n");
+		}
+	}
+	return obj->loop;
+}
+/**
+ * Returns true if `obj` is a closure, logging an error otherwise.
+ */
+bool isCallback(Obj obj)
+{
+	if (obj == nullptr || isInteger(obj) || obj->isa != &ClosureClass)
+	{
+		fprintf(stderr, "\nERROR: event loop callbacks must be closures\n");
+		return false;
+	}
+	return true;
+}
+/**
+ * The `watch` method on `EventLoop` objects.  Calls the closure with the file
+ * whenever data arrives on it.
+ */
+Obj EventLoopWatch(EventLoopObject *obj, Selector sel, File *file,
+                   Obj callback)
+{
+	if (file == nullptr || isInteger((Obj)file) || file->isa != &FileClass)
+	{
+		fprintf(stderr, "\nERROR: event loops can only watch files\n");
+		return nullptr;
+	}
+	EventLoop::Loop *l = loopForObject(obj);
+	if (!l || !isCallback(callback) ||
+	    !EventLoop::watch(l, file, (Closure*)callback))
+	{
+		return nullptr;
+	}
+	return (Obj)obj;
+}
+/**
+ * The `unwatch` method on `EventLoop` objects.
+ */
+Obj EventLoopUnwatch(EventLoopObject *obj, Selector sel, File *file)
+{
+	if (obj->loop && file && !isInteger((Obj)file) &&
+	    (file->isa == &FileClass))
+	{
+		EventLoop::unwatch(obj->loop, file);
+	}
+	return (Obj)obj;
+}
+/**
+ * Add a timer to an `EventLoop` object.
+ */
+Obj addTimer(EventLoopObject *obj, Obj milliseconds, Obj callback,
+             bool repeat)
+{
+	if (!isInteger(milliseconds))
+	{
+		fprintf(stderr, "\nERROR: timer intervals must be numbers\n");
+		return nullptr;
+	}
+	EventLoop::Loop *l = loopForObject(obj);
+	if (!l || !isCallback(callback))
+	{
+		return nullptr;
+	}
+	EventLoop::addTimer(l, getInteger(milliseconds), repeat,
+			(Closure*)callback);
+	return (Obj)obj;
+}
+/**
+ * The `after` method on `EventLoop` objects.  Calls the closure with the loop
+ * once, after the specified number of milliseconds.
+ */
+Obj EventLoopAfter(EventLoopObject *obj, Selector sel, Obj milliseconds,
+                   Obj callback)
+{
+	return addTimer(obj, milliseconds, callback, false);
+}
+/**
+ * The `every` method on `EventLoop` objects.  Calls the closure with the loop
+ * every time the specified number of milliseconds passes.
+ */
+Obj EventLoopEvery(EventLoopObject *obj, Selector sel, Obj milliseconds,
+                   Obj callback)
+{
+	return addTimer(obj, milliseconds, callback, true);
+}
+/**
+ * The `run` method on `EventLoop` objects.  Returns when the loop is stopped
+ * or there are no files or timers left.
+ */
+Obj EventLoopRun(EventLoopObject *obj, Selector sel)
+{
+	if (EventLoop::Loop *l = loopForObject(obj))
+	{
+		EventLoop::run(l, (Obj)obj);
+	}
+	return (Obj)obj;
+}
+/**
+ * The `stop` method on `EventLoop` objects.
+ */
+Obj EventLoopStop(EventLoopObject *obj, Selector sel)
+{
+	if (obj->loop)
+	{
+		EventLoop::stop(obj->loop);
+	}
+	return (Obj)obj;
 }
 
 /**
@@ -210,7 +743,8 @@ Obj ArrayAtPut(Array *arr, Selector sel, Obj idx, Obj obj)
 		// little bit, which should make life a bit more interesting for
 		// students...
 		size_t newSize = i + 1;
-		Obj *buffer = (Obj*)GC_MALLOC(newSize * sizeof(Obj));
+		Obj *buffer = (Obj*)gcAllocBuffer(newSize * sizeof(Obj),
+				"Array buffer");
 		memcpy(buffer, arr->buffer, len * sizeof(Obj));
 		arr->buffer = buffer;
 		arr->bufferSize = createSmallInteger(newSize);
@@ -254,7 +788,7 @@ Obj StringAdd(String *str, Selector sel, String *other)
 	uintptr_t len1 = getInteger(str->length);
 	uintptr_t len2 = getInteger(other->length);
 	uintptr_t lenTotal = len1+len2;
-	String *newStr = gcAlloc<String>(lenTotal);
+	String *newStr = gcAlloc<String>(lenTotal, "String");
 	newStr->isa = &StringClass;
 	newStr->length = createSmallInteger(lenTotal);
 	memcpy(newStr->characters, str->characters, len1);
@@ -310,6 +844,25 @@ enum StaticSelectors
 	close,
 	readline,
 	write,
+	start,
+	next,
+	yield,
+	finished,
+	send,
+	trySend,
+	receive,
+	tryReceive,
+	receiveMany,
+	atEnd,
+	listen,
+	connect,
+	accept,
+	watch,
+	unwatch,
+	after,
+	every,
+	run,
+	stop,
 	LAST_STATIC_SELECTOR
 };
 
@@ -332,7 +885,26 @@ const char *StaticSelectorNames[] =
 	"open",
 	"close",
 	"readline",
-	"write"
+	"write",
+	"start",
+	"next",
+	"yield",
+	"finished",
+	"send",
+	"trySend",
+	"receive",
+	"tryReceive",
+	"receiveMany",
+	"atEnd",
+	"listen",
+	"connect",
+	"accept",
+	"watch",
+	"unwatch",
+	"after",
+	"every",
+	"run",
+	"stop"
 };
 static_assert(sizeof(StaticSelectorNames) / sizeof(char*) ==
 		LAST_STATIC_SELECTOR-1, "Static selector names and enum out of sync");
@@ -365,6 +937,150 @@ struct Method FileMethods[] =
 		0,
 		(CompiledMethod)FileWrite,
 		nullptr
+	},
+	{
+		atEnd,
+		0,
+		(CompiledMethod)FileAtEnd,
+		nullptr
+	},
+	{
+		listen,
+		1,
+		(CompiledMethod)FileListen,
+		nullptr
+	},
+	{
+		connect,
+		1,
+		(CompiledMethod)FileConnect,
+		nullptr
+	},
+	{
+		accept,
+		0,
+		(CompiledMethod)FileAccept,
+		nullptr
+	}
+};
+/**
+ * Methods for the generator class.
+ */
+struct Method GeneratorMethods[] =
+{
+	{
+		start,
+		1,
+		(CompiledMethod)GeneratorStart,
+		nullptr
+	},
+	{
+		next,
+		0,
+		(CompiledMethod)GeneratorNext,
+		nullptr
+	},
+	{
+		yield,
+		1,
+		(CompiledMethod)GeneratorYield,
+		nullptr
+	},
+	{
+		finished,
+		0,
+		(CompiledMethod)GeneratorFinished,
+		nullptr
+	}
+};
+/**
+ * Methods for the channel class.
+ */
+struct Method ChannelMethods[] =
+{
+	{
+		open,
+		1,
+		(CompiledMethod)ChannelOpen,
+		nullptr
+	},
+	{
+		send,
+		1,
+		(CompiledMethod)ChannelSend,
+		nullptr
+	},
+	{
+		trySend,
+		1,
+		(CompiledMethod)ChannelTrySend,
+		nullptr
+	},
+	{
+		receive,
+		0,
+		(CompiledMethod)ChannelReceive,
+		nullptr
+	},
+	{
+		tryReceive,
+		0,
+		(CompiledMethod)ChannelTryReceive,
+		nullptr
+	},
+	{
+		receiveMany,
+		1,
+		(CompiledMethod)ChannelReceiveMany,
+		nullptr
+	},
+	{
+		close,
+		0,
+		(CompiledMethod)ChannelClose,
+		nullptr
+	}
+};
+/**
+ * Methods for the event loop class.
+ */
+struct Method EventLoopMethods[] =
+{
+	{
+		watch,
+		2,
+		(CompiledMethod)EventLoopWatch,
+		nullptr
+	},
+	{
+		unwatch,
+		1,
+		(CompiledMethod)EventLoopUnwatch,
+		nullptr
+	},
+	{
+		after,
+		2,
+		(CompiledMethod)EventLoopAfter,
+		nullptr
+	},
+	{
+		every,
+		2,
+		(CompiledMethod)EventLoopEvery,
+		nullptr
+	},
+	{
+		run,
+		0,
+		(CompiledMethod)EventLoopRun,
+		nullptr
+	},
+	{
+		stop,
+		0,
+		(CompiledMethod)EventLoopStop,
+		nullptr
 	}
 };
 /**
@@ -450,12 +1166,25 @@ const char *ArrayIvars[] = { "length", "bufferSize", "buffer" };
 /**
  * The names of the instance variables in the `File` class.
  */
-const char *FileIvars[] = { "fd" };
+const char *FileIvars[] = { "fd", "buffer" };
+/**
+ * The names of the instance variables in the `Generator` class.
+ */
+const char *GeneratorIvars[] = { "body", "value", "task" };
+/**
+ * The names of the instance variables in the `Channel` class.
+ */
+const char *ChannelIvars[] = { "queue" };
+/**
+ * The names of the instance variables in the `EventLoop` class.
+ */
+const char *EventLoopIvars[] = { "loop" };
 
 }
 
 namespace MysoreScript
 {
+thread_local AllocationAccount *allocationAccount;
 /**
  * The `String` class structure.
  */
@@ -480,6 +1209,42 @@ struct Class FileClass =
 	FileMethods,
 	FileIvars
 };
+/**
+ * The `Generator` class structure.
+ */
+struct Class GeneratorClass =
+{
+	NULL,
+	"Generator",
+	sizeof(GeneratorMethods) / sizeof(Method),
+	sizeof(GeneratorIvars) / sizeof(char*),
+	GeneratorMethods,
+	GeneratorIvars
+};
+/**
+ * The `Channel` class structure.
+ */
+struct Class ChannelClass =
+{
+	NULL,
+	"Channel",
+	sizeof(ChannelMethods) / sizeof(Method),
+	sizeof(ChannelIvars) / sizeof(char*),
+	ChannelMethods,
+	ChannelIvars
+};
+/**
+ * The `EventLoop` class structure.
+ */
+struct Class EventLoopClass =
+{
+	NULL,
+	"EventLoop",
+	sizeof(EventLoopMethods) / sizeof(Method),
+	sizeof(EventLoopIvars) / sizeof(char*),
+	EventLoopMethods,
+	EventLoopIvars
+};
 /**
  * The `Array` class structure.
  */
@@ -560,6 +1325,9 @@ static void registerClasses()
 		classTable["String"] = &StringClass;
 		classTable["Array"] = &ArrayClass;
 		classTable["File"] = &FileClass;
+		classTable["Generator"] = &GeneratorClass;
+		classTable["Channel"] = &ChannelClass;
+		classTable["EventLoop"] = &EventLoopClass;
 	}
 }
 
@@ -569,18 +1337,139 @@ void registerClass(const std::string &name, struct Class *cls)
 	classTable[name] = cls;
 }
 struct Class* lookupClass(const std::string &name)
+{
+	return *lookupClassSlot(name);
+}
+struct Class** lookupClassSlot(const std::string &name)
+{
+	registerClasses();
+	// References to elements in an unordered map remain valid when it is
+	// rehashed.
+	return &classTable[name];
+}
+std::vector<struct Class*> registeredClasses()
 {
 	registerClasses();
-	return classTable[name];
+	std::vector<struct Class*> classes;
+	for (auto &entry : classTable)
+	{
+		// Looking up a class that doesn't exist adds a null entry.
+		if (entry.second)
+		{
+			classes.push_back(entry.second);
+		}
+	}
+	return classes;
 }
 Obj newObject(struct Class *cls)
 {
 	// Allocate space for the object
-	Obj obj = gcAlloc<struct Object>(sizeof(Obj)*cls->indexedIVarCount);
+	Obj obj = gcAlloc<struct Object>(sizeof(Obj)*cls->indexedIVarCount,
+			cls->className);
 	// Set its class pointer
 	obj->isa = cls;
 	return obj;
 }
+Closure *mysoreScriptNewClosure(intptr_t boundVarCount)
+{
+	return gcAlloc<Closure>(boundVarCount * sizeof(Obj), "Closure");
+}
+
+intptr_t fillFileBuffer(File *f)
+{
+	const size_t InitialBufferSize = 64 * 1024;
+	FileBuffer *b = f->buffer;
+	if (!b)
+	{
+		b = (FileBuffer*)gcAllocBuffer(sizeof(FileBuffer) +
+				InitialBufferSize, "File buffer", true);
+		b->start = b->end = 0;
+		b->capacity = InitialBufferSize;
+		b->eof = false;
+		f->buffer = b;
+	}
+	// Move the unconsumed data to the start of the buffer, and grow it if it
+	// is full (with a line that's longer than the buffer).
+	if (b->start > 0)
+	{
+		memmove(b->data, b->data + b->start, b->end - b->start);
+		b->end -= b->start;
+		b->start = 0;
+	}
+	if (b->end == b->capacity)
+	{
+		size_t capacity = b->capacity * 2;
+		FileBuffer *grown = (FileBuffer*)gcAllocBuffer(sizeof(FileBuffer) +
+				capacity, "File buffer", true);
+		memcpy(grown, b, sizeof(FileBuffer) + b->end);
+		grown->capacity = capacity;
+		f->buffer = b = grown;
+	}
+	// Anything written to standard output so far should appear before we
+	// wait for more input, in case it is a prompt or the other end of a pipe
+	// is waiting for it.
+	if (inputDescriptor(f) == STDIN_FILENO)
+	{
+		flushStandardOutput();
+	}
+	for (;;)
+	{
+		ssize_t n = read(inputDescriptor(f), b->data + b->end,
+				b->capacity - b->end);
+		if (n > 0)
+		{
+			b->end += n;
+			return n;
+		}
+		if (n == 0)
+		{
+			b->eof = true;
+			return 0;
+		}
+		if (errno != EINTR)
+		{
+			return -1;
+		}
+	}
+}
+
+String *nextLine(File *f)
+{
+	FileBuffer *b = f->buffer;
+	char *newline = nullptr;
+	while (!b || !(newline = (char*)memchr(b->data + b->start, '\n',
+					b->end - b->start)))
+	{
+		if (b && b->eof)
+		{
+			break;
+		}
+		if (fillFileBuffer(f) < 0)
+		{
+			return nullptr;
+		}
+		b = f->buffer;
+	}
+	char *line = b->data + b->start;
+	uintptr_t len = newline ? newline - line : b->end - b->start;
+	// At the end of the file, with nothing left after the last newline.
+	if (!newline && (len == 0))
+	{
+		return nullptr;
+	}
+	b->start += newline ? len + 1 : len;
+	String *newStr = gcAlloc<String>(len, "String");
+	newStr->isa = &StringClass;
+	newStr->length = createSmallInteger(len);
+	memcpy(newStr->characters, line, len);
+	return newStr;
+}
+
+void flushStandardOutput()
+{
+	std::lock_guard<std::mutex> guard(standardOutputLock);
+	flushStandardOutputLocked();
+}
 
 Method *methodForSelector(Class *cls, Selector sel)
 {
@@ -669,8 +1558,10 @@ CompiledMethod compiledMethodForSelector(Obj obj, Selector sel)
 	// If this object is null, we'll call the invalid method handler when we
 	// invoke a method on it.  Note that we could easily follow the Smalltalk
 	// model of having a Null class whose methods are invoked, or the
-	// Objective-C model of always returning null here.
-	if (!obj)
+	// Objective-C model of always returning null here.  Both of the failure
+	// cases are unlikely, so keep them out of line: this is called for every
+	// method invocation from compiled code.
+	if (__builtin_expect(!obj, 0))
 	{
 		return (CompiledMethod)invalidMethod;
 	}
@@ -680,7 +1571,7 @@ CompiledMethod compiledMethodForSelector(Obj obj, Selector sel)
 	Method *mth = methodForSelector(cls, sel);
 	// If the method doesn't exist, return the invalid method function,
 	// otherwise return the function that we've just looked up.
-	if (!mth)
+	if (__builtin_expect(!mth, 0))
 	{
 		return (CompiledMethod)invalidMethod;
 	}
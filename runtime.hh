@@ -3,28 +3,111 @@
 #include <stdint.h>
 #include <assert.h>
 #include <string>
+#include <vector>
 #include "gc.h"
+#include "allocprofiler.hh"
+#include "safepoint.hh"
 
 static_assert(sizeof(void*) == 8,
 	"MysoreScript only supports 64-bit platforms currently");
 
+namespace MysoreScript
+{
+/**
+ * The number of bytes allocated by code running with an allocation budget.
+ */
+struct AllocationAccount
+{
+	/**
+	 * The number of bytes charged to this account so far.
+	 */
+	uint64_t bytes = 0;
+	/**
+	 * The number of bytes after which the budget has been exceeded.
+	 */
+	uint64_t limit = UINT64_MAX;
+};
+/**
+ * The account that allocations on the current thread are charged to, or null
+ * if the code running on this thread has no allocation budget.
+ */
+extern thread_local AllocationAccount *allocationAccount;
+}
+
 namespace {
+/**
+ * Charge an allocation to the current thread's account, if it has one.  Once
+ * the account's limit has been reached, this makes the next safepoint poll
+ * check the budget, so that a loop that allocates large objects can't go far
+ * past it.
+ */
+inline void chargeAllocation(size_t size)
+{
+	MysoreScript::AllocationAccount *account = MysoreScript::allocationAccount;
+	if (__builtin_expect(account != nullptr, 0))
+	{
+		account->bytes += size;
+		if (account->bytes >= account->limit)
+		{
+			Safepoint::interrupt();
+		}
+	}
+}
 /**
  * Typesafe helper function for allocating garbage-collected memory.  Allocates
  * enough memory for one instance of the specified type, plus the number of
- * extra bytes requested.
+ * extra bytes requested.  The kind names the kind of object for the allocation
+ * profiler.  The allocation is charged to the current thread's allocation
+ * account.
  */
 template<typename T>
-T* gcAlloc(size_t extraBytes=0)
+T* gcAlloc(size_t extraBytes=0, const char *kind=nullptr)
 {
 	size_t size = sizeof(T) + extraBytes;
-	return (T*)GC_MALLOC(size);
+	T *obj = (T*)GC_MALLOC(size);
+	chargeAllocation(size);
+	// Profiling is rare, so keep it off the path that `newObject` and the
+	// other allocators take.
+	if (__builtin_expect(AllocProfiler::active, 0))
+	{
+		AllocProfiler::recordAllocation(obj, size, kind);
+	}
+	return obj;
+}
+/**
+ * Allocate a garbage-collected buffer that is not itself an object, such as
+ * the storage for an array's elements.  If `atomic` is set then the buffer
+ * contains no pointers and is not scanned by the collector.  Buffers are
+ * reported to the allocation profiler and charged to the allocation account in
+ * the same way as objects.
+ */
+inline void *gcAllocBuffer(size_t size, const char *kind, bool atomic=false)
+{
+	void *buffer = atomic ? GC_MALLOC_ATOMIC(size) : GC_MALLOC(size);
+	chargeAllocation(size);
+	if (__builtin_expect(AllocProfiler::active, 0))
+	{
+		AllocProfiler::recordAllocation(buffer, size, kind);
+	}
+	return buffer;
 }
 }
 namespace AST
 {
 	struct ClosureDecl;
 }
+namespace Coroutine
+{
+	struct Task;
+}
+namespace Channel
+{
+	struct Queue;
+}
+namespace EventLoop
+{
+	struct Loop;
+}
 
 namespace MysoreScript
 {
@@ -193,6 +276,55 @@ struct String
 	char      characters[0];
 };
 
+/**
+ * The buffer that a `File` reads into.  Lines are split from buffered data,
+ * so that reading a line takes one system call per buffer-full of data.
+ */
+struct FileBuffer
+{
+	/**
+	 * The offset of the first byte that has not been consumed.
+	 */
+	size_t    start;
+	/**
+	 * The offset of the end of the data that has been read.
+	 */
+	size_t    end;
+	/**
+	 * The size of `data`.
+	 */
+	size_t    capacity;
+	/**
+	 * Set once a read has reached the end of the file.
+	 */
+	bool      eof;
+	/**
+	 * The buffered data.
+	 */
+	char      data[0];
+};
+
+/**
+ * The primitive `File` class in MysoreScript.  This wraps a file, pipe or Unix
+ * domain socket.
+ */
+struct File
+{
+	/**
+	 * Class pointer.  Always set to `&FileClass`.
+	 */
+	Class      *isa;
+	/**
+	 * The file descriptor, or 0 if the file has not been opened, in which
+	 * case reads use standard input and writes use standard output.
+	 */
+	intptr_t    fd;
+	/**
+	 * The read buffer, or null if nothing has been read.
+	 */
+	FileBuffer *buffer;
+};
+
 /**
  * The layout of all closures in MysoreScript.
  */
@@ -221,10 +353,57 @@ struct Closure
 	Obj                boundVars[0];
 };
 
+/**
+ * The structure representing MysoreScript `Generator` objects.  A generator
+ * runs a closure in a coroutine, which passes values back to the generator's
+ * consumer one at a time by calling `yield` on the generator.
+ */
+struct Generator
+{
+	/** The class pointer. */
+	Class            *isa;
+	/** The closure that produces the values. */
+	Obj               body;
+	/** The value most recently yielded, until `next` returns it. */
+	Obj               value;
+	/** The coroutine that runs the body, or null if it has not started. */
+	Coroutine::Task  *task;
+};
+
+/**
+ * The structure representing MysoreScript `Channel` objects.
+ */
+struct ChannelObject
+{
+	/** The class pointer. */
+	Class           *isa;
+	/** The queue, or null if the channel has not been opened. */
+	Channel::Queue  *queue;
+};
+
+/**
+ * The structure representing MysoreScript `EventLoop` objects.
+ */
+struct EventLoopObject
+{
+	/** The class pointer. */
+	Class            *isa;
+	/** The loop, created when it is first used. */
+	EventLoop::Loop  *loop;
+};
+
 /**
  * The class used for strings.
  */
 extern struct Class StringClass;
+/**
+ * The class used for arrays.
+ */
+extern struct Class ArrayClass;
+/**
+ * The class used for files.
+ */
+extern struct Class FileClass;
 /**
  * The class used for small integers.
  */
@@ -233,6 +412,18 @@ extern struct Class SmallIntClass;
  * The class used for closures.
  */
 extern struct Class ClosureClass;
+/**
+ * The class used for generators.
+ */
+extern struct Class GeneratorClass;
+/**
+ * The class used for channels.
+ */
+extern struct Class ChannelClass;
+/**
+ * The class used for event loops.
+ */
+extern struct Class EventLoopClass;
 /**
  * Register a newly constructed class.
  */
@@ -241,6 +432,46 @@ void registerClass(const std::string &name, struct Class *cls);
  * Look up an existing class.
  */
 struct Class* lookupClass(const std::string &name);
+/**
+ * Returns the address of the class table entry for a class, which stays the
+ * same when the class is redefined.  Compiled code loads classes from here, so
+ * that it sees the new definition.
+ */
+struct Class** lookupClassSlot(const std::string &name);
+/**
+ * Returns all of the classes that can be instantiated by name, including the
+ * built-in ones.
+ */
+std::vector<struct Class*> registeredClasses();
+/**
+ * Returns the file descriptor that a `File` reads from.
+ */
+inline int inputDescriptor(File *f)
+{
+	return f->fd ? f->fd : 0;
+}
+/**
+ * Read as much data as is available (up to the space in the buffer) into a
+ * file's read buffer, growing the buffer if it is full.  Returns the number of
+ * bytes read, 0 at the end of the file, or -1 if the read failed, including
+ * if the file is non-blocking and no data is available (`errno` is then
+ * `EAGAIN`).
+ */
+intptr_t fillFileBuffer(File *f);
+/**
+ * Return the next line from a file, without the newline, filling its buffer
+ * as needed.  Empty lines are returned as empty strings.  Returns null at the
+ * end of the file, if the read fails, or if the file is non-blocking and a
+ * complete line has not arrived yet.
+ */
+String *nextLine(File *f);
+/**
+ * Write everything in the buffer shared by all writes to standard output.
+ * Writes that are made through `File` objects that have not been opened are
+ * buffered, unless standard output is a terminal, and are flushed when the
+ * buffer fills, before standard input is read, and when the process exits.
+ */
+void flushStandardOutput();
 
 
 
@@ -251,6 +482,12 @@ extern "C"
  * its instance variables set to null.
  */
 Obj newObject(struct Class *cls);
+/**
+ * Allocate a closure with space for the given number of bound variables.  The
+ * caller initialises all of its fields.  Called by compiled code, so that
+ * closures are profiled and accounted for like all other allocations.
+ */
+Closure *mysoreScriptNewClosure(intptr_t boundVarCount);
 /**
  * Helper function called by compiled code for the + operator on objects that
  * are not small (embedded in a pointer) integers.
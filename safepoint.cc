@@ -0,0 +1,286 @@
+#include "safepoint.hh"
+#include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+namespace {
+/**
+ * The value that the current thread's countdown started the current period
+ * at, adjusted whenever the period is cut short, so that the number of polls
+ * executed in this period is always `periodStart - countdown`.
+ */
+thread_local std::atomic<int64_t> periodStart(Safepoint::Interval);
+/**
+ * The number of polls executed by the current thread in earlier periods.
+ */
+thread_local uint64_t completedPolls;
+/**
+ * The number of outstanding requests.  Every poll reaches a safepoint while
+ * this is not zero.
+ */
+std::atomic<uint32_t> pending;
+/**
+ * Is the current thread unwinding back to the embedder?
+ */
+thread_local bool unwinding;
+/**
+ * The current thread's handlers and their identifiers.
+ */
+thread_local std::vector<std::pair<int, Safepoint::Handler>> handlers;
+/**
+ * The identifier to give the next handler added to the current thread.
+ */
+thread_local int nextHandlerId;
+/**
+ * Is the current thread running its handlers?  Handlers may run MysoreScript
+ * code, which will reach more safepoints, but they are not run recursively.
+ */
+thread_local bool inHandlers;
+/**
+ * Is the current thread registered with a `Safepoint::Mutator`?
+ */
+thread_local bool isMutator;
+/**
+ * Has the current thread stopped the world?  It must keep running, so that it
+ * can restart the others.
+ */
+thread_local bool isStopper;
+/**
+ * Protects the stop-the-world state.
+ */
+std::mutex worldLock;
+/**
+ * Signalled whenever a thread stops, resumes or stops being a mutator.
+ */
+std::condition_variable worldChanged;
+/**
+ * The number of registered mutator threads.
+ */
+int mutators;
+/**
+ * The countdown and period start of each registered mutator thread, so that
+ * requests can interrupt them.
+ */
+std::vector<std::pair<std::atomic<int64_t>*, std::atomic<int64_t>*>>
+	mutatorCountdowns;
+/**
+ * The number of mutator threads that are stopped at a safepoint.
+ */
+int stopped;
+/**
+ * Has a thread asked for the world to be stopped?
+ */
+bool stopping;
+/**
+ * Make the next poll of the thread that owns `countdown` reach a safepoint,
+ * shortening its period so that its step count stays correct.
+ */
+void interruptCountdown(std::atomic<int64_t> &countdown,
+                        std::atomic<int64_t> &start)
+{
+	int64_t remaining = countdown.exchange(0);
+	if (remaining > 0)
+	{
+		start -= remaining;
+	}
+}
+/**
+ * Stop the current thread, if the world is being stopped and it is a mutator.
+ */
+void stopIfRequested()
+{
+	if (!isMutator || isStopper)
+	{
+		return;
+	}
+	std::unique_lock<std::mutex> lock(worldLock);
+	if (!stopping)
+	{
+		return;
+	}
+	stopped++;
+	worldChanged.notify_all();
+	worldChanged.wait(lock, []() { return !stopping; });
+	stopped--;
+}
+}
+
+namespace Safepoint
+{
+thread_local std::atomic<int64_t> countdown(Interval);
+
+int addHandler(Handler h)
+{
+	int id = nextHandlerId++;
+	handlers.emplace_back(id, std::move(h));
+	return id;
+}
+
+void removeHandler(int id)
+{
+	for (auto I=handlers.begin(), E=handlers.end() ; I!=E ; ++I)
+	{
+		if (I->first == id)
+		{
+			handlers.erase(I);
+			return;
+		}
+	}
+}
+
+void interrupt()
+{
+	interruptCountdown(countdown, periodStart);
+}
+
+void scheduleWithin(int64_t n)
+{
+	int64_t remaining = countdown.load(std::memory_order_relaxed);
+	if (n < remaining)
+	{
+		periodStart -= remaining - n;
+		countdown = n;
+	}
+}
+
+uint64_t polls()
+{
+	return completedPolls + (periodStart - countdown);
+}
+
+bool countdownOffset(intptr_t &offset)
+{
+#if defined(__linux__) && defined(__x86_64__)
+	// The first word of the thread control block, which %fs points to, is
+	// its own address.  The countdown is in the executable's static TLS
+	// block, at the same offset from it in every thread.
+	uintptr_t threadPointer;
+	asm("movq %%fs:0, %0" : "=r"(threadPointer));
+	offset = (intptr_t)&countdown - (intptr_t)threadPointer;
+	return true;
+#else
+	return false;
+#endif
+}
+
+void setUnwinding(bool unwind)
+{
+	unwinding = unwind;
+	if (unwind)
+	{
+		interrupt();
+	}
+}
+
+bool isUnwinding()
+{
+	return unwinding;
+}
+
+void request()
+{
+	pending++;
+	interrupt();
+	std::lock_guard<std::mutex> lock(worldLock);
+	for (auto &mutator : mutatorCountdowns)
+	{
+		interruptCountdown(*mutator.first, *mutator.second);
+	}
+}
+
+void release()
+{
+	pending--;
+}
+
+bool reached()
+{
+	// Start the next period.  While there are requests outstanding, or this
+	// thread is unwinding, every poll must reach a safepoint.
+	completedPolls += periodStart - countdown;
+	int64_t next = (pending || unwinding) ? 0 : Interval;
+	periodStart = next;
+	countdown = next;
+	if (!inHandlers)
+	{
+		inHandlers = true;
+		// Handlers may add or remove handlers, so run a copy of the list.
+		auto current = handlers;
+		for (auto &h : current)
+		{
+			h.second();
+		}
+		inHandlers = false;
+	}
+	stopIfRequested();
+	return unwinding;
+}
+
+Mutator::Mutator()
+{
+	std::unique_lock<std::mutex> lock(worldLock);
+	// Don't start running while the world is stopped.
+	worldChanged.wait(lock, []() { return !stopping; });
+	mutators++;
+	isMutator = true;
+	mutatorCountdowns.emplace_back(&countdown, &periodStart);
+	// Requests made before this thread registered apply to it too.
+	if (pending)
+	{
+		interrupt();
+	}
+}
+
+Mutator::~Mutator()
+{
+	std::lock_guard<std::mutex> lock(worldLock);
+	mutators--;
+	isMutator = false;
+	mutatorCountdowns.erase(std::find(mutatorCountdowns.begin(),
+				mutatorCountdowns.end(), std::make_pair(&countdown,
+					&periodStart)));
+	worldChanged.notify_all();
+}
+
+void stopTheWorld()
+{
+	request();
+	std::unique_lock<std::mutex> lock(worldLock);
+	stopping = true;
+	isStopper = true;
+	// The calling thread doesn't stop itself.
+	int self = isMutator ? 1 : 0;
+	worldChanged.wait(lock, [=]() { return stopped == mutators - self; });
+}
+
+void resumeTheWorld()
+{
+	{
+		std::lock_guard<std::mutex> lock(worldLock);
+		stopping = false;
+		isStopper = false;
+		worldChanged.notify_all();
+	}
+	release();
+}
+}
+
+extern "C"
+int mysoreScriptSafepoint()
+{
+	return Safepoint::reached();
+}
+
+extern "C"
+int mysoreScriptUnwinding()
+{
+	return Safepoint::isUnwinding();
+}
+
+extern "C"
+std::atomic<int64_t> *mysoreScriptSafepointCountdown()
+{
+	return &Safepoint::countdown;
+}
@@ -0,0 +1,164 @@
+#pragma once
+#include <atomic>
+#include <functional>
+#include <stdint.h>
+
+/**
+ * Safepoints.  Code running MysoreScript polls a countdown at every loop back
+ * edge and function entry, in both the interpreter and compiled code.  The
+ * poll decrements the countdown and branches if it has reached zero.  The
+ * thread that brings it to zero reaches a safepoint: it runs its safepoint
+ * handlers and then resets the countdown.  This happens periodically, which
+ * lets handlers count the steps (polls) that a script has taken and check how
+ * long it has been running, and immediately when another thread (or a timer)
+ * sets the countdown to zero by calling `request()` or `interrupt()`.  This
+ * allows long-running scripts to be interrupted without signals, so that
+ * budgets can be enforced, threads can be preempted, and all threads can be
+ * stopped at a consistent point.
+ *
+ * The countdown, the step count and the handlers are all per thread, so
+ * threads running scripts don't share a cache line on every back edge and
+ * each thread's steps are counted separately.  Compiled code finds the
+ * current thread's countdown at a fixed offset from the thread pointer, where
+ * the platform allows it, and otherwise asks for its address on entry.  Step
+ * counts are exact unless another thread interrupts this one with
+ * `request()`.
+ */
+namespace Safepoint
+{
+	/**
+	 * The number of polls until the current thread's next safepoint.
+	 * Compiled code and the interpreter decrement this and call `reached()`
+	 * when it is zero or less.  It is atomic because `request()` clears it
+	 * from other threads, but the decrement is not an atomic
+	 * read-modify-write, because that would make every poll much more
+	 * expensive; if a poll races with `request()`, the safepoint can be
+	 * delayed by up to `Interval` polls.
+	 */
+	extern thread_local std::atomic<int64_t> countdown
+		__attribute__((tls_model("initial-exec")));
+	/**
+	 * The number of polls between periodic safepoints.
+	 */
+	const int64_t Interval = 1 << 16;
+	/**
+	 * A safepoint handler.  Handlers run on the thread that reaches the
+	 * safepoint.
+	 */
+	typedef std::function<void()> Handler;
+	/**
+	 * Add a handler for the current thread.  Returns an identifier that can
+	 * be passed to `removeHandler()`.
+	 */
+	int addHandler(Handler h);
+	/**
+	 * Remove a handler that was added to the current thread.
+	 */
+	void removeHandler(int id);
+	/**
+	 * Make the current thread's next poll reach a safepoint.  This is safe to
+	 * call from collector callbacks.
+	 */
+	void interrupt();
+	/**
+	 * Make a safepoint happen on the current thread within at most `polls`
+	 * polls, to enforce an exact limit on the number of steps.
+	 */
+	void scheduleWithin(int64_t polls);
+	/**
+	 * Returns the number of polls that the current thread has executed so
+	 * far.
+	 */
+	uint64_t polls();
+	/**
+	 * Finds the offset of `countdown` from the thread pointer, which is the
+	 * same in every thread.  Returns false if compiled code can't address
+	 * thread-local variables like this on this platform.
+	 */
+	bool countdownOffset(intptr_t &offset);
+	/**
+	 * Start or stop unwinding the current thread.  While it is unwinding,
+	 * every poll reaches a safepoint and tells its caller to return
+	 * immediately, so that control goes back to the embedder.
+	 */
+	void setUnwinding(bool unwind);
+	/**
+	 * Returns true if the current thread is unwinding.  Calls return null
+	 * while it is, so code that gets null back from a call checks this before
+	 * doing anything else with the result.
+	 */
+	bool isUnwinding();
+	/**
+	 * Ask the current thread and every registered mutator thread to run its
+	 * handlers at every safepoint until the request is withdrawn, starting
+	 * with the next poll.  Each call must be balanced by a call to
+	 * `release()` once the request has been satisfied.  This is safe to call
+	 * from any thread.
+	 */
+	void request();
+	/**
+	 * Withdraw a request made with `request()`.
+	 */
+	void release();
+	/**
+	 * Run the current thread's handlers and reset the countdown.  Called
+	 * when a poll brings the countdown to zero.  Returns true if the thread
+	 * is unwinding, in which case the caller should return immediately.
+	 */
+	bool reached();
+	/**
+	 * Poll, reaching a safepoint if the countdown has expired.  Returns true
+	 * if the caller should return immediately.
+	 */
+	inline bool poll()
+	{
+		int64_t c = countdown.load(std::memory_order_relaxed) - 1;
+		countdown.store(c, std::memory_order_relaxed);
+		if (__builtin_expect(c <= 0, 0))
+		{
+			return reached();
+		}
+		return false;
+	}
+	/**
+	 * Registers the current thread as running MysoreScript code for the
+	 * lifetime of this object, so that `request()` interrupts it and
+	 * `stopTheWorld()` waits for it.
+	 */
+	struct Mutator
+	{
+		Mutator();
+		~Mutator();
+	};
+	/**
+	 * Stop every other registered thread at its next safepoint, returning
+	 * once they have all stopped.  They stay stopped until
+	 * `resumeTheWorld()` is called.  Only one thread may stop the world at
+	 * a time.
+	 */
+	void stopTheWorld();
+	/**
+	 * Restart the threads stopped by `stopTheWorld()`.
+	 */
+	void resumeTheWorld();
+}
+
+extern "C"
+{
+/**
+ * Called by compiled code when a safepoint poll brings the countdown to zero.
+ * Returns non-zero if the calling function should return immediately.
+ */
+int mysoreScriptSafepoint();
+/**
+ * Called by compiled code when a call returns null and the countdown has
+ * expired.  Returns non-zero if the calling function should return
+ * immediately.
+ */
+int mysoreScriptUnwinding();
+/**
+ * Returns the address of the current thread's safepoint countdown, for
+ * compiled code on platforms where `Safepoint::countdownOffset()` fails.
+ */
+std::atomic<int64_t> *mysoreScriptSafepointCountdown();
+}
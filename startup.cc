@@ -0,0 +1,148 @@
+#include "startup.hh"
+#include <chrono>
+#include <string>
+#include <utility>
+#include <vector>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace {
+typedef std::chrono::steady_clock Clock;
+/**
+ * The time at which the first static initialiser in this program ran.
+ */
+Clock::time_point initStart;
+/**
+ * The number of seconds between the kernel starting the process and the first
+ * static initialiser running, or a negative value if it is not known.  This
+ * mostly consists of loading and initialising shared libraries.
+ */
+double loadSeconds = -1;
+/**
+ * The time at which the last startup step finished.
+ */
+Clock::time_point lastMark;
+/**
+ * The startup steps that have been recorded, in order, and their durations in
+ * seconds.
+ */
+std::vector<std::pair<std::string, double>> steps;
+/**
+ * Costs that were deferred until after startup, and their durations in
+ * seconds.
+ */
+std::vector<std::pair<std::string, double>> deferredSteps;
+
+/**
+ * Returns the number of seconds since the process was started, according to
+ * the kernel, or a negative value if this can't be determined.  The kernel
+ * only records the start time in clock ticks, so this is quite coarse.
+ */
+double secondsSinceExec()
+{
+#ifdef __linux__
+	FILE *stat = fopen("/proc/self/stat", "r");
+	if (!stat)
+	{
+		return -1;
+	}
+	// The process name is in brackets and may contain spaces, so skip to the
+	// last closing bracket before counting fields.
+	char buffer[1024];
+	size_t len = fread(buffer, 1, sizeof(buffer) - 1, stat);
+	fclose(stat);
+	buffer[len] = 0;
+	std::string line(buffer);
+	size_t pos = line.rfind(')');
+	if (pos == std::string::npos)
+	{
+		return -1;
+	}
+	// The start time is the 22nd field, and the field after the bracket is
+	// the 3rd.
+	unsigned long long startTicks;
+	const char *fields = line.c_str() + pos + 2;
+	if (sscanf(fields, "%*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s %*s "
+	                   "%*s %*s %*s %*s %*s %*s %llu", &startTicks) != 1)
+	{
+		return -1;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_BOOTTIME, &now);
+	double bootSeconds = now.tv_sec + now.tv_nsec / 1e9;
+	return bootSeconds - (double)startTicks / sysconf(_SC_CLK_TCK);
+#else
+	return -1;
+#endif
+}
+/**
+ * Record the time at which static initialisation started.  This runs before
+ * any other static initialiser in the program (but after those in shared
+ * libraries), so that their cost is included in the report.
+ */
+__attribute__((constructor(101)))
+void recordInitStart()
+{
+	initStart = Clock::now();
+	loadSeconds = secondsSinceExec();
+}
+/**
+ * Returns the number of seconds between two time points.
+ */
+double secondsBetween(Clock::time_point start, Clock::time_point end)
+{
+	std::chrono::duration<double> elapsed = end - start;
+	return elapsed.count();
+}
+}
+
+namespace Startup
+{
+bool active;
+
+void mark(const char *step)
+{
+	Clock::time_point now = Clock::now();
+	if (steps.empty())
+	{
+		lastMark = initStart;
+	}
+	steps.emplace_back(step, secondsBetween(lastMark, now));
+	lastMark = now;
+}
+
+void deferred(const char *step, double seconds)
+{
+	deferredSteps.emplace_back(step, seconds);
+}
+
+void report()
+{
+	if (!active)
+	{
+		return;
+	}
+	double total = 0;
+	fprintf(stderr, "%-40s %12s\n", "Startup step", "ms");
+	if (loadSeconds >= 0)
+	{
+		// This is measured in clock ticks, so it is only approximate.
+		fprintf(stderr, "%-40s %12.3f\n", "exec and shared libraries (approx.)",
+				loadSeconds * 1000);
+		total += loadSeconds;
+	}
+	for (auto &step : steps)
+	{
+		fprintf(stderr, "%-40s %12.3f\n", step.first.c_str(),
+				step.second * 1000);
+		total += step.second;
+	}
+	fprintf(stderr, "%-40s %12.3f\n", "Total to first statement", total * 1000);
+	for (auto &step : deferredSteps)
+	{
+		fprintf(stderr, "%-40s %12.3f\n", ("Deferred: " + step.first).c_str(),
+				step.second * 1000);
+	}
+}
+}
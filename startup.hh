@@ -0,0 +1,34 @@
+#pragma once
+
+/**
+ * Startup latency profiling.  When active, the time taken by each step
+ * between the process being started and the first MysoreScript statement
+ * being executed is recorded, so that a budget can be kept on the startup
+ * cost of short-lived invocations.
+ */
+namespace Startup
+{
+	/**
+	 * Should the startup profile be reported?  Steps are recorded even when
+	 * this is not set, because some of them finish before the command-line
+	 * options have been parsed, and recording them is cheap.
+	 */
+	extern bool active;
+	/**
+	 * Record that the named startup step has just finished.  Its duration is
+	 * the time since the previous step finished or, for the first step, since
+	 * the program's static initialisers started running.
+	 */
+	void mark(const char *step);
+	/**
+	 * Record a one-off cost that is deferred until after startup, such as
+	 * initialising the JIT, so that it is reported alongside the startup
+	 * steps but not included in their total.
+	 */
+	void deferred(const char *step, double seconds);
+	/**
+	 * Print the startup steps and their durations to the standard error
+	 * stream.
+	 */
+	void report();
+}
@@ -0,0 +1,69 @@
+#include "stats.hh"
+#include "ast.hh"
+#include <algorithm>
+#include <vector>
+#include <stdio.h>
+
+namespace {
+/**
+ * All of the functions that have been called at least once.
+ */
+std::vector<AST::ClosureDecl*> functions;
+}
+
+namespace Stats
+{
+bool enabled;
+uint64_t interpreterToCompiled;
+uint64_t interpreterToTrampoline;
+uint64_t trampolineCalls;
+
+void registerFunction(AST::ClosureDecl *fn)
+{
+	functions.push_back(fn);
+}
+
+void report(double executionSeconds)
+{
+	// Show the most frequently called functions first.
+	std::sort(functions.begin(), functions.end(),
+		[](AST::ClosureDecl *a, AST::ClosureDecl *b)
+		{
+			return (a->stats.interpretedCalls + a->stats.compiledCalls) >
+			       (b->stats.interpretedCalls + b->stats.compiledCalls);
+		});
+	double compileSeconds = 0;
+	size_t compiledFunctions = 0;
+	size_t codeSize = 0;
+	fprintf(stderr, "%-40s %12s %12s %12s %10s\n", "Function", "Interpreted",
+			"Compiled", "Compile ms", "Code bytes");
+	for (auto *fn : functions)
+	{
+		FunctionStats &s = fn->stats;
+		fprintf(stderr, "%-40s %12llu %12llu %12.3f %10zu\n",
+				fn->displayName().c_str(),
+				(unsigned long long)s.interpretedCalls,
+				(unsigned long long)s.compiledCalls,
+				s.compileSeconds * 1000, s.codeSize);
+		if (s.codeSize)
+		{
+			compiledFunctions++;
+			codeSize += s.codeSize;
+		}
+		compileSeconds += s.compileSeconds;
+	}
+	fprintf(stderr, "Calls from interpreter to compiled code: %llu\n",
+			(unsigned long long)interpreterToCompiled);
+	fprintf(stderr, "Calls from compiled code to interpreter: %llu\n",
+			(unsigned long long)(trampolineCalls - interpreterToTrampoline));
+	fprintf(stderr, "Compiled %zu functions (%zu bytes) in %f seconds.\n",
+			compiledFunctions, codeSize, compileSeconds);
+	if (compiledFunctions)
+	{
+		fprintf(stderr, "Mean compile time: %f ms per function.\n",
+				compileSeconds * 1000 / compiledFunctions);
+	}
+	fprintf(stderr, "Execution took %f seconds, %f excluding compilation.\n",
+			executionSeconds, executionSeconds - compileSeconds);
+}
+}
@@ -0,0 +1,82 @@
+#pragma once
+#include <chrono>
+#include <stddef.h>
+#include <stdint.h>
+
+namespace AST
+{
+	struct ClosureDecl;
+}
+
+/**
+ * Per-function execution statistics, for working out where a script spends its
+ * time and how well the tiering between the interpreter and compiler works.
+ */
+namespace Stats
+{
+	/**
+	 * Are statistics being collected?  Compiled code only counts calls if this
+	 * was set when it was compiled.
+	 */
+	extern bool enabled;
+	/**
+	 * Statistics about a single closure or method.  Each `ClosureDecl`
+	 * contains one of these.
+	 */
+	struct FunctionStats
+	{
+		/**
+		 * The number of times that the function has been interpreted.
+		 */
+		uint64_t interpretedCalls = 0;
+		/**
+		 * The number of times that the compiled version has been called.
+		 * Compiled code increments this directly.
+		 */
+		uint64_t compiledCalls = 0;
+		/**
+		 * The time spent compiling the function, in seconds.
+		 */
+		double compileSeconds = 0;
+		/**
+		 * The size of the generated machine code, in bytes.
+		 */
+		size_t codeSize = 0;
+	};
+	/**
+	 * The number of calls from the interpreter that went directly to compiled
+	 * code.
+	 */
+	extern uint64_t interpreterToCompiled;
+	/**
+	 * The number of calls from the interpreter that went via a trampoline back
+	 * into the interpreter.
+	 */
+	extern uint64_t interpreterToTrampoline;
+	/**
+	 * The total number of calls via trampolines.  Calls that were not counted
+	 * in `interpreterToTrampoline` came from compiled code.
+	 */
+	extern uint64_t trampolineCalls;
+	/**
+	 * Record that a function has been called for the first time, so that it
+	 * is included in the report.
+	 */
+	void registerFunction(AST::ClosureDecl *fn);
+	/**
+	 * Print the per-function report and the totals to the standard error
+	 * stream.  The argument is the total wall-clock time spent executing the
+	 * program, including compilation.
+	 */
+	void report(double executionSeconds);
+	/**
+	 * Returns the number of seconds since `start`.  Used to measure the
+	 * compile and execution times that are reported.
+	 */
+	inline double secondsSince(std::chrono::steady_clock::time_point start)
+	{
+		std::chrono::duration<double> elapsed =
+			std::chrono::steady_clock::now() - start;
+		return elapsed.count();
+	}
+}
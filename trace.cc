@@ -0,0 +1,173 @@
+#include "trace.hh"
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <stdio.h>
+#include <unistd.h>
+#include <gc.h>
+
+namespace {
+/**
+ * The file that the trace is written to.
+ */
+FILE *traceFile;
+/**
+ * The time at which tracing started.  All timestamps are relative to this.
+ */
+std::chrono::steady_clock::time_point startTime;
+/**
+ * Lock protecting `traceFile`.  Files are parsed in parallel, so spans may be
+ * recorded from several threads.
+ */
+std::mutex traceLock;
+/**
+ * The next thread identifier to assign.
+ */
+std::atomic<int> nextThreadId(1);
+/**
+ * The identifier used for the current thread in the trace.  Threads are
+ * numbered in the order in which they first record an event.
+ */
+thread_local int threadId;
+/**
+ * The process ID, recorded in every event.
+ */
+int pid;
+/**
+ * The collection event handler that was installed before ours, if any.
+ */
+GC_on_collection_event_proc previousGCEvent;
+
+/**
+ * Returns the trace identifier for the calling thread.
+ */
+int currentThread()
+{
+	if (threadId == 0)
+	{
+		threadId = nextThreadId++;
+	}
+	return threadId;
+}
+/**
+ * Write a string as a JSON string literal.
+ */
+void writeString(const std::string &str)
+{
+	putc('"', traceFile);
+	for (char c : str)
+	{
+		if (c == '"' || c == '\\')
+		{
+			putc('\\', traceFile);
+			putc(c, traceFile);
+		}
+		else if ((unsigned char)c < 0x20)
+		{
+			fprintf(traceFile, "\\u%04x", c);
+		}
+		else
+		{
+			putc(c, traceFile);
+		}
+	}
+	putc('"', traceFile);
+}
+/**
+ * Write a single event.  The `extra` string contains any fields that are
+ * specific to the phase, including their leading comma.
+ */
+void writeEvent(const char *category, const std::string &name, char phase,
+                double ts, const char *extra)
+{
+	int tid = currentThread();
+	std::lock_guard<std::mutex> guard(traceLock);
+	if (!traceFile)
+	{
+		return;
+	}
+	fputs(",\n{\"name\":", traceFile);
+	writeString(name);
+	fprintf(traceFile, ",\"cat\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,"
+			"\"tid\":%d%s}", category, phase, ts, pid, tid, extra);
+}
+/**
+ * Callback from the garbage collector, recording the start and end of each
+ * collection.  The collector holds its allocation lock while calling this, so
+ * it must not allocate GC'd memory.
+ */
+void gcEvent(GC_EventType event)
+{
+	switch (event)
+	{
+		case GC_EVENT_START:
+			writeEvent("gc", "GC", 'B', Trace::now(), "");
+			break;
+		case GC_EVENT_END:
+			writeEvent("gc", "GC", 'E', Trace::now(), "");
+			break;
+		default:
+			break;
+	}
+	if (previousGCEvent)
+	{
+		previousGCEvent(event);
+	}
+}
+}
+
+namespace Trace
+{
+bool active;
+bool traceCalls;
+
+bool start(const char *file, bool calls)
+{
+	traceFile = fopen(file, "w");
+	if (!traceFile)
+	{
+		return false;
+	}
+	pid = getpid();
+	startTime = std::chrono::steady_clock::now();
+	// Start with a metadata event, so that every other event can be written
+	// with a leading comma.
+	fprintf(traceFile, "{\"traceEvents\":[\n{\"name\":\"process_name\","
+			"\"ph\":\"M\",\"pid\":%d,\"args\":{\"name\":\"MysoreScript\"}}",
+			pid);
+	previousGCEvent = GC_get_on_collection_event();
+	GC_set_on_collection_event(gcEvent);
+	traceCalls = calls;
+	active = true;
+	return true;
+}
+
+void stop()
+{
+	if (!active)
+	{
+		return;
+	}
+	active = false;
+	traceCalls = false;
+	GC_set_on_collection_event(previousGCEvent);
+	std::lock_guard<std::mutex> guard(traceLock);
+	fputs("\n]}\n", traceFile);
+	fclose(traceFile);
+	traceFile = nullptr;
+}
+
+double now()
+{
+	std::chrono::duration<double, std::micro> elapsed =
+		std::chrono::steady_clock::now() - startTime;
+	return elapsed.count();
+}
+
+void complete(const char *category, const std::string &name, double start)
+{
+	char duration[64];
+	snprintf(duration, sizeof(duration), ",\"dur\":%.3f", now() - start);
+	writeEvent(category, name, 'X', start, duration);
+}
+}
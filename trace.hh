@@ -0,0 +1,85 @@
+#pragma once
+#include <string>
+
+/**
+ * A timeline tracer.  While tracing is active, parsing, JIT compilation,
+ * garbage collection and (optionally) calls made from top-level code are
+ * recorded as timestamped spans, in the Chrome trace event format.  The output
+ * can be loaded into chrome://tracing or Perfetto.
+ */
+namespace Trace
+{
+	/**
+	 * Is a trace being recorded?
+	 */
+	extern bool active;
+	/**
+	 * Should calls made from top-level code be recorded?
+	 */
+	extern bool traceCalls;
+	/**
+	 * Start recording a trace into the named file.  Returns false if the file
+	 * can not be opened.
+	 */
+	bool start(const char *file, bool calls);
+	/**
+	 * Finish the trace and close the file.
+	 */
+	void stop();
+	/**
+	 * Returns the time since tracing started, in microseconds.
+	 */
+	double now();
+	/**
+	 * Record a complete span that began at `start` (as returned by `now()`)
+	 * and ends now.
+	 */
+	void complete(const char *category, const std::string &name, double start);
+	/**
+	 * A span that lasts for the lifetime of this object.  Nothing is recorded
+	 * if tracing was not active when it was constructed.
+	 */
+	class Span
+	{
+		/**
+		 * The category of this span.
+		 */
+		const char *category;
+		/**
+		 * The name of this span.
+		 */
+		std::string name;
+		/**
+		 * The time at which this span started, or a negative value if it is
+		 * not being recorded.
+		 */
+		double startTime = -1;
+		public:
+		/**
+		 * Start a span with the specified category and name.
+		 */
+		Span(const char *cat, const std::string &n) : category(cat)
+		{
+			if (active)
+			{
+				name = n;
+				startTime = now();
+			}
+		}
+		/**
+		 * End the span now, rather than when it is destroyed.
+		 */
+		void end()
+		{
+			if (startTime >= 0)
+			{
+				complete(category, name, startTime);
+				startTime = -1;
+			}
+		}
+		/**
+		 * Ends the span, if it has not already been ended.
+		 */
+		~Span() { end(); }
+	};
+}